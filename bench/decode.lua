@@ -0,0 +1,140 @@
+-- =================================================================
+-- 
+-- decode.lua
+-- Offline decoding benchmark for luapsql: times result set access on
+-- synthetic results built with psql.makeresult (no server needed)
+-- See Copyright Notice at the bottom of psql.c
+--
+-- Usage: lua bench/decode.lua [nrows [seconds]]
+-- Output: tab-separated lines "case op rows/s bytes/s"
+--
+-- ==================================================================
+
+local psql = require "psql"
+local clock = os.clock
+local floor = math.floor
+
+local NROWS = tonumber(arg and arg[1]) or 10000
+local MINTIME = tonumber(arg and arg[2]) or 0.5
+
+-- type oids
+local INT4, INT8, FLOAT8, TEXT, BYTEA = 23, 20, 701, 25, 17
+local TIMESTAMP, INT4ARRAY = 1114, 1007
+local PAIR = 99999 -- synthetic registered type: two big-endian int16
+
+local pair = {}
+pair.__index = pair
+pair.__recv = function (s)
+  local a, b, c, d = s:byte(1, 4)
+  return setmetatable({a * 256 + b, c * 256 + d}, pair)
+end
+pair.__send = function (p)
+  return string.char(floor(p[1] / 256), p[1] % 256,
+    floor(p[2] / 256), p[2] % 256)
+end
+psql.register(PAIR, pair)
+
+local TEXTVALUE = string.rep("x", 32)
+local BYTEAVALUE = string.rep("\0\1\2\3", 16)
+local ARRAYVALUE = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10}
+
+-- columns: type, value of row i, encoded size
+local columns = {
+  int4 = {INT4, function (i) return i end, 4},
+  int8 = {INT8, function (i) return i * 1000003 end, 8},
+  float8 = {FLOAT8, function (i) return i / 7 end, 8},
+  text = {TEXT, function () return TEXTVALUE end, #TEXTVALUE},
+  bytea = {BYTEA, function () return BYTEAVALUE end, #BYTEAVALUE},
+  timestamp = {TIMESTAMP, function (i) return 946684800 + i end, 8},
+  int4array = {INT4ARRAY, function () return ARRAYVALUE end,
+    12 + 8 + #ARRAYVALUE * 8},
+  pair = {PAIR, function (i) return setmetatable({i % 1000, 7}, pair) end, 4},
+}
+
+local cases = {
+  {"int4", {"int4"}},
+  {"int8", {"int8"}},
+  {"float8", {"float8"}},
+  {"text", {"text"}},
+  {"bytea", {"bytea"}},
+  {"timestamp", {"timestamp"}},
+  {"int4array", {"int4array"}},
+  {"registered", {"pair"}},
+  {"mixed", {"int4", "int8", "float8", "text", "bytea", "timestamp"}},
+}
+
+local function makeresult (names)
+  local types, rows, rowsize = {}, {}, 0
+  for f, name in ipairs(names) do
+    types[f] = columns[name][1]
+    rowsize = rowsize + columns[name][3]
+  end
+  for i = 1, NROWS do
+    local row = {}
+    for f, name in ipairs(names) do row[f] = columns[name][2](i) end
+    rows[i] = row
+  end
+  return psql.makeresult(types, rows, names), rowsize
+end
+
+-- operations: decode every value of rset once
+local ops = {}
+
+function ops.fetch (rset)
+  for _ in rset:fetch() do end
+end
+
+function ops.rows (rset, names)
+  local n = #names
+  for _, t in rset:rows() do
+    for f = 1, n do local _ = t[names[f]] end
+  end
+end
+
+function ops.index (rset, names)
+  local n = #names
+  for i = 1, #rset do
+    local t = rset[i]
+    for f = 1, n do local _ = t[names[f]] end
+  end
+end
+
+function ops.totable (rset)
+  rset:totable()
+end
+
+function ops.columns (rset)
+  rset:columns()
+end
+
+local NUMERIC = {int4 = true, int8 = true, float8 = true}
+function ops.column_buffer (rset, names)
+  for f = 1, #names do
+    if not NUMERIC[names[f]] then return false end
+  end
+  for f = 1, #names do rset:column_buffer(f) end
+end
+
+local OPS = {"fetch", "rows", "index", "totable", "columns", "column_buffer"}
+
+io.write("case\top\trows/s\tbytes/s\n")
+for _, case in ipairs(cases) do
+  local name, names = case[1], case[2]
+  local rset, rowsize = makeresult(names)
+  assert(#rset == NROWS and rset:status() == "PGRES_TUPLES_OK")
+  for _, op in ipairs(OPS) do
+    if ops[op](rset, names) ~= false then -- warm up and check support
+      local reps, elapsed, start = 0, 0, clock()
+      repeat
+        ops[op](rset, names)
+        reps = reps + 1
+        elapsed = clock() - start
+      until elapsed >= MINTIME
+      local rate = reps * NROWS / elapsed
+      io.write(string.format("%s\t%s\t%.0f\t%.0f\n", name, op, rate,
+        rate * rowsize))
+    end
+  end
+  rset = nil
+  collectgarbage()
+end
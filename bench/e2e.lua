@@ -0,0 +1,117 @@
+-- =================================================================
+-- 
+-- e2e.lua
+-- End-to-end throughput benchmark for luapsql against a live server
+-- See Copyright Notice at the bottom of psql.c
+--
+-- Usage: lua bench/e2e.lua conninfo [nrows [seconds [poolsize]]]
+-- (bench/e2e.sh runs it against a throwaway server)
+-- Output: tab-separated lines "metric value unit"
+--
+-- ==================================================================
+
+local psql = require "psql"
+local clock = psql.clock -- monotonic, in seconds
+
+local conninfo = assert(arg[1], "conninfo expected")
+local NROWS = tonumber(arg[2]) or 100000
+local SECONDS = tonumber(arg[3]) or 2
+local POOLSIZE = tonumber(arg[4]) or 8
+local BATCH = 1000 -- rows per execmany call
+
+-- count per second since start
+local function report (metric, count, start, unit)
+  io.write(string.format("%s\t%.0f\t%s\n", metric, count / (clock() - start),
+    unit))
+end
+
+local function check (conn, rset)
+  local status = rset and rset:status()
+  assert(status == "PGRES_COMMAND_OK" or status == "PGRES_TUPLES_OK",
+    conn:error())
+  return rset
+end
+
+local conn = assert(psql.connect(conninfo))
+assert(select(2, conn:status()) == "CONNECTION_OK", conn:error())
+check(conn, conn:exec"SET client_min_messages = warning")
+check(conn, conn:exec"DROP TABLE IF EXISTS bench_kv")
+check(conn, conn:exec("CREATE UNLOGGED TABLE bench_kv " ..
+  "(id int4 PRIMARY KEY, n int8, x float8, v text)"))
+
+local PAYLOAD = string.rep("v", 40)
+
+-- bulk insert through binary COPY
+local start = clock()
+local copy = assert(conn:copyin("COPY bench_kv FROM STDIN (FORMAT binary)",
+  {23, 20, 701, 25}))
+for i = 1, NROWS do assert(copy:put(i, i * 3, i / 7, PAYLOAD)) end
+check(conn, copy:finish())
+report("bulk_insert_copy", NROWS, start, "rows/s")
+
+-- bulk insert through pipelined plan:execmany
+check(conn, conn:exec"TRUNCATE bench_kv")
+local insert = assert(conn:prepare(
+  "INSERT INTO bench_kv VALUES ($1, $2, $3, $4)", "bench_insert"))
+start = clock()
+for i = 1, NROWS, BATCH do
+  local rows = {}
+  for k = i, math.min(i + BATCH - 1, NROWS) do
+    rows[#rows + 1] = {k, k * 3, k / 7, PAYLOAD}
+  end
+  local rsets = assert(insert:execmany(rows))
+  check(conn, rsets[#rsets])
+end
+report("bulk_insert_execmany", NROWS, start, "rows/s")
+check(conn, conn:exec"VACUUM ANALYZE bench_kv")
+
+-- point selects through plan:exec
+local select1 = assert(conn:prepare(
+  "SELECT n, x, v FROM bench_kv WHERE id = $1", "bench_select"))
+local n = 0
+start = clock()
+repeat
+  for k = 1, 100 do
+    local r = select1:exec((n + k) % NROWS + 1)
+    assert(r[1].n ~= nil)
+  end
+  n = n + 100
+until clock() - start >= SECONDS
+report("point_select", n, start, "queries/s")
+
+-- large scan, whole result and streamed
+n = 0
+start = clock()
+repeat
+  local r = check(conn, conn:exec"SELECT * FROM bench_kv")
+  for _ in r:fetch() do n = n + 1 end
+until clock() - start >= SECONDS
+report("scan_exec", n, start, "rows/s")
+
+n = 0
+start = clock()
+repeat
+  for _ in conn:stream("SELECT * FROM bench_kv", nil, 1000) do n = n + 1 end
+until clock() - start >= SECONDS
+report("scan_stream", n, start, "rows/s")
+
+-- async fan-out over the pool
+local pool = assert(psql.pool(conninfo, POOLSIZE))
+n = 0
+start = clock()
+repeat
+  for k = 1, 1000 do
+    pool:submit(string.format("SELECT n, x, v FROM bench_kv WHERE id = %d",
+      (n + k) % NROWS + 1))
+  end
+  for k = 1, 1000 do
+    local id, r = pool:wait()
+    assert(r[1].n ~= nil)
+  end
+  n = n + 1000
+until clock() - start >= SECONDS
+report("pool_fanout", n, start, "queries/s")
+pool:close()
+
+check(conn, conn:exec"DROP TABLE bench_kv")
+conn:finish()
@@ -0,0 +1,42 @@
+#!/bin/sh
+# =================================================================
+#
+# e2e.sh
+# Run bench/e2e.lua against a throwaway PostgreSQL cluster
+# See Copyright Notice at the bottom of psql.c
+#
+# Usage: bench/e2e.sh [nrows [seconds [poolsize]]]
+# Environment:
+#   LUA        Lua interpreter (default: lua)
+#   PGBIN      directory with initdb and pg_ctl (default: from PATH)
+#   LUA_CPATH  where to find psql.so; psql.so in the top directory (as
+#              built by etc/Makefile) is tried first, then an installed
+#              module (luarocks)
+#
+# ==================================================================
+
+set -e
+
+LUA=${LUA:-lua}
+if [ -n "$PGBIN" ]; then PATH="$PGBIN:$PATH"; fi
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/luapsql-bench.XXXXXX")
+
+cleanup () {
+  pg_ctl -D "$TMP/data" -m immediate stop >/dev/null 2>&1 || true
+  rm -rf "$TMP"
+}
+trap cleanup EXIT INT TERM
+
+initdb -D "$TMP/data" -U bench -A trust -E UTF8 --no-sync \
+  >"$TMP/initdb.log" 2>&1 || { cat "$TMP/initdb.log" >&2; exit 1; }
+pg_ctl -D "$TMP/data" -l "$TMP/postgres.log" -w \
+  -o "-k $TMP -h '' -c fsync=off -c synchronous_commit=off" start >/dev/null \
+  || { cat "$TMP/postgres.log" >&2; exit 1; }
+
+if [ -f "$TOP/psql.so" ]; then
+  LUA_CPATH="$TOP/?.so;${LUA_CPATH:-;}"
+  export LUA_CPATH
+fi
+
+$LUA "$TOP/bench/e2e.lua" "host=$TMP user=bench dbname=postgres" "$@"
@@ -0,0 +1,52 @@
+-- =================================================================
+-- 
+-- aexec.lua
+-- Coroutine-yielding queries for Lua 5.1, where conn:aexec and
+-- plan:aexec are not available; uses the native ones otherwise
+-- See Copyright Notice at the bottom of psql.c
+--
+-- ==================================================================
+
+local yield = coroutine.yield
+
+local M = {}
+
+-- collect results of query sent on conn, yielding while busy
+local function collect (conn)
+  local last
+  while true do
+    local ok, e = conn:consume()
+    if not ok then return nil, e end
+    if conn:isbusy() then
+      yield(conn:socket(), "read")
+    else
+      local rset = conn:getresult()
+      if rset == nil then break end
+      last = rset
+      local status = rset:status()
+      if status == "PGRES_COPY_IN" or status == "PGRES_COPY_OUT"
+          or status == "PGRES_COPY_BOTH" then
+        break
+      end
+    end
+  end
+  return last
+end
+
+-- exec(conn, cmd): same as conn:aexec(cmd)
+function M.exec (conn, cmd)
+  if conn.aexec then return conn:aexec(cmd) end
+  local ok, e = conn:query(cmd)
+  if not ok then return nil, e end
+  return collect(conn)
+end
+
+-- execplan(conn, plan, ...): same as plan:aexec(...); conn is plan's
+function M.execplan (conn, plan, ...)
+  if plan.aexec then return plan:aexec(...) end
+  local ok, e = plan:query(...)
+  if not ok then return nil, e end
+  return collect(conn)
+end
+
+return M
@@ -1,9 +1,6 @@
 #include <lua.h>
 #include <lauxlib.h>
-#include <postgres.h>
-
-#define LPQ_REGMT_RECV  "__recv"
-#define LPQ_REGMT_SEND  "__send"
+#include "lpqtype.h"
 
 #if LUA_VERSION_NUM <= 501
 #define lregister(L,l,n) luaL_openlib(L,NULL,l,n)
@@ -11,15 +8,19 @@
 #define lregister luaL_setfuncs
 #endif
 
+typedef int int32;
+
 typedef struct {
   int32 low;
   int32 high;
 } int_interval;
 
-static int_interval *newintinterval (lua_State *L, int32 low, int32 high) {
+/* mt: stack index of int_interval metatable */
+static int_interval *newintinterval (lua_State *L, int32 low, int32 high,
+                                     int mt) {
   int_interval *ii = (int_interval *) lua_newuserdata(L,
       sizeof(int_interval));
-  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushvalue(L, mt);
   lua_setmetatable(L, -2);
   ii->low = low;
   ii->high = high;
@@ -27,7 +28,8 @@ static int_interval *newintinterval (lua_State *L, int32 low, int32 high) {
 }
 
 static int intinterval_call (lua_State *L) {
-  newintinterval(L, luaL_optinteger(L, 1, 0), luaL_optinteger(L, 2, 0));
+  newintinterval(L, luaL_optinteger(L, 1, 0), luaL_optinteger(L, 2, 0),
+      lua_upvalueindex(1));
   return 1;
 }
 
@@ -45,7 +47,8 @@ static uint32 getuint32 (const char *v) {
 static int intinterval__recv (lua_State *L) {
   const char *s = luaL_checkstring(L, 1);
   newintinterval(L, (int32) getuint32(&s[0]), /* low */
-      (int32) getuint32(&s[4])); /* high */
+      (int32) getuint32(&s[4]), /* high */
+      lua_upvalueindex(1));
   return 1;
 }
 
@@ -64,8 +67,28 @@ static int intinterval__send (lua_State *L) {
   return 1;
 }
 
+/* C codec, used by psql instead of __recv and __send */
+static int intinterval_recv (lua_State *L, const char *value, int length,
+                             int mod) {
+  (void) mod;
+  if (length != 8) return 0;
+  newintinterval(L, (int32) getuint32(&value[0]),
+      (int32) getuint32(&value[4]), lua_gettop(L));
+  return 1;
+}
+
+static int intinterval_send (lua_State *L, int narg, luaL_Buffer *b) {
+  int_interval *ii = (int_interval *) lua_touserdata(L, narg);
+  senduint32(b, (uint32) ii->low);
+  senduint32(b, (uint32) ii->high);
+  return 8;
+}
+
+static const lpq_Codec intinterval_codec = {LPQ_CODEC_VERSION,
+  intinterval_recv, intinterval_send};
+
 
-static const luaL_reg pqtype_intinterval_mt[] = {
+static const luaL_Reg pqtype_intinterval_mt[] = {
   {"__tostring", intinterval__tostring},
   {LPQ_REGMT_SEND, intinterval__send},
   {LPQ_REGMT_RECV, intinterval__recv},
@@ -76,7 +99,9 @@ int luaopen_pqtype_intinterval (lua_State *L) {
   lua_newtable(L);
   lua_pushvalue(L, -1);
   lregister(L, pqtype_intinterval_mt, 1);
-  lua_pushcfunction(L, intinterval_call);
+  lua_pushlightuserdata(L, (void *) &intinterval_codec);
+  lua_setfield(L, -2, LPQ_REGMT_CODEC);
+  lua_pushcclosure(L, intinterval_call, 1);
   return 1;
 }
 
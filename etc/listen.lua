@@ -14,16 +14,6 @@ local setmetatable, tostring = setmetatable, tostring
 module(...)
 local mt = {__index = _M}
 
-local function notify (o)
-  local conn = o.conn
-  while true do
-    local c, _, payload = conn:notifies()
-    if c == nil then break end
-    local cb = o.channel[c]
-    if cb ~= nil then cb(payload, c) end
-  end
-end
-
 function new (info)
   local c = assert(psql_connect(info))
   return setmetatable({conn = c, channel = {}}, mt), c:status()
@@ -35,6 +25,7 @@ function listen (o, c, cb)
   local rset = conn:exec("LISTEN " .. c)
   assert(rset:status() == "PGRES_COMMAND_OK", conn:error())
   o.channel[c] = cb
+  conn:onnotify(c, cb) -- cb(payload, channel, pid)
 end
 
 function unlisten (o, c)
@@ -43,19 +34,25 @@ function unlisten (o, c)
     local rset = conn:exec("UNLISTEN " .. c)
     assert(rset:status() == "PGRES_COMMAND_OK", conn:error())
     o.channel[c] = nil
+    conn:onnotify(c, nil)
   end
 end
 
 function exec (o, cmd)
   local conn = o.conn
   local rset = conn:exec(cmd)
-  notify(o) -- check notifications
+  conn:dispatch(0) -- check notifications
   return rset
 end
 
 function check (o)
-  local conn = o.conn
-  assert(conn:consume())
-  notify(o)
+  assert(o.conn:dispatch(0))
+end
+
+-- wait up to timeout seconds (forever if nil) for notifications and route
+-- them; if batch, callbacks get arrays with all payloads and pids of their
+-- channel instead
+function wait (o, timeout, batch)
+  return o.conn:dispatch(timeout, batch)
 end
 
@@ -29,6 +29,21 @@ typedef double float8;
 #define LPQ_REGMT_OID   "__oid"
 #define LPQ_REGMT_RECV  "__recv"
 #define LPQ_REGMT_SEND  "__send"
+#define LPQ_REGMT_CODEC "__codec" /* lightuserdata to lpq_Codec, optional */
+
+/* C codec of a registered type, used before __recv and __send:
+ * recv is called with the registered metatable on top of the stack and
+ * pushes the value decoded from length bytes at value, or returns 0 to fall
+ * back to __recv; send adds the encoding of the value at narg, known to have
+ * the registered metatable, to b and returns its length, or returns -1
+ * before adding anything to fall back to __send. Codecs must leave the stack
+ * otherwise unchanged. */
+#define LPQ_CODEC_VERSION 1
+typedef struct lpq_Codec_struct {
+  int version; /* LPQ_CODEC_VERSION */
+  int (*recv) (lua_State *L, const char *value, int length, int mod);
+  int (*send) (lua_State *L, int narg, luaL_Buffer *b);
+} lpq_Codec;
 
 /* recv */
 uint32 lpq_getuint32 (const char *v);
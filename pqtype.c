@@ -26,16 +26,17 @@
 typedef short int16;
 typedef unsigned short uint16;
 
-static int16 *newint2 (lua_State *L, int16 v) {
+/* mt: stack index of int2 metatable */
+static int16 *newint2 (lua_State *L, int16 v, int mt) {
   int16 *i = (int16 *) lua_newuserdata(L, sizeof(int16));
-  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushvalue(L, mt);
   lua_setmetatable(L, -2);
   *i = v;
   return i;
 }
 
 static int int2_call (lua_State *L) {
-  newint2(L, (int16) luaL_optinteger(L, 1, 0));
+  newint2(L, (int16) luaL_optinteger(L, 1, 0), lua_upvalueindex(1));
   return 1;
 }
 
@@ -52,7 +53,7 @@ static int16 getint16 (const char *s) {
 }
 
 static int int2__recv (lua_State *L) {
-  newint2(L, getint16(luaL_checkstring(L, 1)));
+  newint2(L, getint16(luaL_checkstring(L, 1)), lua_upvalueindex(1));
   return 1;
 }
 
@@ -70,6 +71,21 @@ static int int2__send (lua_State *L) {
   return 1;
 }
 
+/* C codec: same as __recv and __send without Lua strings */
+static int int2_recv (lua_State *L, const char *value, int length, int mod) {
+  (void) mod;
+  if (length != sizeof(int16)) return 0;
+  newint2(L, getint16(value), lua_gettop(L));
+  return 1;
+}
+
+static int int2_send (lua_State *L, int narg, luaL_Buffer *b) {
+  sendint16(b, *(int16 *) lua_touserdata(L, narg));
+  return sizeof(int16);
+}
+
+static const lpq_Codec int2_codec = {LPQ_CODEC_VERSION, int2_recv, int2_send};
+
 
 static const luaL_Reg pqtype_int2_mt[] = {
   {"__tostring", int2__tostring},
@@ -82,6 +98,8 @@ int luaopen_pqtype_int2 (lua_State *L) {
   luaL_newlibtable(L, pqtype_int2_mt);
   lua_pushvalue(L, -1);
   registerlib(L, pqtype_int2_mt, 1);
+  lua_pushlightuserdata(L, (void *) &int2_codec);
+  lua_setfield(L, -2, LPQ_REGMT_CODEC);
   lua_pushcclosure(L, int2_call, 1);
   return 1;
 }
@@ -93,9 +111,10 @@ typedef struct {
   double y;
 } point;
 
-static point *newpoint (lua_State *L, double x, double y) {
+/* mt: stack index of point metatable */
+static point *newpoint (lua_State *L, double x, double y, int mt) {
   point *p = (point *) lua_newuserdata(L, sizeof(point));
-  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushvalue(L, mt);
   lua_setmetatable(L, -2);
   p->x = x;
   p->y = y;
@@ -103,7 +122,8 @@ static point *newpoint (lua_State *L, double x, double y) {
 }
 
 static int point_call (lua_State *L) {
-  newpoint(L, luaL_optnumber(L, 1, 0), luaL_optnumber(L, 2, 0));
+  newpoint(L, luaL_optnumber(L, 1, 0), luaL_optnumber(L, 2, 0),
+      lua_upvalueindex(1));
   return 1;
 }
 
@@ -117,7 +137,8 @@ static int point__tostring (lua_State *L) {
 static int point__recv (lua_State *L) {
   const char *s = luaL_checkstring(L, 1);
   newpoint(L, (double) lpq_getfloat8(&s[0]), /* x */
-      (double) lpq_getfloat8(&s[8])); /* y */
+      (double) lpq_getfloat8(&s[8]), /* y */
+      lua_upvalueindex(1));
   return 1;
 }
 
@@ -131,6 +152,25 @@ static int point__send (lua_State *L) {
   return 1;
 }
 
+/* C codec */
+static int point_recv (lua_State *L, const char *value, int length, int mod) {
+  (void) mod;
+  if (length != 2 * sizeof(float8)) return 0;
+  newpoint(L, (double) lpq_getfloat8(&value[0]),
+      (double) lpq_getfloat8(&value[8]), lua_gettop(L));
+  return 1;
+}
+
+static int point_send (lua_State *L, int narg, luaL_Buffer *b) {
+  point *p = (point *) lua_touserdata(L, narg);
+  lpq_sendfloat8(b, p->x);
+  lpq_sendfloat8(b, p->y);
+  return 2 * sizeof(float8);
+}
+
+static const lpq_Codec point_codec = {LPQ_CODEC_VERSION, point_recv,
+  point_send};
+
 
 static const luaL_Reg pqtype_point_mt[] = {
   {"__tostring", point__tostring},
@@ -143,6 +183,8 @@ int luaopen_pqtype_point (lua_State *L) {
   luaL_newlibtable(L, pqtype_point_mt);
   lua_pushvalue(L, -1);
   registerlib(L, pqtype_point_mt, 1);
+  lua_pushlightuserdata(L, (void *) &point_codec);
+  lua_setfield(L, -2, LPQ_REGMT_CODEC);
   lua_pushcclosure(L, point_call, 1);
   return 1;
 }
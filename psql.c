@@ -11,26 +11,99 @@
 #include <lua.h>
 #include <lauxlib.h>
 
-#include <stdlib.h> /* atoi */
+#include <errno.h>
+#include <math.h> /* HUGE_VAL, floor */
+#include <stdio.h> /* sprintf */
+#include <stdlib.h> /* atoi, strtod */
 #include <string.h> /* memcpy */
 #include "lpqtype.h"
 #include <libpq-fe.h>
-#include <libpqtypes.h>
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+#include <poll.h>
+#include <time.h> /* clock_gettime */
+#define lpq_poll poll
+#else
+#define lpq_poll WSAPoll /* winsock2.h from lpqtype.h */
+#include <ws2tcpip.h> /* inet_ntop, inet_pton */
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h> /* close */
+#define LPQ_HAS_EPOLL
+#endif
 
 #define PSQL_NAME       "psql"
 #define LPQ_CONN_NAME   "connection"
 #define LPQ_PLAN_NAME   "plan"
 #define LPQ_RSET_NAME   "result set"
 #define LPQ_TUPLE_NAME  "tuple"
+#define LPQ_COPY_NAME   "copy"
+#define LPQ_STREAM_NAME "stream"
+#define LPQ_BUFFER_NAME "column buffer"
+#define LPQ_VIEW_NAME   "view"
+#define LPQ_RANGE_NAME  "range"
+#define LPQ_POOL_NAME   "pool"
+#define LPQ_POOL_QUEUE  "queue" /* in pool userdata environment */
 #define LPQ_RSET_FIELDS "fields" /* in result set userdata environment */
+#define LPQ_CONN_CACHE  "cache" /* in connection userdata environment */
+#define LPQ_CONN_NOTIFY "notify" /* in connection userdata environment */
+#define LPQ_CONN_UNROUTED "unrouted" /* in connection userdata environment */
+/* enum, domain and composite types outside pg_catalog, with attributes */
+#define LPQ_CATALOG_QUERY \
+  "SELECT t.oid, t.typtype, t.typbasetype, t.typarray, t.typname," \
+  " a.attname, a.atttypid FROM pg_type t" \
+  " JOIN pg_namespace n ON n.oid = t.typnamespace" \
+  " LEFT JOIN pg_attribute a ON a.attrelid = t.typrelid" \
+  " AND a.attnum > 0 AND NOT a.attisdropped" \
+  " WHERE t.typtype IN ('e', 'd', 'c') AND n.nspname <> 'pg_catalog'" \
+  " AND n.nspname NOT LIKE 'pg_toast%' ORDER BY t.oid, a.attnum"
+#define LPQ_TRACE_LATENCY "latency" /* in connection trace table */
+#define LPQ_TRACE_SLOWLOG "slowlog"
+#define LPQ_CACHE_SIZE  128 /* default #statements cached by conn:execp */
+#define LPQ_LATENCY_SIZE  256 /* default #statements with histograms */
+#define LPQ_COPY_BUFSIZE (1 << 18) /* flush threshold for COPY data */
+#define LPQ_COPY_SIGLEN  11 /* binary COPY signature */
+
 
+typedef struct lpq_Plan_struct lpq_Plan;
+typedef struct lpq_Column_struct lpq_Column;
+typedef void (*lpq_Decoder) (lua_State *L, const lpq_Column *c,
+                             const char *value, int length, int row);
+
+/* counters shared by a connection and its result sets */
+typedef struct lpq_Stats_struct {
+  int refs;
+  double queries; /* sent */
+  double results; /* received */
+  double rows;
+  double bytes; /* of received values */
+  double parambytes; /* of parameters sent */
+  double prepares; /* prepare and describe round trips */
+  double exectime; /* ms blocked in PQexec*, PQprepare and PQdescribe* */
+  double decodetime; /* ms decoding values */
+} lpq_Stats;
 
 typedef struct lpq_Conn_struct {
   PGconn *conn;
   int done;
+  lpq_Stats *stats;
+  int trace; /* registry ref to latency histograms and slow hook */
+  int latency; /* max #statements with latency histograms, or 0 */
+  int nlatency; /* #statements with latency histograms */
+  double slowms; /* slow query threshold, or < 0 */
+  int viewsize; /* min length of values returned as views, or 0 */
+  int types; /* registry ref to type catalog, or LUA_NOREF */
+  lpq_Decoder numeric; /* for numeric values */
+  lpq_Decoder timestamp; /* for timestamp and timestamptz values */
+  /* statements prepared by conn:execp, most recently used first */
+  lpq_Plan *head;
+  lpq_Plan *tail;
+  int ncached;
+  int maxcached;
+  int nextid; /* for statement names */
 } lpq_Conn;
 
-typedef struct lpq_Plan_struct {
+struct lpq_Plan_struct {
   lpq_Conn *conn;
   const char *name;
   int n; /* #params */
@@ -39,10 +112,31 @@ typedef struct lpq_Plan_struct {
   int *length;
   int *format;
   int valid; /* referenced conn valid? */
-} lpq_Plan;
+  /* if cached: statement is key in conn cache */
+  const char *stmt;
+  size_t stmtlen;
+  lpq_Plan *prev;
+  lpq_Plan *next;
+};
+
+struct lpq_Column_struct {
+  Oid type;
+  int mod;
+  lpq_Decoder decode; /* resolved once per column */
+  int ref; /* registered type MT or result anchor in registry, or LUA_NOREF */
+  const lpq_Codec *codec; /* of registered type, or NULL */
+  int viewsize; /* for lpq_decodeview */
+  lpq_Column *elem; /* element column for arrays, fields for records */
+  int n; /* #elem */
+};
 
 typedef struct lpq_Rset_struct {
   PGresult *result;
+  ExecStatusType status; /* of result, for __gc after anchor is cleared */
+  lpq_Stats *stats; /* of connection, or NULL */
+  int anchored; /* result owned by anchor shared with views? */
+  int n; /* #columns */
+  lpq_Column *col;
 } lpq_Rset;
 
 typedef struct lpq_Tuple_struct {
@@ -51,6 +145,91 @@ typedef struct lpq_Tuple_struct {
   int valid; /* referenced rset valid? */
 } lpq_Tuple;
 
+typedef struct lpq_Copy_struct {
+  lpq_Conn *conn; /* kept alive in copy userdata environment */
+  int n; /* #columns */
+  int binary; /* binary COPY format? */
+  int out; /* COPY TO STDOUT? */
+  int done;
+  int row; /* rows read; -1 if binary header is pending */
+  lpq_Column *col; /* decoders for COPY TO STDOUT */
+  Oid *type;
+  int *length;
+  char *buf; /* pending COPY data */
+  size_t used;
+  size_t size;
+} lpq_Copy;
+
+typedef struct lpq_Stream_struct {
+  lpq_Conn *conn; /* kept alive in stream userdata environment */
+  PGresult *result; /* current row or chunk of rows */
+  int row; /* next row in result */
+  int count; /* rows returned */
+  int done;
+  int n; /* #columns */
+  lpq_Column *col; /* resolved from first result */
+} lpq_Stream;
+
+
+typedef struct lpq_PoolSlot_struct {
+  lpq_Conn *conn; /* kept alive in pool userdata environment */
+  int id; /* query in flight, or 0 */
+  int leased; /* handed out by pool:acquire? */
+  PGresult *result; /* last result of query in flight */
+  int copy; /* 1 while discarding COPY data, 2 after */
+} lpq_PoolSlot;
+
+typedef struct lpq_Pool_struct {
+  int n; /* #connections */
+  int maxinflight;
+  int inflight;
+  int nextid; /* last submitted query */
+  int dispatched; /* last query sent; queue holds the ones after it */
+  int nidle; /* #slots in idle stack */
+  int nready; /* #slots in ready stack */
+  int epfd; /* epoll instance, or -1 */
+  int closed;
+  lpq_PoolSlot *slot;
+  int *idle; /* slots without query and not leased */
+  int *ready; /* slots with finished query */
+  struct pollfd *pfd; /* for poll fallback */
+} lpq_Pool;
+
+typedef struct lpq_Buffer_struct {
+  Oid type;
+  int n; /* #values */
+  int elemsize;
+  char *data; /* n values in native byte order, NULLs as zero */
+  unsigned char *nulls; /* bit i - 1 set if value i is NULL, or NULL */
+} lpq_Buffer;
+#define LPQ_BUFFER_HDRSIZE ((sizeof(lpq_Buffer) + 7) & ~(size_t) 7)
+
+/* value in a result, kept alive by anchor in userdata environment */
+typedef struct lpq_View_struct {
+  const char *data;
+  size_t length;
+} lpq_View;
+
+/* bound of range, for range parameters and methods */
+typedef struct lpq_Bound_struct {
+  int value; /* stack position, or 0 if infinite */
+  int inclusive;
+  int lower; /* lower bound? */
+} lpq_Bound;
+
+/* log-bucketed latency histogram (in microseconds): values below
+ * LPQ_HIST_SUB are exact, then each power of 2 is split into LPQ_HIST_SUB
+ * buckets, for a relative error below 1/LPQ_HIST_SUB up to 2^32 us */
+#define LPQ_HIST_SUBBITS 3
+#define LPQ_HIST_SUB (1 << LPQ_HIST_SUBBITS)
+#define LPQ_HIST_SIZE ((32 - LPQ_HIST_SUBBITS + 1) * LPQ_HIST_SUB)
+
+typedef struct lpq_Hist_struct {
+  unsigned int count;
+  double max;
+  unsigned int bucket[LPQ_HIST_SIZE];
+} lpq_Hist;
+
 
 /* =======   Auxiliar   ======= */
 
@@ -64,6 +243,11 @@ typedef struct lpq_Tuple_struct {
 #else
 #define lpq_registerlib luaL_setfuncs
 #endif
+#if LUA_VERSION_NUM <= 501
+#define lpq_lessthan lua_lessthan
+#else
+#define lpq_lessthan(L,a,b) lua_compare(L,a,b,LUA_OPLT)
+#endif
 
 static int lpq_typeerror (lua_State *L, int narg, const char *tname) {
   const char *msg = lua_pushfstring(L, "%s expected, got %s", tname,
@@ -77,6 +261,7 @@ static int lpq_typeerror (lua_State *L, int narg, const char *tname) {
 #define CHAROID    18
 #define NAMEOID    19
 #define INT8OID    20
+#define INT2OID    21
 #define INT4OID    23
 #define TEXTOID    25 /* ignore encoding for now */
 #define OIDOID     26
@@ -86,11 +271,28 @@ static int lpq_typeerror (lua_State *L, int narg, const char *tname) {
 #define VARCHAROID 1043
 #define REGCLASSOID 2205
 #define TIMESTAMPOID 1114
-// oops these are the same
-#define INTERVALOID 1184
 #define TIMESTAMPTZOID 1184
+#define INTERVALOID 1186
+#define NUMERICOID 1700
+#define DATEOID 1082
+#define TIMEOID 1083
+#define UUIDOID 2950
+#define INETOID 869
+#define CIDROID 650
 #define JSONOID 114
+#define UNKNOWNOID 705
+#define RECORDOID 2249
+#define RECORDARRAYOID 2287
 // array oid types
+#define JSONARRAYOID 199
+#define BOOLARRAYOID 1000
+#define BYTEAARRAYOID 1001
+#define CHARARRAYOID 1002
+#define NAMEARRAYOID 1003
+#define TEXTARRAYOID 1009
+#define BPCHARARRAYOID 1014
+#define OIDARRAYOID 1028
+#define REGCLASSARRAYOID 2210
 #define VARCHARARRAYOID 1015
 #define INTEGERARRAYOID 1007
 #define BIGINTEGERARRAYOID 1016
@@ -98,10 +300,140 @@ static int lpq_typeerror (lua_State *L, int narg, const char *tname) {
 #define TIMESTAMPTZARRAYOID 1185
 #define FLOAT4ARRAYOID 1021
 #define FLOAT8ARRAYOID 1022
+#define INT2ARRAYOID 1005
+#define NUMERICARRAYOID 1231
+#define DATEARRAYOID 1182
+#define TIMEARRAYOID 1183
+#define UUIDARRAYOID 2951
+#define INETARRAYOID 1041
+#define CIDRARRAYOID 651
+#define INTERVALARRAYOID 1187
+#define INT4RANGEOID 3904
+#define NUMRANGEOID 3906
+#define TSRANGEOID 3908
+#define TSTZRANGEOID 3910
+#define DATERANGEOID 3912
+#define INT8RANGEOID 3926
+#define INT4MULTIRANGEOID 4451
+#define NUMMULTIRANGEOID 4532
+#define TSMULTIRANGEOID 4533
+#define TSTZMULTIRANGEOID 4534
+#define DATEMULTIRANGEOID 4535
+#define INT8MULTIRANGEOID 4536
+#define INT4RANGEARRAYOID 3905
+#define NUMRANGEARRAYOID 3907
+#define TSRANGEARRAYOID 3909
+#define TSTZRANGEARRAYOID 3911
+#define DATERANGEARRAYOID 3913
+#define INT8RANGEARRAYOID 3927
+#define INT4MULTIRANGEARRAYOID 6150
+#define NUMMULTIRANGEARRAYOID 6151
+#define TSMULTIRANGEARRAYOID 6152
+#define TSTZMULTIRANGEARRAYOID 6153
+#define DATEMULTIRANGEARRAYOID 6155
+#define INT8MULTIRANGEARRAYOID 6157
+
+#define LPQ_ARRAY_MAXDIM 6 /* MAXDIM in utils/array.h */
+#define LPQ_EPOCH_OFFSET 946684800 /* 2000-01-01 in Unix time */
+#define LPQ_DAY_SECS 86400
+#define LPQ_TS_NOBEGIN (-0x7FFFFFFFFFFFFFFFLL - 1) /* -infinity */
+#define LPQ_TS_NOEND 0x7FFFFFFFFFFFFFFFLL
+#define LPQ_NBASE 10000 /* numeric digits */
+#define LPQ_NUMERIC_NEG  0x4000
+#define LPQ_NUMERIC_NAN  0xC000
+#define LPQ_NUMERIC_PINF 0xD000
+#define LPQ_NUMERIC_NINF 0xF000
+#define LPQ_AF_INET  2 /* PGSQL_AF_INET */
+#define LPQ_AF_INET6 3
+#define LPQ_RANGE_EMPTY  0x01 /* range flags, from utils/rangetypes.h */
+#define LPQ_RANGE_LB_INC 0x02
+#define LPQ_RANGE_UB_INC 0x04
+#define LPQ_RANGE_LB_INF 0x08
+#define LPQ_RANGE_UB_INF 0x10
+
+/* built-in array types and their element types */
+static const struct { Oid array, elem; } lpq_arraytypes[] = {
+  {BOOLARRAYOID, BOOLOID}, {BYTEAARRAYOID, BYTEAOID},
+  {CHARARRAYOID, CHAROID}, {NAMEARRAYOID, NAMEOID},
+  {INTEGERARRAYOID, INT4OID}, {BIGINTEGERARRAYOID, INT8OID},
+  {TEXTARRAYOID, TEXTOID}, {BPCHARARRAYOID, BPCHAROID},
+  {VARCHARARRAYOID, VARCHAROID}, {JSONARRAYOID, JSONOID},
+  {OIDARRAYOID, OIDOID}, {REGCLASSARRAYOID, REGCLASSOID},
+  {FLOAT4ARRAYOID, FLOAT4OID}, {FLOAT8ARRAYOID, FLOAT8OID},
+  {TIMESTAMPARRAYOID, TIMESTAMPOID}, {TIMESTAMPTZARRAYOID, TIMESTAMPTZOID},
+  {RECORDARRAYOID, RECORDOID}, {INT2ARRAYOID, INT2OID},
+  {NUMERICARRAYOID, NUMERICOID}, {DATEARRAYOID, DATEOID},
+  {TIMEARRAYOID, TIMEOID}, {UUIDARRAYOID, UUIDOID},
+  {INETARRAYOID, INETOID}, {CIDRARRAYOID, CIDROID},
+  {INTERVALARRAYOID, INTERVALOID},
+  {INT4RANGEARRAYOID, INT4RANGEOID}, {INT8RANGEARRAYOID, INT8RANGEOID},
+  {NUMRANGEARRAYOID, NUMRANGEOID}, {DATERANGEARRAYOID, DATERANGEOID},
+  {TSRANGEARRAYOID, TSRANGEOID}, {TSTZRANGEARRAYOID, TSTZRANGEOID},
+  {INT4MULTIRANGEARRAYOID, INT4MULTIRANGEOID},
+  {INT8MULTIRANGEARRAYOID, INT8MULTIRANGEOID},
+  {NUMMULTIRANGEARRAYOID, NUMMULTIRANGEOID},
+  {DATEMULTIRANGEARRAYOID, DATEMULTIRANGEOID},
+  {TSMULTIRANGEARRAYOID, TSMULTIRANGEOID},
+  {TSTZMULTIRANGEARRAYOID, TSTZMULTIRANGEOID},
+  {0, 0}
+};
 
+/* built-in range types, their element and multirange types */
+static const struct { Oid range, elem, multirange; } lpq_rangetypes[] = {
+  {INT4RANGEOID, INT4OID, INT4MULTIRANGEOID},
+  {INT8RANGEOID, INT8OID, INT8MULTIRANGEOID},
+  {NUMRANGEOID, NUMERICOID, NUMMULTIRANGEOID},
+  {DATERANGEOID, DATEOID, DATEMULTIRANGEOID},
+  {TSRANGEOID, TIMESTAMPOID, TSMULTIRANGEOID},
+  {TSTZRANGEOID, TIMESTAMPTZOID, TSTZMULTIRANGEOID},
+  {0, 0, 0}
+};
 
 static int lpq_type_mt_ = 0;
 #define LPQ_TYPE_MT ((void *) &lpq_type_mt_)
+static int lpq_array_type_ = 0; /* registered array type -> element type */
+#define LPQ_ARRAY_TYPE ((void *) &lpq_array_type_)
+static int lpq_anchor_mt_ = 0; /* MT of result anchors */
+#define LPQ_ANCHOR_MT ((void *) &lpq_anchor_mt_)
+static int lpq_view_mt_ = 0;
+#define LPQ_VIEW_MT ((void *) &lpq_view_mt_)
+static int lpq_range_mt_ = 0;
+#define LPQ_RANGE_MT ((void *) &lpq_range_mt_)
+
+/* element type of built-in or registered array type, or 0 */
+static Oid lpq_elemtype (lua_State *L, Oid type) {
+  int i;
+  Oid elem;
+  for (i = 0; lpq_arraytypes[i].array != 0; i++)
+    if (lpq_arraytypes[i].array == type) return lpq_arraytypes[i].elem;
+  lua_pushlightuserdata(L, LPQ_ARRAY_TYPE);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  lua_rawgeti(L, -1, (int) type);
+  elem = (Oid) lua_tointeger(L, -1);
+  lua_pop(L, 2);
+  return elem;
+}
+
+/* element type of built-in range type, or range type of built-in
+ * multirange type with *multi set, or 0 */
+static Oid lpq_rangetype (Oid type, int *multi) {
+  int i;
+  for (i = 0; lpq_rangetypes[i].range != 0; i++) {
+    *multi = (lpq_rangetypes[i].multirange == type);
+    if (lpq_rangetypes[i].range == type) return lpq_rangetypes[i].elem;
+    if (*multi) return lpq_rangetypes[i].range;
+  }
+  return 0;
+}
+
+/* C codec in registered MT at narg, or NULL */
+static const lpq_Codec *lpq_getcodec (lua_State *L, int narg) {
+  const lpq_Codec *codec;
+  lua_getfield(L, narg, LPQ_REGMT_CODEC);
+  codec = (const lpq_Codec *) lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return (codec != NULL && codec->version == LPQ_CODEC_VERSION) ? codec : NULL;
+}
 
 static int lpq_gettypemt (lua_State *L, Oid type) {
   int found;
@@ -114,892 +446,4624 @@ static int lpq_gettypemt (lua_State *L, Oid type) {
   return found;
 }
 
-static void lpq_pushvalue (lua_State *L, Oid type, int mod, const char *value,
-                           int length, PGresult *result, int field_number, int rowindex) {
+/* decoders: push value of given length according to column c */
 
-  // FIXME: Some of the blocks below are all so similar, that they can be abstracted further
-  switch (type) {
-    case BOOLOID:
-      lua_pushboolean(L, *value);
-      break;
-    case CHAROID:
-      lua_pushlstring(L, value, 1);
-      break;
-    case INT4OID:
-    case REGCLASSOID:
-    case OIDOID:
-      lua_pushinteger(L, (int) lpq_getuint32(value));
-      break;
-    case INT8OID:
-      lua_pushinteger(L, (int64) lpq_getint64(value));
-      break;
-    case FLOAT4OID:
-      lua_pushnumber(L, (lua_Number) lpq_getfloat4(value));
-      break;
-    case FLOAT8OID:
-      lua_pushnumber(L, (lua_Number) lpq_getfloat8(value));
-      break;
-    case TIMESTAMPOID:
-    case TIMESTAMPTZOID: {
-      // I'm re-reading the value as casting the *value did not work correctly
-      char *typeflag = "%timestamptz";
-      if (type == TIMESTAMPOID)typeflag = "%timestamp";
-      PGtimestamp tvalue;
-      PQgetf(result, rowindex, typeflag, field_number, &tvalue);
-      lua_pushnumber(L, tvalue.epoch);
-      break;
-    }
-    case BYTEAOID:
-    case TEXTOID:
-    case VARCHAROID:
-    case JSONOID:
-    case NAMEOID:
-      lua_pushlstring(L, value, length);
-      break;
-  case INTEGERARRAYOID: {
-      PGarray arr;
-      int i = 0;
-      PQgetf(result, rowindex, "%int4[]", field_number, &arr);
-      int ntups = PQntuples(arr.res);
-      lua_newtable(L);
-      for(i=0; i < ntups; i++) {
-        // We get the value for each row in the dictionary
-        PGint4 val;
-        PQgetf(arr.res, i, "%int4", 0, &val);
-        lua_pushnumber(L, i + 1); //index
-        lua_pushnumber(L, val); //value
-        lua_settable(L, -3);
-      }
-    break;
-  }
-  case BIGINTEGERARRAYOID: {
-      PGarray arr;
-      int i = 0;
-      PQgetf(result, rowindex, "%int8[]", field_number, &arr);
-      int ntups = PQntuples(arr.res);
-      lua_newtable(L);
-      for(i=0; i < ntups; i++) {
-        // We get the value for each row in the dictionary
-        PGint8 val;
-        PQgetf(arr.res, i, "%int8", 0, &val);
-        lua_pushnumber(L, i + 1); //index
-        lua_pushnumber(L, val); //value
-        lua_settable(L, -3);
-      }
-    break;
-  }
-  case VARCHARARRAYOID: {
-      PGarray arr;
-      int i = 0;
-      PQgetf(result, rowindex, "%varchar[]", field_number, &arr);
-      int ntups = PQntuples(arr.res);
-      lua_newtable(L);
-      for(i=0; i < ntups; i++) {
-        // We get the value for each row in the dictionary
-        PGvarchar val;
-        PQgetf(arr.res, i, "%varchar", 0, &val);
-        lua_pushnumber(L, i + 1); //index
-        // I'm not sure if strlen is correct usage here, but I couldn't
-        // figure out if there is an official function for determining
-        // PGvarchar's length. Besides, strlen seems to work fine.
-        lua_pushlstring(L, val, strlen(val));
-        lua_settable(L, -3);
-      }
-      break;
-    }
-  case TIMESTAMPARRAYOID: {
-    PGarray arr;
-    int i = 0;
-    PQgetf(result, rowindex, "%timestamp[]", field_number, &arr);
-    int ntups = PQntuples(arr.res);
-    lua_newtable(L);
-    for(i=0; i < ntups; i++) {
-      // We get the val for each row in the dictionary
-      PGtimestamp val;
-      PQgetf(arr.res, i, "%timestamp", 0, &val);
-      lua_pushnumber(L, i + 1); //index
-      // we're pushing the time converted to time stamp, lua doesn't support much more anyway
-      lua_pushnumber(L, val.epoch);
-      lua_settable(L, -3);
-    }
-    break;
-  }
-  case TIMESTAMPTZARRAYOID: {
-    PGarray arr;
-    int i = 0;
-    PQgetf(result, rowindex, "%timestamptz[]", field_number, &arr);
-    int ntups = PQntuples(arr.res);
-    lua_newtable(L);
-    for(i=0; i < ntups; i++) {
-      // We get the value for each row in the dictionary
-      PGtimestamp val;
-      PQgetf(arr.res, i, "%timestamptz", 0, &val);
-      lua_pushnumber(L, i + 1); //index
-      // we're pushing the time converted to time stamp, lua doesn't support much more anyway
-      lua_pushnumber(L, val.epoch);
-      lua_settable(L, -3);
-    }
-    break;
-  }
-  case FLOAT8ARRAYOID:
-  case FLOAT4ARRAYOID: {
-    int byteSize = 4;
-    if (type == FLOAT8ARRAYOID) {
-      byteSize = 8;
-    }
-    char template1[8];
-    sprintf(template1, "%%float%i", byteSize);
-    char template2[10];
-    sprintf(template2, "%s[]", template1);
-
-    PGarray arr;
-    int i = 0;
-    PQgetf(result, rowindex, template2, field_number, &arr);
-    int ntups = PQntuples(arr.res);
-    lua_newtable(L);
-    for(i=0; i < ntups; i++) {
-      // We get the val for each row in the dictionary
-      lua_pushnumber(L, i + 1); //index
-      // we're pushing the time converted to time stamp, lua doesn't support much more anyway
-      if (byteSize == 4) {
-        PGfloat4 val;
-        PQgetf(arr.res, i, template1, 0, &val);
-        lua_pushnumber(L, (lua_Number)val);
-      }
-      if (byteSize == 8) {
-        PGfloat8 val;
-        PQgetf(arr.res, i, template1, 0, &val);
-        lua_pushnumber(L, (lua_Number)val);
-      }
-      lua_settable(L, -3);
-    }
-    break;
-  }
-  case BPCHAROID: {
-      int l = mod - VARHDRSZ;
-      if (l < 0) l = length;
-      lua_pushlstring(L, value, l);
-      if (length > l) { /* pad? */
-        luaL_Buffer b;
-        length -= l;
-        luaL_buffinit(L, &b);
-        while (l-- > 0) luaL_addchar(&b, ' ');
-        luaL_pushresult(&b);
-        lua_concat(L, 2);
-      }
-      break;
-    }
-    default:
-      if (lpq_gettypemt(L, type)) { /* registered type? */
-        lua_getfield(L, -1, LPQ_REGMT_RECV);
-        if (lua_type(L, -1) == LUA_TFUNCTION) {
-          int consistent = 0;
-          lua_pushlstring(L, value, length);
-          lua_pushinteger(L, mod);
-          lua_call(L, 2, 1);
-          /* check returned value */
-          if (lua_getmetatable(L, -1)) {
-            if (lua_rawequal(L, -1, -3)) consistent = 1;
-            lua_pop(L, 1); /* MT */
-          }
-          if (consistent) {
-            lua_replace(L, -2);
-            return;
-          }
-        }
-        lua_pop(L, 2);
-      }
-      memcpy((char *) lua_newuserdata(L, length), value, length);
-  }
+static void lpq_decodebool (lua_State *L, const lpq_Column *c,
+                            const char *value, int length, int row) {
+  (void) c; (void) length; (void) row;
+  lua_pushboolean(L, *value);
 }
 
-static int lpq_tovalue (lua_State *L, int narg, Oid type, luaL_Buffer *b) {
-  switch (type) {
-    case INTERVALOID:
-      lua_getfield(L, narg, "time");
-      /* XXX: if timestamps are int64... or float8... */
-      lpq_sendfloat8(b, (float8) lua_tonumber(L, -1));
-      lua_getfield(L, narg, "day");
-      lpq_senduint32(b, (uint32) lua_tonumber(L, -1));
-      lua_getfield(L, narg, "month");
-      lpq_senduint32(b, (uint32) lua_tonumber(L, -1));
-      return 0x10;
-    case BOOLOID:
-      luaL_addchar(b, (char) lua_toboolean(L, narg));
-      return sizeof(char);
-    case CHAROID:
-      luaL_addchar(b, *lua_tostring(L, narg));
-      return sizeof(char);
-    case INT4OID:
-    case OIDOID:
-      lpq_senduint32(b, (uint32) lua_tointeger(L, narg));
-      return sizeof(uint32);
-    case FLOAT4OID:
-      lpq_sendfloat4(b, (float4) lua_tonumber(L, narg));
-      return sizeof(float4);
-    case FLOAT8OID:
-      lpq_sendfloat8(b, (float8) lua_tonumber(L, narg));
-      return sizeof(float8);
-    case BYTEAOID:
-    case TEXTOID:
-    case BPCHAROID:
-    case NAMEOID:
-    case VARCHAROID: {
-      size_t l;
-      const char *s = lua_tolstring(L, narg, &l);
-      luaL_addlstring(b, s, l);
-      return l;
-    }
-    default: {
-      size_t l;
-      const char *s;
-      if (lpq_gettypemt(L, type)) { /* registered type? */
-        lua_getfield(L, -1, LPQ_REGMT_SEND);
-        if (lua_type(L, -1) == LUA_TFUNCTION) {
-          int consistent = 0;
-          /* check input */
-          if (lua_getmetatable(L, narg)) {
-            if (lua_rawequal(L, -1, -3)) consistent = 1;
-            lua_pop(L, 1); /* MT */
-          }
-          if (consistent) {
-            lua_pushvalue(L, narg);
-            lua_call(L, 1, 1);
-            s = lua_tolstring(L, -1, &l);
-            if (s != NULL) luaL_addlstring(b, s, l);
-            else l = 0;
-            lua_pop(L, 2);
-            return l;
-          }
-        }
-        lua_pop(L, 2);
-      }
-      s = (const char *) lua_touserdata(L, narg);
-      if (s != NULL) {
-        l = lua_rawlen(L, narg);
-        luaL_addlstring(b, s, l);
-      }
-      else l = 0;
-      return l;
-    }
-  }
+static void lpq_decodechar (lua_State *L, const lpq_Column *c,
+                            const char *value, int length, int row) {
+  (void) c; (void) length; (void) row;
+  lua_pushlstring(L, value, 1);
 }
 
-static int lpq_pushstatus (lua_State *L, int status, PGconn *conn) {
-  lua_pushboolean(L, status);
-  if (status == 0) {
-    lua_pushstring(L, PQerrorMessage(conn));
-    return 2;
-  }
-  return 1;
+static void lpq_decodeint4 (lua_State *L, const lpq_Column *c,
+                            const char *value, int length, int row) {
+  (void) c; (void) length; (void) row;
+  lua_pushinteger(L, (int) lpq_getuint32(value));
 }
 
-/* =======   PSQL   ======= */
+static void lpq_decodeint8 (lua_State *L, const lpq_Column *c,
+                            const char *value, int length, int row) {
+  (void) c; (void) length; (void) row;
+  lua_pushinteger(L, (int64) lpq_getint64(value));
+}
 
-static int lpq_pushconnection (lua_State *L, PGconn *conn) {
-  lpq_Conn *C;
-  if (conn == NULL) luaL_error(L, "libpq unable to alloc connection");
-  C = (lpq_Conn *) lua_newuserdata(L, sizeof(lpq_Conn));
-  // Have to call this on any connection to be used with libpqtypes: http://libpqtypes.esilo.com/
-  PQinitTypes(conn);
-  C->conn = conn;
-  C->done = 0;
-  lua_newtable(L);
-  lua_setuservalue(L, -2);
-  lua_pushvalue(L, lua_upvalueindex(1)); /* MT */
-  lua_setmetatable(L, -2);
-  return 1;
+static void lpq_decodefloat4 (lua_State *L, const lpq_Column *c,
+                              const char *value, int length, int row) {
+  (void) c; (void) length; (void) row;
+  lua_pushnumber(L, (lua_Number) lpq_getfloat4(value));
 }
 
-static int lpq_connect (lua_State *L) {
-  const char *conninfo = luaL_checkstring(L, 1);
-  return lpq_pushconnection(L, PQconnectdb(conninfo));
+static void lpq_decodefloat8 (lua_State *L, const lpq_Column *c,
+                              const char *value, int length, int row) {
+  (void) c; (void) length; (void) row;
+  lua_pushnumber(L, (lua_Number) lpq_getfloat8(value));
 }
 
-static int lpq_start (lua_State *L) {
-  const char *conninfo = luaL_checkstring(L, 1);
-  return lpq_pushconnection(L, PQconnectStart(conninfo));
+/* also bpchar: values are blank-padded by the server */
+static void lpq_decodetext (lua_State *L, const lpq_Column *c,
+                            const char *value, int length, int row) {
+  (void) c; (void) row;
+  lua_pushlstring(L, value, length);
 }
 
-/* register(oid [, metatable]) */
-static int lpq_register (lua_State *L) {
-  Oid type = (Oid) luaL_checkinteger(L, 1);
-  lua_settop(L, 2);
-  lua_pushlightuserdata(L, LPQ_TYPE_MT);
+/* text-like value of at least c->viewsize bytes: view into anchored result */
+static void lpq_decodeview (lua_State *L, const lpq_Column *c,
+                            const char *value, int length, int row) {
+  lpq_View *V;
+  (void) row;
+  if (length < c->viewsize) {
+    lua_pushlstring(L, value, length);
+    return;
+  }
+  V = (lpq_View *) lua_newuserdata(L, sizeof(lpq_View));
+  V->data = value;
+  V->length = (size_t) length;
+  lua_pushlightuserdata(L, LPQ_VIEW_MT);
   lua_rawget(L, LUA_REGISTRYINDEX);
-  if (lua_type(L, 2) != LUA_TTABLE) 
-    lua_createtable(L, 0, 1);
-  else
-    lua_pushvalue(L, 2);
-  lua_pushinteger(L, (int) type);
-  lua_setfield(L, -2, LPQ_REGMT_OID);
-  lua_rawseti(L, -2, (int) type);
-  return 0;
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 1, 0);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref); /* anchor */
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
 }
 
+/* unknown type: opaque copy */
+static void lpq_decoderaw (lua_State *L, const lpq_Column *c,
+                           const char *value, int length, int row) {
+  (void) c; (void) row;
+  memcpy((char *) lua_newuserdata(L, length), value, length);
+}
 
-/* =======   lpq_Conn   ======= */
+/* timestamp and timestamptz: microseconds since 2000-01-01 (UTC for
+ * timestamptz), as Unix time in seconds; infinite values as +-inf */
+static void lpq_decodetimestamp (lua_State *L, const lpq_Column *c,
+                                 const char *value, int length, int row) {
+  int64 t = lpq_getint64(value);
+  (void) c; (void) length; (void) row;
+  if (t == LPQ_TS_NOEND) lua_pushnumber(L, HUGE_VAL);
+  else if (t == LPQ_TS_NOBEGIN) lua_pushnumber(L, -HUGE_VAL);
+  else lua_pushnumber(L, (lua_Number) (t / 1000000 + LPQ_EPOCH_OFFSET)
+      + (lua_Number) (t % 1000000) / 1e6);
+}
 
-static lpq_Conn *lpq_checkconn (lua_State *L, int narg) {
-  lpq_Conn *C = NULL;
-  if (lua_getmetatable(L, narg)) { /* has metatable? */
-    if (lua_rawequal(L, -1, lua_upvalueindex(1))) /* MT == upvalue? */
-      C = (lpq_Conn *) lua_touserdata(L, narg);
-    lua_pop(L, 1); /* MT */
+/* as microseconds since the Unix epoch; infinite values as extreme int64 */
+static void lpq_decodetimestampint (lua_State *L, const lpq_Column *c,
+                                    const char *value, int length, int row) {
+  int64 t = lpq_getint64(value);
+  (void) c; (void) length; (void) row;
+  if (t != LPQ_TS_NOEND && t != LPQ_TS_NOBEGIN)
+    t += (int64) LPQ_EPOCH_OFFSET * 1000000;
+  lua_pushinteger(L, (lua_Integer) t);
+}
+
+static int64 lpq_floordiv (int64 x, int64 d) {
+  return (x >= 0) ? x / d : -((-x + d - 1) / d);
+}
+
+/* proleptic Gregorian calendar, after H. Hinnant's days_from_civil */
+static int64 lpq_civildays (int64 y, int m, int d) { /* since 1970-01-01 */
+  int64 era, yoe, doy;
+  y -= (m <= 2);
+  era = lpq_floordiv(y, 400);
+  yoe = y - era * 400;
+  doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/* as table with year, month, day, hour, min, sec and usec, in UTC */
+static void lpq_decodetimestamptable (lua_State *L, const lpq_Column *c,
+                                      const char *value, int length,
+                                      int row) {
+  int64 t = lpq_getint64(value), days, z, era, doe, yoe, doy, mp;
+  int64 usec;
+  if (t == LPQ_TS_NOEND || t == LPQ_TS_NOBEGIN) {
+    lpq_decodetimestamp(L, c, value, length, row);
+    return;
   }
-  if (C == NULL) lpq_typeerror(L, narg, LPQ_CONN_NAME);
-  if (C->done) luaL_error(L, LPQ_CONN_NAME " is finished");
-  return C;
+  days = lpq_floordiv(t, (int64) LPQ_DAY_SECS * 1000000);
+  usec = t - days * LPQ_DAY_SECS * 1000000;
+  z = days + LPQ_EPOCH_OFFSET / LPQ_DAY_SECS + 719468; /* civil_from_days */
+  era = lpq_floordiv(z, 146097);
+  doe = z - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, (lua_Integer) (yoe + era * 400 + (mp >= 10)));
+  lua_setfield(L, -2, "year");
+  lua_pushinteger(L, (lua_Integer) ((mp < 10) ? mp + 3 : mp - 9));
+  lua_setfield(L, -2, "month");
+  lua_pushinteger(L, (lua_Integer) (doy - (153 * mp + 2) / 5 + 1));
+  lua_setfield(L, -2, "day");
+  lua_pushinteger(L, (lua_Integer) (usec / 3600000000LL));
+  lua_setfield(L, -2, "hour");
+  lua_pushinteger(L, (lua_Integer) (usec / 60000000 % 60));
+  lua_setfield(L, -2, "min");
+  lua_pushinteger(L, (lua_Integer) (usec / 1000000 % 60));
+  lua_setfield(L, -2, "sec");
+  lua_pushinteger(L, (lua_Integer) (usec % 1000000));
+  lua_setfield(L, -2, "usec");
 }
 
-static void lpq_finishconn (lua_State *L, lpq_Conn *C) {
-  if (!C->done) {
-    PQfinish(C->conn);
-    /* mark plans that reference conn as invalid */
-    lua_getuservalue(L, 1);
-    lua_pushnil(L);
-    while (lua_next(L, 2)) {
-      lpq_Plan *P = (lpq_Plan *) lua_touserdata(L, -1);
-      if (P != NULL) P->valid = 0;
-      lua_pop(L, 1);
+static int lpq_getint16 (const char *v) {
+  unsigned short n16;
+  memcpy(&n16, v, 2);
+  return (short) ntohs(n16);
+}
+
+static void lpq_decodeint2 (lua_State *L, const lpq_Column *c,
+                            const char *value, int length, int row) {
+  (void) c; (void) length; (void) row;
+  lua_pushinteger(L, lpq_getint16(value));
+}
+
+/* numeric in binary format: ndigits, weight, sign and dscale as int16, then
+ * ndigits base LPQ_NBASE digits, the first of weight `weight` */
+typedef struct lpq_Numeric_struct {
+  int ndigits, weight, sign, dscale;
+  const char *digits;
+} lpq_Numeric;
+
+static void lpq_getnumeric (lua_State *L, lpq_Numeric *N, const char *value,
+                            int length) {
+  if (length < 8) luaL_error(L, "malformed numeric value");
+  N->ndigits = lpq_getint16(value);
+  N->weight = lpq_getint16(value + 2);
+  N->sign = lpq_getint16(value + 4) & 0xFFFF;
+  N->dscale = lpq_getint16(value + 6);
+  N->digits = value + 8;
+  if (N->ndigits < 0 || length < 8 + 2 * N->ndigits)
+    luaL_error(L, "malformed numeric value");
+}
+
+/* digit of weight N->weight - i, zero if not stored */
+static int lpq_numdigit (const lpq_Numeric *N, int i) {
+  return (i >= 0 && i < N->ndigits) ? lpq_getint16(N->digits + 2 * i) : 0;
+}
+
+/* push N as exact decimal string, as numeric_out */
+static void lpq_pushnumericstr (lua_State *L, const lpq_Numeric *N) {
+  luaL_Buffer b;
+  char buf[8];
+  int d, n;
+  switch (N->sign) {
+    case LPQ_NUMERIC_NAN: lua_pushliteral(L, "NaN"); return;
+    case LPQ_NUMERIC_PINF: lua_pushliteral(L, "Infinity"); return;
+    case LPQ_NUMERIC_NINF: lua_pushliteral(L, "-Infinity"); return;
+  }
+  luaL_buffinit(L, &b);
+  if (N->sign == LPQ_NUMERIC_NEG) luaL_addchar(&b, '-');
+  if (N->weight < 0) luaL_addchar(&b, '0');
+  for (d = 0; d <= N->weight; d++) {
+    sprintf(buf, (d == 0) ? "%d" : "%04d", lpq_numdigit(N, d));
+    luaL_addstring(&b, buf);
+  }
+  if (N->dscale > 0) {
+    luaL_addchar(&b, '.');
+    for (d = N->weight + 1, n = 0; n < N->dscale; d++, n += 4) {
+      sprintf(buf, "%04d", lpq_numdigit(N, d));
+      luaL_addlstring(&b, buf, (N->dscale - n < 4) ? N->dscale - n : 4);
     }
-    C->done = 1;
   }
+  luaL_pushresult(&b);
 }
 
-static int lpq_conn__tostring (lua_State *L) {
-  lua_pushfstring(L, LPQ_CONN_NAME ": %p", (void *) lua_touserdata(L, 1));
-  return 1;
+/* push N as lua_Number: a few digits scaled by an exact power of LPQ_NBASE
+ * are rounded once, others are read back from the decimal string */
+static void lpq_pushnumericnum (lua_State *L, const lpq_Numeric *N) {
+  int i, scale = N->ndigits - 1 - N->weight; /* digits after point */
+  switch (N->sign) {
+    case LPQ_NUMERIC_NAN: lua_pushnumber(L, strtod("nan", NULL)); return;
+    case LPQ_NUMERIC_PINF: lua_pushnumber(L, HUGE_VAL); return;
+    case LPQ_NUMERIC_NINF: lua_pushnumber(L, -HUGE_VAL); return;
+  }
+  if (N->ndigits <= 3 && scale >= -4 && scale <= 5) {
+    double v = 0, p = 1;
+    for (i = 0; i < N->ndigits; i++) v = v * LPQ_NBASE + lpq_numdigit(N, i);
+    for (i = 0; i < scale || i < -scale; i++) p *= LPQ_NBASE;
+    v = (scale >= 0) ? v / p : v * p;
+    lua_pushnumber(L, (lua_Number) ((N->sign == LPQ_NUMERIC_NEG) ? -v : v));
+    return;
+  }
+  lpq_pushnumericstr(L, N);
+  lua_pushnumber(L, (lua_Number) strtod(lua_tostring(L, -1), NULL));
+  lua_remove(L, -2);
 }
 
-static int lpq_conn__gc (lua_State *L) {
-  lpq_finishconn(L, (lpq_Conn *) lua_touserdata(L, 1));
-  return 0;
+/* numeric decoders for conn:setnumeric modes */
+static void lpq_decodenumeric (lua_State *L, const lpq_Column *c,
+                               const char *value, int length, int row) {
+  lpq_Numeric N;
+  (void) c; (void) row;
+  lpq_getnumeric(L, &N, value, length);
+  lpq_pushnumericnum(L, &N);
 }
 
+static void lpq_decodenumericstr (lua_State *L, const lpq_Column *c,
+                                  const char *value, int length, int row) {
+  lpq_Numeric N;
+  (void) c; (void) row;
+  lpq_getnumeric(L, &N, value, length);
+  lpq_pushnumericstr(L, &N);
+}
 
-static int lpq_conn_notifies (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  PGnotify *p = PQnotifies(C->conn);
-  if (p == NULL) { /* queue is empty? */
-    lua_pushnil(L);
-    return 1;
+/* integral values in int64 range as integers, others as numbers */
+static void lpq_decodenumericint (lua_State *L, const lpq_Column *c,
+                                  const char *value, int length, int row) {
+  lpq_Numeric N;
+  (void) c; (void) row;
+  lpq_getnumeric(L, &N, value, length);
+  if ((N.sign == 0 || N.sign == LPQ_NUMERIC_NEG)
+      && N.ndigits - 1 <= N.weight && N.weight <= 4) {
+    unsigned long long v = 0, max = ((unsigned long long) 1 << 63)
+      - (N.sign == 0);
+    int i;
+    for (i = 0; i <= N.weight; i++) {
+      int d = lpq_numdigit(&N, i);
+      if (v > (max - d) / LPQ_NBASE) break; /* overflow */
+      v = v * LPQ_NBASE + d;
+    }
+    if (i > N.weight) {
+      lua_pushinteger(L, (N.sign == 0) ? (lua_Integer) v
+          : (lua_Integer) -(long long) (v - 1) - 1);
+      return;
+    }
   }
-  lua_pushstring(L, p->relname);
-  lua_pushinteger(L, p->be_pid);
-  lua_pushstring(L, p->extra);
-  PQfreemem(p);
-  return 3;
+  lpq_pushnumericnum(L, &N);
 }
 
-static int lpq_conn_poll (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  PostgresPollingStatusType status = PQconnectPoll(C->conn);
-  lua_pushboolean(L, status == PGRES_POLLING_OK);
-  switch (status) {
-    case PGRES_POLLING_OK:
-      lua_pushstring(L, "PGRES_POLLING_OK"); break;
-    case PGRES_POLLING_READING:
-      lua_pushstring(L, "PGRES_POLLING_READING"); break;
-    case PGRES_POLLING_WRITING:
-      lua_pushstring(L, "PGRES_POLLING_WRITING"); break;
-    default:
-      lua_pushstring(L, "PGRES_POLLING_FAILED");
+/* date: days since 2000-01-01, as Unix time; infinite dates as +-inf */
+static void lpq_decodedate (lua_State *L, const lpq_Column *c,
+                            const char *value, int length, int row) {
+  int d = (int) lpq_getuint32(value);
+  (void) c; (void) length; (void) row;
+  if (d == 0x7FFFFFFF) lua_pushnumber(L, HUGE_VAL);
+  else if (d == -0x7FFFFFFF - 1) lua_pushnumber(L, -HUGE_VAL);
+  else lua_pushinteger(L, (lua_Integer) d * LPQ_DAY_SECS + LPQ_EPOCH_OFFSET);
+}
+
+/* time: microseconds since midnight, as seconds */
+static void lpq_decodetime (lua_State *L, const lpq_Column *c,
+                            const char *value, int length, int row) {
+  (void) c; (void) length; (void) row;
+  lua_pushnumber(L, (lua_Number) lpq_getint64(value) / 1e6);
+}
+
+static void lpq_decodeuuid (lua_State *L, const lpq_Column *c,
+                            const char *value, int length, int row) {
+  static const char hex[] = "0123456789abcdef";
+  char buf[36];
+  int i, j = 0;
+  (void) c; (void) row;
+  if (length != 16) luaL_error(L, "malformed uuid value");
+  for (i = 0; i < 16; i++) {
+    if (i == 4 || i == 6 || i == 8 || i == 10) buf[j++] = '-';
+    buf[j++] = hex[(value[i] >> 4) & 0xF];
+    buf[j++] = hex[value[i] & 0xF];
   }
-  return 2;
+  lua_pushlstring(L, buf, 36);
 }
 
-static int lpq_conn_status (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  ConnStatusType status = PQstatus(C->conn);
-  lua_pushboolean(L, status == CONNECTION_OK);
+/* inet and cidr: family, bits, is_cidr, #bytes and address; pushed as in
+ * text form, with /bits for cidr or non-host masks */
+static void lpq_decodeinet (lua_State *L, const lpq_Column *c,
+                            const char *value, int length, int row) {
+  char buf[64];
+  int bits, max = 0;
+  (void) c; (void) row;
+  if (length < 4 || length != 4 + (unsigned char) value[3])
+    luaL_error(L, "malformed inet value");
+  bits = (unsigned char) value[1];
+  if (value[0] == LPQ_AF_INET && value[3] == 4) {
+    inet_ntop(AF_INET, (void *) (value + 4), buf, sizeof(buf));
+    max = 32;
+  }
+  else if (value[0] == LPQ_AF_INET6 && value[3] == 16) {
+    inet_ntop(AF_INET6, (void *) (value + 4), buf, sizeof(buf));
+    max = 128;
+  }
+  else luaL_error(L, "malformed inet value");
+  if (value[2] || bits != max)
+    sprintf(buf + strlen(buf), "/%d", bits);
+  lua_pushstring(L, buf);
+}
+
+/* interval: microseconds, days and months, as table with time in seconds */
+static void lpq_decodeinterval (lua_State *L, const lpq_Column *c,
+                                const char *value, int length, int row) {
+  (void) c; (void) row;
+  if (length != 16) luaL_error(L, "malformed interval value");
+  lua_createtable(L, 0, 3);
+  lua_pushnumber(L, (lua_Number) lpq_getint64(value) / 1e6);
+  lua_setfield(L, -2, "time");
+  lua_pushinteger(L, (int) lpq_getuint32(value + 8));
+  lua_setfield(L, -2, "day");
+  lua_pushinteger(L, (int) lpq_getuint32(value + 12));
+  lua_setfield(L, -2, "month");
+}
+
+static void lpq_initcolumn (lua_State *L, lpq_Column *c, Oid type, int mod,
+                            int cat);
+static void lpq_freecolumns (lua_State *L, lpq_Column *c, int n);
+
+/* push nested tables for dimensions dim[0..ndim-1]; elements at *p */
+static void lpq_pusharraydim (lua_State *L, const lpq_Column *e,
+                              const char **p, const char *end,
+                              const int *dim, int ndim, int row) {
+  int i, n = dim[0];
+  lua_createtable(L, n, 0);
+  for (i = 1; i <= n; i++) {
+    if (ndim > 1) lpq_pusharraydim(L, e, p, end, dim + 1, ndim - 1, row);
+    else {
+      int length;
+      if (end - *p < 4) luaL_error(L, "malformed array value");
+      length = (int) lpq_getuint32(*p);
+      *p += 4;
+      if (length < 0) continue; /* NULL */
+      if (end - *p < length) luaL_error(L, "malformed array value");
+      e->decode(L, e, *p, length, row);
+      *p += length;
+    }
+    lua_rawseti(L, -2, i);
+  }
+}
+
+/* array in binary format: ndim, hasnull flag, element type, ndim pairs of
+ * (size, lower bound) and elements as (length, value), length -1 for NULL;
+ * lower bounds are ignored and NULL elements are holes */
+static void lpq_decodearray (lua_State *L, const lpq_Column *c,
+                             const char *value, int length, int row) {
+  const char *p = value, *end = value + length;
+  int i, ndim, dim[LPQ_ARRAY_MAXDIM];
+  Oid elemtype;
+  lpq_Column *e = c->elem;
+  if (length < 12) luaL_error(L, "malformed array value");
+  ndim = (int) lpq_getuint32(p);
+  elemtype = (Oid) lpq_getuint32(p + 8);
+  p += 12;
+  if (ndim < 0 || ndim > LPQ_ARRAY_MAXDIM || end - p < 8 * ndim)
+    luaL_error(L, "malformed array value");
+  for (i = 0; i < ndim; i++, p += 8) {
+    dim[i] = (int) lpq_getuint32(p);
+    if (dim[i] < 0) luaL_error(L, "malformed array value");
+  }
+  if (ndim == 0) { /* empty array */
+    lua_newtable(L);
+    return;
+  }
+  if (e->type != elemtype) { /* not the expected element type? */
+    lpq_freecolumns(L, e, 1);
+    lpq_initcolumn(L, e, elemtype, -1, 0);
+  }
+  lpq_pusharraydim(L, e, &p, end, dim, ndim, row);
+}
+
+/* record in binary format: #fields and (type, length, value) per field,
+ * length -1 for NULL; fields are keyed by name for composite types in the
+ * catalog, with names in table referenced by c->ref, else by position */
+static void lpq_decoderecord (lua_State *L, const lpq_Column *c,
+                              const char *value, int length, int row) {
+  const char *p = value + 4, *end = value + length;
+  int i, n, names = 0;
+  if (length < 4) luaL_error(L, "malformed record value");
+  n = (int) lpq_getuint32(value);
+  if (n < 0) luaL_error(L, "malformed record value");
+  if (n != c->n) { /* anonymous record or stale catalog: resize fields */
+    lpq_Column *e = NULL;
+    if (n > 0) {
+      e = (lpq_Column *) malloc(n * sizeof(lpq_Column));
+      if (e == NULL) luaL_error(L, "not enough memory");
+      for (i = 0; i < n; i++) lpq_initcolumn(L, &e[i], 0, -1, 0);
+    }
+    lpq_freecolumns(L, c->elem, c->n);
+    free(c->elem);
+    ((lpq_Column *) c)->elem = e;
+    ((lpq_Column *) c)->n = n;
+  }
+  if (c->ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref); /* field names */
+    names = lua_gettop(L);
+  }
+  lua_createtable(L, (names == 0) ? n : 0, (names == 0) ? 0 : n);
+  for (i = 0; i < n; i++) {
+    lpq_Column *f = &c->elem[i];
+    Oid type;
+    int l;
+    if (end - p < 8) luaL_error(L, "malformed record value");
+    type = (Oid) lpq_getuint32(p);
+    l = (int) lpq_getuint32(p + 4);
+    p += 8;
+    if (l < 0) continue; /* NULL */
+    if (end - p < l) luaL_error(L, "malformed record value");
+    if (f->type != type) { /* not the expected field type? */
+      lpq_freecolumns(L, f, 1);
+      lpq_initcolumn(L, f, type, -1, 0);
+    }
+    f->decode(L, f, p, l, row);
+    p += l;
+    if (names != 0) lua_rawgeti(L, names, i + 1);
+    if (names == 0 || lua_isnil(L, -1)) {
+      if (names != 0) lua_pop(L, 1);
+      lua_rawseti(L, -2, i + 1);
+    }
+    else {
+      lua_insert(L, -2);
+      lua_rawset(L, -3);
+    }
+  }
+  if (names != 0) lua_remove(L, names);
+}
+
+/* range in binary format: flags byte, then (length, value) for each finite
+ * bound of a non-empty range; as table with fields lower and upper (nil if
+ * infinite), lowerinc, upperinc and empty, and the range metatable */
+static void lpq_decoderange (lua_State *L, const lpq_Column *c,
+                             const char *value, int length, int row) {
+  const char *p = value + 1, *end = value + length;
+  int flags;
+  if (length < 1) luaL_error(L, "malformed range value");
+  flags = (unsigned char) *value;
+  lua_createtable(L, 0, 4);
+  if (flags & LPQ_RANGE_EMPTY) {
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "empty");
+  }
+  else {
+    int i;
+    for (i = 0; i < 2; i++) {
+      int l;
+      if (flags & (i == 0 ? LPQ_RANGE_LB_INF : LPQ_RANGE_UB_INF)) continue;
+      if (end - p < 4) luaL_error(L, "malformed range value");
+      l = (int) lpq_getuint32(p);
+      p += 4;
+      if (l < 0 || end - p < l) luaL_error(L, "malformed range value");
+      c->elem->decode(L, c->elem, p, l, row);
+      lua_setfield(L, -2, (i == 0) ? "lower" : "upper");
+      p += l;
+    }
+    lua_pushboolean(L, flags & LPQ_RANGE_LB_INC);
+    lua_setfield(L, -2, "lowerinc");
+    lua_pushboolean(L, flags & LPQ_RANGE_UB_INC);
+    lua_setfield(L, -2, "upperinc");
+  }
+  lua_pushlightuserdata(L, LPQ_RANGE_MT);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  lua_setmetatable(L, -2);
+}
+
+/* multirange in binary format: #ranges and (length, range) per range; as
+ * array of ranges */
+static void lpq_decodemultirange (lua_State *L, const lpq_Column *c,
+                                  const char *value, int length, int row) {
+  const char *p = value + 4, *end = value + length;
+  int i, n;
+  if (length < 4) luaL_error(L, "malformed multirange value");
+  n = (int) lpq_getuint32(value);
+  if (n < 0) luaL_error(L, "malformed multirange value");
+  lua_createtable(L, n, 0);
+  for (i = 1; i <= n; i++) {
+    int l;
+    if (end - p < 4) luaL_error(L, "malformed multirange value");
+    l = (int) lpq_getuint32(p);
+    p += 4;
+    if (l < 0 || end - p < l) luaL_error(L, "malformed multirange value");
+    lpq_decoderange(L, c->elem, p, l, row);
+    lua_rawseti(L, -2, i);
+    p += l;
+  }
+}
+
+/* registered type: call C codec or __recv from metatable referenced by
+ * c->ref */
+static void lpq_decoderegistered (lua_State *L, const lpq_Column *c,
+                                  const char *value, int length, int row) {
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref); /* MT */
+  if (c->codec != NULL && c->codec->recv != NULL
+      && c->codec->recv(L, value, length, c->mod)) {
+    lua_replace(L, -2);
+    return;
+  }
+  lua_getfield(L, -1, LPQ_REGMT_RECV);
+  if (lua_type(L, -1) == LUA_TFUNCTION) {
+    int consistent = 0;
+    lua_pushlstring(L, value, length);
+    lua_pushinteger(L, c->mod);
+    lua_call(L, 2, 1);
+    /* check returned value */
+    if (lua_getmetatable(L, -1)) {
+      if (lua_rawequal(L, -1, -3)) consistent = 1;
+      lua_pop(L, 1); /* MT */
+    }
+    if (consistent) {
+      lua_replace(L, -2);
+      return;
+    }
+  }
+  lua_pop(L, 2);
+  lpq_decoderaw(L, c, value, length, row);
+}
+
+/* push entry of type in catalog at stack position cat, if any */
+static int lpq_getcatalog (lua_State *L, Oid type, int cat) {
+  if (cat == 0) return 0;
+  lua_rawgeti(L, cat, (int) type);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  return 1;
+}
+
+/* resolve column c of type from entry on top of stack in catalog at cat */
+static void lpq_initcatalog (lua_State *L, lpq_Column *c, Oid type, int cat) {
+  int i, n;
+  lua_getfield(L, -1, "kind");
+  switch (*lua_tostring(L, -1)) {
+    case 'e': /* enum: label */
+      c->decode = lpq_decodetext;
+      break;
+    case 'd': /* domain: as base type */
+      lua_getfield(L, -2, "base");
+      lpq_initcolumn(L, c, (Oid) lua_tointeger(L, -1), c->mod, cat);
+      c->type = type;
+      lua_pop(L, 1);
+      break;
+    case 'a': /* array */
+      lua_getfield(L, -2, "elem");
+      c->elem = (lpq_Column *) malloc(sizeof(lpq_Column));
+      if (c->elem == NULL) luaL_error(L, "not enough memory");
+      c->n = 1;
+      lpq_initcolumn(L, c->elem, (Oid) lua_tointeger(L, -1), -1, cat);
+      c->decode = lpq_decodearray;
+      lua_pop(L, 1);
+      break;
+    default: /* composite */
+      lua_getfield(L, -2, "types");
+      n = (int) lua_rawlen(L, -1);
+      if (n > 0) {
+        c->elem = (lpq_Column *) malloc(n * sizeof(lpq_Column));
+        if (c->elem == NULL) luaL_error(L, "not enough memory");
+      }
+      for (i = 0; i < n; i++, c->n++) {
+        lua_rawgeti(L, -1, i + 1);
+        lpq_initcolumn(L, &c->elem[i], (Oid) lua_tointeger(L, -1), -1, cat);
+        lua_pop(L, 1);
+      }
+      lua_getfield(L, -3, "fields");
+      c->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      c->decode = lpq_decoderecord;
+      lua_pop(L, 1); /* types */
+  }
+  lua_pop(L, 1); /* kind */
+}
+
+/* resolve decoder for column of given type; user-defined types are looked
+ * up in catalog at stack position cat, if not 0 */
+static void lpq_initcolumn (lua_State *L, lpq_Column *c, Oid type, int mod,
+                            int cat) {
+  Oid elemtype;
+  int multi;
+  c->type = type;
+  c->mod = mod;
+  c->ref = LUA_NOREF;
+  c->codec = NULL;
+  c->viewsize = 0;
+  c->elem = NULL;
+  c->n = 0;
+  switch (type) {
+    case BOOLOID: c->decode = lpq_decodebool; break;
+    case CHAROID: c->decode = lpq_decodechar; break;
+    case INT4OID:
+    case REGCLASSOID:
+    case OIDOID: c->decode = lpq_decodeint4; break;
+    case INT8OID: c->decode = lpq_decodeint8; break;
+    case INT2OID: c->decode = lpq_decodeint2; break;
+    case NUMERICOID: c->decode = lpq_decodenumeric; break;
+    case DATEOID: c->decode = lpq_decodedate; break;
+    case TIMEOID: c->decode = lpq_decodetime; break;
+    case UUIDOID: c->decode = lpq_decodeuuid; break;
+    case INETOID:
+    case CIDROID: c->decode = lpq_decodeinet; break;
+    case INTERVALOID: c->decode = lpq_decodeinterval; break;
+    case FLOAT4OID: c->decode = lpq_decodefloat4; break;
+    case FLOAT8OID: c->decode = lpq_decodefloat8; break;
+    case BYTEAOID:
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID:
+    case JSONOID:
+    case UNKNOWNOID: /* untyped literals in records */
+    case NAMEOID: c->decode = lpq_decodetext; break;
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+      c->decode = lpq_decodetimestamp;
+      break;
+    case RECORDOID: c->decode = lpq_decoderecord; break;
+    default:
+      if (lpq_gettypemt(L, type)) { /* registered type? */
+        c->codec = lpq_getcodec(L, -1);
+        c->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        c->decode = lpq_decoderegistered;
+      }
+      else if (lpq_getcatalog(L, type, cat)) { /* user-defined type? */
+        lpq_initcatalog(L, c, type, cat);
+        lua_pop(L, 1); /* entry */
+      }
+      else if ((elemtype = lpq_rangetype(type, &multi)) != 0) { /* range? */
+        c->elem = (lpq_Column *) malloc(sizeof(lpq_Column));
+        if (c->elem == NULL) luaL_error(L, "not enough memory");
+        c->n = 1;
+        lpq_initcolumn(L, c->elem, elemtype, -1, cat);
+        c->decode = multi ? lpq_decodemultirange : lpq_decoderange;
+      }
+      else if ((elemtype = lpq_elemtype(L, type)) != 0) { /* array? */
+        c->elem = (lpq_Column *) malloc(sizeof(lpq_Column));
+        if (c->elem == NULL) luaL_error(L, "not enough memory");
+        c->n = 1;
+        lpq_initcolumn(L, c->elem, elemtype, -1, cat);
+        c->decode = lpq_decodearray;
+      }
+      else c->decode = lpq_decoderaw;
+  }
+}
+
+static void lpq_freecolumns (lua_State *L, lpq_Column *c, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    luaL_unref(L, LUA_REGISTRYINDEX, c[i].ref);
+    if (c[i].elem != NULL) {
+      lpq_freecolumns(L, c[i].elem, c[i].n);
+      free(c[i].elem);
+    }
+  }
+}
+
+/* replace default decoder from by to in columns c[0..n-1], their elements
+ * and fields, for conn:setnumeric and conn:settimestamp modes */
+static void lpq_setdecoder (lpq_Column *c, int n, lpq_Decoder from,
+                            lpq_Decoder to) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (c[i].decode == from) c[i].decode = to;
+    if (c[i].elem != NULL) lpq_setdecoder(c[i].elem, c[i].n, from, to);
+  }
+}
+
+/* apply decoding modes of C */
+static void lpq_setmodes (lpq_Column *c, int n, const lpq_Conn *C) {
+  if (C->numeric != lpq_decodenumeric)
+    lpq_setdecoder(c, n, lpq_decodenumeric, C->numeric);
+  if (C->timestamp != lpq_decodetimestamp)
+    lpq_setdecoder(c, n, lpq_decodetimestamp, C->timestamp);
+}
+
+/* push field f of row in result, decoded according to column c; returns
+ * its length */
+static int lpq_pushfield (lua_State *L, PGresult *result, const lpq_Column *c,
+                          int row, int f) {
+  int length;
+  if (PQgetisnull(result, row, f)) {
+    lua_pushnil(L);
+    return 0;
+  }
+  length = PQgetlength(result, row, f);
+  c->decode(L, c, PQgetvalue(result, row, f), length, row);
+  return length;
+}
+
+static void lpq_putint16 (char *v, int n) {
+  unsigned short n16 = htons((unsigned short) n);
+  memcpy(v, &n16, 2);
+}
+
+static void lpq_putuint32 (char *v, uint32 n32) {
+  n32 = htonl(n32);
+  memcpy(v, &n32, 4);
+}
+
+/* text form of number at narg in buf that the server reads back exactly */
+static const char *lpq_numstring (lua_State *L, int narg, char *buf) {
+  lua_Number x;
+#if LUA_VERSION_NUM >= 503
+  if (lua_isinteger(L, narg)) {
+    sprintf(buf, "%lld", (long long) lua_tointeger(L, narg));
+    return buf;
+  }
+#endif
+  x = lua_tonumber(L, narg);
+  sprintf(buf, "%.15g", (double) x);
+  if (strtod(buf, NULL) != (double) x) sprintf(buf, "%.17g", (double) x);
+  return buf;
+}
+
+/* microseconds in x seconds, rounded */
+static int64 lpq_tousec (lua_Number x) {
+  return (int64) ((x < 0) ? x * 1e6 - 0.5 : x * 1e6 + 0.5);
+}
+
+/* timestamp at narg as microseconds since 2000-01-01: Unix time in seconds
+ * or table as from "table" mode (UTC), with usec and sec possibly
+ * fractional, else an error; leaves stack as is, for use with a
+ * luaL_Buffer */
+static int64 lpq_totimestamp (lua_State *L, int narg) {
+  if (lua_type(L, narg) == LUA_TTABLE) {
+    static const char *const fields[] = {"year", "month", "day", "hour", "min",
+      "sec", "usec"};
+    lua_Number v[7] = {2000, 1, 1, 0, 0, 0, 0};
+    int i;
+    for (i = 0; i < 7; i++) {
+      lua_getfield(L, narg, fields[i]);
+      if (lua_isnumber(L, -1)) v[i] = lua_tonumber(L, -1);
+      lua_pop(L, 1);
+    }
+    return (lpq_civildays((int64) v[0], (int) v[1], (int) v[2])
+        - LPQ_EPOCH_OFFSET / LPQ_DAY_SECS) * LPQ_DAY_SECS * 1000000
+      + ((int64) v[3] * 3600 + (int64) v[4] * 60) * 1000000
+      + lpq_tousec(v[5]) + (int64) v[6];
+  }
+  else {
+    lua_Number x;
+    if (!lua_isnumber(L, narg)) luaL_error(L, "invalid timestamp value");
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, narg))
+      return ((int64) lua_tointeger(L, narg) - LPQ_EPOCH_OFFSET) * 1000000;
+#endif
+    x = lua_tonumber(L, narg);
+    if (x >= HUGE_VAL) return LPQ_TS_NOEND;
+    if (x <= -HUGE_VAL) return LPQ_TS_NOBEGIN;
+    return lpq_tousec(x - LPQ_EPOCH_OFFSET);
+  }
+}
+
+/* word w (in lower case) at p, followed by blanks only? */
+static int lpq_isword (const char *p, const char *w) {
+  while (*w != '\0' && (*p | 0x20) == *w) p++, w++;
+  while (*p == ' ') p++;
+  return *w == '\0' && *p == '\0';
+}
+
+/* numeric from decimal string s, as numeric_in: [-+]digits[.digits]
+ * [e[-+]digits], NaN or [-+]Infinity; returns length, or -1 if malformed */
+static int lpq_sendnumeric (const char *s, luaL_Buffer *b) {
+  char hdr[8], v[2];
+  unsigned char *dig;
+  const char *p = s;
+  int neg = 0, n = 0, k = 0, nint = 0, nfrac = 0, exp = 0, point, dscale;
+  int g, w, ndigits;
+  while (*p == ' ') p++;
+  if (*p == '-' || *p == '+') neg = (*p++ == '-');
+  if (lpq_isword(p, "nan") || lpq_isword(p, "infinity")
+      || lpq_isword(p, "inf")) {
+    lpq_putint16(hdr, 0);
+    lpq_putint16(hdr + 2, 0);
+    lpq_putint16(hdr + 4, (*p == 'n' || *p == 'N') ? LPQ_NUMERIC_NAN
+        : neg ? LPQ_NUMERIC_NINF : LPQ_NUMERIC_PINF);
+    lpq_putint16(hdr + 6, 0);
+    luaL_addlstring(b, hdr, 8);
+    return 8;
+  }
+  dig = (unsigned char *) malloc(strlen(p) + 1);
+  if (dig == NULL) return -1;
+  for (; *p >= '0' && *p <= '9'; p++, nint++) dig[n++] = *p - '0';
+  if (*p == '.')
+    for (p++; *p >= '0' && *p <= '9'; p++, nfrac++) dig[n++] = *p - '0';
+  if (n > 0 && (*p == 'e' || *p == 'E')) {
+    char *end;
+    long e = strtol(p + 1, &end, 10);
+    if (end == p + 1 || e > 1000 || e < -1000) n = 0;
+    exp = (int) e;
+    p = end;
+  }
+  while (*p == ' ') p++;
+  if (n == 0 || *p != '\0') {
+    free(dig);
+    return -1;
+  }
+  dscale = (nfrac - exp > 0) ? nfrac - exp : 0;
+  point = nint + exp; /* #digits before decimal point */
+  while (k < n && dig[k] == 0) k++, point--; /* leading zeros */
+  while (n > k && dig[n - 1] == 0) n--; /* trailing zeros */
+  /* digit i has decimal exponent point - 1 - i; group by LPQ_NBASE */
+  w = (k < n) ? (int) lpq_floordiv(point - 1, 4) : 0;
+  ndigits = (k < n) ? w - (int) lpq_floordiv(point - n + k, 4) + 1 : 0;
+  lpq_putint16(hdr, ndigits);
+  lpq_putint16(hdr + 2, w);
+  lpq_putint16(hdr + 4, (neg && ndigits > 0) ? LPQ_NUMERIC_NEG : 0);
+  lpq_putint16(hdr + 6, dscale);
+  luaL_addlstring(b, hdr, 8);
+  for (g = w; g > w - ndigits; g--) {
+    int d = 0, e;
+    for (e = 3; e >= 0; e--) { /* exponents 4g + 3, ..., 4g */
+      int pos = point - 1 - (4 * g + e); /* index of digit, relative to k */
+      d = 10 * d + ((pos >= 0 && k + pos < n) ? dig[k + pos] : 0);
+    }
+    lpq_putint16(v, d);
+    luaL_addlstring(b, v, 2);
+  }
+  free(dig);
+  return 8 + 2 * ndigits;
+}
+
+/* uuid from 32 hex digits, possibly with braces and dashes */
+static int lpq_senduuid (const char *s, luaL_Buffer *b) {
+  char v[16];
+  int n = 0;
+  for (; *s != '\0'; s++) {
+    int h;
+    if (*s >= '0' && *s <= '9') h = *s - '0';
+    else if ((*s | 0x20) >= 'a' && (*s | 0x20) <= 'f')
+      h = (*s | 0x20) - 'a' + 10;
+    else if (*s == '-' || *s == '{' || *s == '}') continue;
+    else return -1;
+    if (n == 32) return -1;
+    v[n / 2] = (char) ((n % 2 == 0) ? h << 4 : v[n / 2] | h);
+    n++;
+  }
+  if (n != 32) return -1;
+  luaL_addlstring(b, v, 16);
+  return 16;
+}
+
+/* inet or cidr from address[/bits] */
+static int lpq_sendinet (const char *s, int iscidr, luaL_Buffer *b) {
+  char buf[64], v[20];
+  char *slash;
+  int bits, max;
+  if (strlen(s) >= sizeof(buf)) return -1;
+  strcpy(buf, s);
+  slash = strchr(buf, '/');
+  if (slash != NULL) *slash = '\0';
+  if (inet_pton(AF_INET, buf, v + 4) == 1) {
+    v[0] = LPQ_AF_INET;
+    max = 32;
+  }
+  else if (inet_pton(AF_INET6, buf, v + 4) == 1) {
+    v[0] = LPQ_AF_INET6;
+    max = 128;
+  }
+  else return -1;
+  bits = (slash != NULL) ? atoi(slash + 1) : max;
+  if (bits < 0 || bits > max) return -1;
+  v[1] = (char) bits;
+  v[2] = (char) iscidr;
+  v[3] = (char) (max / 8);
+  luaL_addlstring(b, v, 4 + max / 8);
+  return 4 + max / 8;
+}
+
+static int lpq_tovalue (lua_State *L, int narg, Oid type, luaL_Buffer *b) {
+  switch (type) {
+    case INTERVALOID: { /* table with time in seconds, day and month */
+      int64 usec;
+      int day, month;
+      lua_getfield(L, narg, "time");
+      usec = lpq_tousec(lua_tonumber(L, -1));
+      lua_getfield(L, narg, "day");
+      day = (int) lua_tointeger(L, -1);
+      lua_getfield(L, narg, "month");
+      month = (int) lua_tointeger(L, -1);
+      lua_pop(L, 3); /* before adding to b */
+      lpq_sendint64(b, usec);
+      lpq_senduint32(b, (uint32) day);
+      lpq_senduint32(b, (uint32) month);
+      return 16;
+    }
+    case NUMERICOID: {
+      char buf[32];
+      int l = lpq_sendnumeric((lua_type(L, narg) == LUA_TNUMBER)
+          ? lpq_numstring(L, narg, buf) : lua_tostring(L, narg), b);
+      if (l < 0) luaL_error(L, "invalid numeric value");
+      return l;
+    }
+    case DATEOID: { /* Unix time */
+      lua_Number x;
+      int d;
+      if (!lua_isnumber(L, narg)) luaL_error(L, "invalid date value");
+      x = lua_tonumber(L, narg);
+      d = (x >= HUGE_VAL) ? 0x7FFFFFFF : (x <= -HUGE_VAL) ? -0x7FFFFFFF - 1
+        : (int) lpq_floordiv((int64) floor(x) - LPQ_EPOCH_OFFSET,
+            LPQ_DAY_SECS);
+      lpq_senduint32(b, (uint32) d);
+      return 4;
+    }
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+      lpq_sendint64(b, lpq_totimestamp(L, narg));
+      return 8;
+    case TIMEOID: /* seconds since midnight */
+      if (!lua_isnumber(L, narg)) luaL_error(L, "invalid time value");
+      lpq_sendint64(b, lpq_tousec(lua_tonumber(L, narg)));
+      return 8;
+    case UUIDOID: {
+      const char *s = lua_tostring(L, narg);
+      int l = (s != NULL) ? lpq_senduuid(s, b) : -1;
+      if (l < 0) luaL_error(L, "invalid uuid value");
+      return l;
+    }
+    case INETOID:
+    case CIDROID: {
+      const char *s = lua_tostring(L, narg);
+      int l = (s != NULL) ? lpq_sendinet(s, type == CIDROID, b) : -1;
+      if (l < 0) luaL_error(L, "invalid inet value");
+      return l;
+    }
+    case BOOLOID:
+      luaL_addchar(b, (char) lua_toboolean(L, narg));
+      return sizeof(char);
+    case CHAROID:
+      luaL_addchar(b, *lua_tostring(L, narg));
+      return sizeof(char);
+    case INT4OID:
+    case OIDOID:
+      lpq_senduint32(b, (uint32) lua_tointeger(L, narg));
+      return sizeof(uint32);
+    case INT8OID:
+      lpq_sendint64(b, (int64) lua_tointeger(L, narg));
+      return sizeof(int64);
+    case FLOAT4OID:
+      lpq_sendfloat4(b, (float4) lua_tonumber(L, narg));
+      return sizeof(float4);
+    case FLOAT8OID:
+      lpq_sendfloat8(b, (float8) lua_tonumber(L, narg));
+      return sizeof(float8);
+    case BYTEAOID:
+    case TEXTOID:
+    case BPCHAROID:
+    case NAMEOID:
+    case VARCHAROID: {
+      size_t l;
+      const char *s = lua_tolstring(L, narg, &l);
+      luaL_addlstring(b, s, l);
+      return l;
+    }
+    case INT2OID:
+      if (lua_type(L, narg) == LUA_TNUMBER) {
+        char v[2];
+        lua_Integer i = lua_tointeger(L, narg);
+        if (i < -32768 || i > 32767) luaL_error(L, "smallint out of range");
+        lpq_putint16(v, (int) i);
+        luaL_addlstring(b, v, 2);
+        return 2;
+      }
+      /* else registered value, as from pqtype.int2 */
+      /* FALLTHROUGH */
+    default: {
+      size_t l;
+      const char *s;
+      if (lpq_gettypemt(L, type)) { /* registered type? */
+        const lpq_Codec *codec = lpq_getcodec(L, -1);
+        int consistent = 0;
+        /* check input */
+        if (lua_getmetatable(L, narg)) {
+          if (lua_rawequal(L, -1, -2)) consistent = 1;
+          lua_pop(L, 1); /* MT */
+        }
+        if (consistent && codec != NULL && codec->send != NULL) {
+          int n;
+          lua_pop(L, 1); /* registered MT, as codec may add to b */
+          if ((n = codec->send(L, narg, b)) >= 0) return n;
+          lpq_gettypemt(L, type);
+        }
+        lua_getfield(L, -1, LPQ_REGMT_SEND);
+        if (consistent && lua_type(L, -1) == LUA_TFUNCTION) {
+          lua_pushvalue(L, narg);
+          lua_call(L, 1, 1);
+          s = lua_tolstring(L, -1, &l);
+          if (s != NULL) luaL_addlstring(b, s, l);
+          else l = 0;
+          lua_pop(L, 2);
+          return l;
+        }
+        lua_pop(L, 2);
+      }
+      if (lua_type(L, narg) == LUA_TSTRING) /* encoded value */
+        s = lua_tolstring(L, narg, &l);
+      else {
+        s = (const char *) lua_touserdata(L, narg);
+        l = (s != NULL) ? lua_rawlen(L, narg) : 0;
+      }
+      if (s != NULL) luaL_addlstring(b, s, l);
+      return l;
+    }
+  }
+}
+
+/* push lower and upper bound values of range at narg, nil if infinite, and
+ * set lo and up; missing lowerinc is true, as for "[)"; returns 0 if range
+ * is empty */
+static int lpq_getbounds (lua_State *L, int narg, lpq_Bound *lo,
+                          lpq_Bound *up) {
+  int empty;
+  lua_getfield(L, narg, "empty");
+  empty = lua_toboolean(L, -1);
+  lua_getfield(L, narg, "lowerinc");
+  lo->inclusive = lua_isnil(L, -1) || lua_toboolean(L, -1);
+  lua_getfield(L, narg, "upperinc");
+  up->inclusive = lua_toboolean(L, -1);
+  lua_pop(L, 3);
+  lua_getfield(L, narg, "lower");
+  lo->value = lua_isnil(L, -1) ? 0 : lua_gettop(L);
+  lua_getfield(L, narg, "upper");
+  up->value = lua_isnil(L, -1) ? 0 : lua_gettop(L);
+  lo->inclusive = lo->inclusive && lo->value != 0;
+  up->inclusive = up->inclusive && up->value != 0;
+  lo->lower = 1;
+  up->lower = 0;
+  return !empty;
+}
+
+/* replace range table at stack position narg by range of elemtype in binary
+ * format */
+static void lpq_encoderange (lua_State *L, int narg, Oid elemtype) {
+  lpq_Bound bound[2];
+  luaL_Buffer b;
+  int i, flags = LPQ_RANGE_EMPTY, top = lua_gettop(L);
+  if (lpq_getbounds(L, narg, &bound[0], &bound[1])) {
+    flags = (bound[0].value == 0) ? LPQ_RANGE_LB_INF
+      : bound[0].inclusive ? LPQ_RANGE_LB_INC : 0;
+    flags |= (bound[1].value == 0) ? LPQ_RANGE_UB_INF
+      : bound[1].inclusive ? LPQ_RANGE_UB_INC : 0;
+    for (i = 0; i < 2; i++) { /* encoded bounds at top + 3 and top + 4 */
+      if (bound[i].value == 0) {
+        lua_pushnil(L);
+        continue;
+      }
+      luaL_buffinit(L, &b);
+      lpq_tovalue(L, bound[i].value, elemtype, &b);
+      luaL_pushresult(&b);
+    }
+  }
+  luaL_buffinit(L, &b);
+  luaL_addchar(&b, (char) flags);
+  for (i = 0; i < 2 && !(flags & LPQ_RANGE_EMPTY); i++) {
+    size_t l;
+    const char *s = lua_tolstring(L, top + 3 + i, &l);
+    if (s == NULL) continue; /* infinite */
+    lpq_senduint32(&b, (uint32) l);
+    luaL_addlstring(&b, s, l);
+  }
+  luaL_pushresult(&b);
+  lua_replace(L, narg);
+  lua_settop(L, top);
+}
+
+/* replace array of range tables at stack position narg by multirange of
+ * range type in binary format */
+static void lpq_encodemultirange (lua_State *L, int narg, Oid type) {
+  luaL_Buffer b;
+  int i, multi, n = (int) lua_rawlen(L, narg), top = lua_gettop(L);
+  Oid elemtype = lpq_rangetype(type, &multi);
+  luaL_checkstack(L, n, "too many ranges");
+  for (i = 1; i <= n; i++) { /* encoded ranges at top + i */
+    lua_rawgeti(L, narg, i);
+    if (!lua_istable(L, -1)) luaL_error(L, "multirange elements must be ranges");
+    lpq_encoderange(L, top + i, elemtype);
+  }
+  luaL_buffinit(L, &b);
+  lpq_senduint32(&b, (uint32) n);
+  for (i = 1; i <= n; i++) {
+    size_t l;
+    const char *s = lua_tolstring(L, top + i, &l);
+    lpq_senduint32(&b, (uint32) l);
+    luaL_addlstring(&b, s, l);
+  }
+  luaL_pushresult(&b);
+  lua_replace(L, narg);
+  lua_settop(L, top);
+}
+
+typedef struct lpq_Array_struct {
+  int ndim, dim[LPQ_ARRAY_MAXDIM];
+  Oid elemtype;
+  int multirange; /* elements are multiranges? */
+  int hasnull;
+  int idx; /* stack position of buffer udata */
+  char *buf;
+  size_t used, size;
+} lpq_Array;
+
+/* make room for sz bytes at the end of encoded array */
+static char *lpq_arrayreserve (lua_State *L, lpq_Array *A, size_t sz) {
+  if (A->used + sz > A->size) {
+    size_t size = (A->size > 0) ? A->size : 256;
+    char *buf;
+    while (size < A->used + sz) size *= 2;
+    buf = (char *) lua_newuserdata(L, size);
+    if (A->used > 0) memcpy(buf, A->buf, A->used);
+    lua_replace(L, A->idx);
+    A->buf = buf;
+    A->size = size;
+  }
+  return A->buf + A->used;
+}
+
+/* #t, or t.n if set so that trailing NULLs are kept */
+static int lpq_arraylen (lua_State *L, int narg) {
+  int n;
+  lua_pushliteral(L, "n");
+  lua_rawget(L, narg);
+  n = lua_isnumber(L, -1) ? (int) lua_tointeger(L, -1)
+    : (int) lua_rawlen(L, narg);
+  lua_pop(L, 1);
+  return n;
+}
+
+/* tables without metatable are arrays, others can be registered values */
+static int lpq_issubarray (lua_State *L, int narg) {
+  if (lua_type(L, narg) != LUA_TTABLE) return 0;
+  if (lua_getmetatable(L, narg)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  return 1;
+}
+
+/* range table at narg: psql.range or table of bounds */
+static int lpq_israngetable (lua_State *L, int narg) {
+  int range, top = lua_gettop(L);
+  if (lua_type(L, narg) != LUA_TTABLE) return 0;
+  if (!lpq_issubarray(L, narg)) return 1;
+  lua_rawgeti(L, narg, 1);
+  lua_pushnil(L);
+  range = lua_isnil(L, -2) && lua_next(L, narg); /* keys but no items? */
+  lua_settop(L, top);
+  return range;
+}
+
+/* in arrays of multiranges, table at narg is an element rather than a
+ * subarray if it is a range (an error later), empty, or holds ranges */
+static int lpq_ismultirange (lua_State *L, int narg) {
+  int multi;
+  if (lpq_israngetable(L, narg)) return 1;
+  lua_rawgeti(L, narg, 1);
+  multi = lua_isnil(L, -1) || lpq_israngetable(L, lua_gettop(L));
+  lua_pop(L, 1);
+  return multi;
+}
+
+static void lpq_putarraydim (lua_State *L, lpq_Array *A, int narg, int d) {
+  int i, n = lpq_arraylen(L, narg);
+  if (n != A->dim[d])
+    luaL_error(L, "multidimensional arrays must have matching dimensions");
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, narg, i);
+    if (d < A->ndim - 1) {
+      if (!lpq_issubarray(L, -1))
+        luaL_error(L, "multidimensional arrays must have matching dimensions");
+      lpq_putarraydim(L, A, lua_gettop(L), d + 1);
+    }
+    else if (lua_isnil(L, -1)) { /* NULL */
+      lpq_putuint32(lpq_arrayreserve(L, A, 4), (uint32) -1);
+      A->used += 4;
+      A->hasnull = 1;
+    }
+    else {
+      size_t l;
+      const char *s;
+      char *v;
+      luaL_Buffer b;
+      int multi;
+      Oid rangeelem;
+      if (A->multirange) {
+        if (!lua_istable(L, -1) || lpq_israngetable(L, lua_gettop(L)))
+          luaL_error(L, "multirange array elements must be arrays of ranges");
+        lpq_encodemultirange(L, lua_gettop(L),
+            lpq_rangetype(A->elemtype, &multi));
+      }
+      else if (lua_type(L, -1) == LUA_TTABLE /* range? */
+          && (rangeelem = lpq_rangetype(A->elemtype, &multi)) != 0)
+        lpq_encoderange(L, lua_gettop(L), rangeelem);
+      luaL_buffinit(L, &b);
+      lpq_tovalue(L, lua_gettop(L), A->elemtype, &b);
+      luaL_pushresult(&b);
+      s = lua_tolstring(L, -1, &l);
+      v = lpq_arrayreserve(L, A, 4 + l);
+      lpq_putuint32(v, (uint32) l);
+      memcpy(v + 4, s, l);
+      A->used += 4 + l;
+      lua_pop(L, 1); /* encoded element */
+    }
+    lua_pop(L, 1); /* element */
+  }
+}
+
+/* replace table at stack position narg by array of elemtype in binary
+ * format; dimensions are taken from the first element at each level */
+static void lpq_encodearray (lua_State *L, int narg, Oid elemtype) {
+  lpq_Array A;
+  int i, multi, top = lua_gettop(L);
+  Oid range = lpq_rangetype(elemtype, &multi);
+  char *v;
+  A.ndim = 0;
+  A.elemtype = elemtype;
+  A.multirange = range != 0 && multi;
+  A.hasnull = 0;
+  lua_pushvalue(L, narg);
+  for (;;) { /* dimensions */
+    int n = lpq_arraylen(L, lua_gettop(L));
+    if (n == 0) { /* empty */
+      A.ndim = 0;
+      break;
+    }
+    if (A.ndim == LPQ_ARRAY_MAXDIM)
+      luaL_error(L, "number of array dimensions exceeds the maximum");
+    A.dim[A.ndim++] = n;
+    lua_rawgeti(L, -1, 1);
+    if (!lpq_issubarray(L, -1)) break;
+    if (range != 0 && (A.multirange ? lpq_ismultirange(L, lua_gettop(L))
+          : lpq_israngetable(L, lua_gettop(L))))
+      break; /* element, not subarray */
+  }
+  lua_settop(L, top);
+  A.buf = NULL;
+  A.used = A.size = 0;
+  lua_pushnil(L); /* buffer */
+  A.idx = lua_gettop(L);
+  v = lpq_arrayreserve(L, &A, 12 + 8 * A.ndim);
+  lpq_putuint32(v, (uint32) A.ndim);
+  lpq_putuint32(v + 8, (uint32) elemtype);
+  for (i = 0; i < A.ndim; i++) {
+    lpq_putuint32(v + 12 + 8 * i, (uint32) A.dim[i]);
+    lpq_putuint32(v + 16 + 8 * i, 1); /* lower bound */
+  }
+  A.used = 12 + 8 * A.ndim;
+  if (A.ndim > 0) lpq_putarraydim(L, &A, narg, 0);
+  lpq_putuint32(A.buf + 4, (uint32) A.hasnull);
+  lua_pushlstring(L, A.buf, A.used);
+  lua_replace(L, narg);
+  lua_settop(L, top);
+}
+
+/* encode tables at stack positions narg, ..., narg + n - 1 that are
+ * parameters of array or range types; done ahead as values share one
+ * luaL_Buffer */
+static void lpq_encodetables (lua_State *L, const Oid *type, int narg,
+                              int n) {
+  int i, multi;
+  for (i = 0; i < n; i++) {
+    Oid elemtype;
+    if (lua_type(L, narg + i) != LUA_TTABLE) continue;
+    if ((elemtype = lpq_rangetype(type[i], &multi)) != 0) {
+      if (multi) lpq_encodemultirange(L, narg + i, elemtype);
+      else lpq_encoderange(L, narg + i, elemtype);
+    }
+    else if (lpq_issubarray(L, narg + i)
+        && (elemtype = lpq_elemtype(L, type[i])) != 0)
+      lpq_encodearray(L, narg + i, elemtype);
+  }
+}
+
+/* push text form of number at narg */
+static const char *lpq_pushnumstring (lua_State *L, int narg) {
+  char buf[32];
+  return lua_pushstring(L, lpq_numstring(L, narg, buf));
+}
+
+static int lpq_pushstatus (lua_State *L, int status, PGconn *conn) {
+  lua_pushboolean(L, status);
+  if (status == 0) {
+    lua_pushstring(L, PQerrorMessage(conn));
+    return 2;
+  }
+  return 1;
+}
+
+/* wait for events (POLLIN and/or POLLOUT) on connection socket for at most
+ * timeout ms (forever if negative); returns events, 0 if timed out, -1 on
+ * error */
+static int lpq_waitsocket (PGconn *conn, int events, int timeout) {
+  struct pollfd pfd;
+  int status;
+  pfd.fd = PQsocket(conn);
+  if (pfd.fd < 0) return -1;
+  pfd.events = (short) events;
+  pfd.revents = 0;
+  do status = lpq_poll(&pfd, 1, timeout);
+  while (status < 0 && errno == EINTR);
+  if (status <= 0) return status;
+  return (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+    ? events /* let libpq find out */ : pfd.revents;
+}
+
+/* milliseconds from a monotonic clock */
+static double lpq_clockms (void) {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+  return (double) GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+#endif
+}
+
+/* optional timeout in seconds at narg, in ms; -1 if absent or negative */
+static int lpq_opttimeout (lua_State *L, int narg) {
+  lua_Number timeout = luaL_optnumber(L, narg, -1);
+  if (timeout < 0) return -1;
+  return (timeout * 1000 < 2147483647.0) ? (int) (timeout * 1000) : -1;
+}
+
+/* ms left until deadline from lpq_clockms, at least 0 */
+static int lpq_timeleft (double deadline) {
+  double left = deadline - lpq_clockms();
+  return (left > 0) ? (int) left + 1 : 0;
+}
+
+static void lpq_releasestats (lpq_Stats *S) {
+  if (S != NULL && --S->refs == 0) free(S);
+}
+
+/* account for result received */
+static void lpq_countresult (lpq_Stats *S, const PGresult *result) {
+  S->results++;
+  S->rows += PQntuples(result);
+}
+
+/* account for decoding of given bytes started at t, from lpq_clockms */
+static void lpq_countdecode (lpq_Stats *S, double t, double bytes) {
+  if (S != NULL) {
+    S->decodetime += lpq_clockms() - t;
+    S->bytes += bytes;
+  }
+}
+
+/* consume input until a result can be read without blocking; waits at most
+ * timeout ms (forever if negative); returns 1 if ready, 0 if timed out, -1
+ * on error */
+static int lpq_waitready (PGconn *conn, int timeout) {
+  double deadline = lpq_clockms() + timeout;
+  while (PQisBusy(conn)) {
+    int events = lpq_waitsocket(conn, POLLIN,
+        (timeout < 0) ? -1 : lpq_timeleft(deadline));
+    if (events <= 0) return events;
+    if (!PQconsumeInput(conn)) return -1;
+  }
+  return 1;
+}
+
+/* flush nonblocking connection, reading input meanwhile so the server never
+ * blocks on its output; returns 0 on error */
+static int lpq_flushsocket (PGconn *conn) {
+  int status;
+  while ((status = PQflush(conn)) == 1) {
+    int events = lpq_waitsocket(conn, POLLIN | POLLOUT, -1);
+    if (events < 0) return 0;
+    if ((events & POLLIN) && !PQconsumeInput(conn)) return 0;
+  }
+  return status == 0;
+}
+
+/* latency histograms */
+static int lpq_histindex (double us) {
+  unsigned long v = (us < 4294967295.0) ? (unsigned long) us : 4294967295UL;
+  int e = 0;
+  if (v < LPQ_HIST_SUB) return (int) v;
+  while ((v >> e) >= 2 * LPQ_HIST_SUB) e++;
+  return (e + 1) * LPQ_HIST_SUB + (int) ((v >> e) - LPQ_HIST_SUB);
+}
+
+/* exclusive upper bound of bucket i, in microseconds */
+static double lpq_histupper (int i) {
+  if (i < LPQ_HIST_SUB) return i + 1;
+  return (double) (i % LPQ_HIST_SUB + LPQ_HIST_SUB + 1)
+    * (double) (1UL << (i / LPQ_HIST_SUB - 1));
+}
+
+static void lpq_histadd (lpq_Hist *H, double us) {
+  H->count++;
+  if (us > H->max) H->max = us;
+  H->bucket[lpq_histindex(us)]++;
+}
+
+/* upper bound of bucket holding p-th quantile, at most max */
+static double lpq_histquantile (const lpq_Hist *H, double p) {
+  double rank = p * H->count, k = 0;
+  int i;
+  for (i = 0; i < LPQ_HIST_SIZE; i++) {
+    k += H->bucket[i];
+    if (k >= rank && k > 0)
+      return (lpq_histupper(i) < H->max) ? lpq_histupper(i) : H->max;
+  }
+  return H->max;
+}
+
+/* push {max = , p50 = , p90 = , p99 = , buckets = {{upper, count}, ...}},
+ * in seconds */
+static void lpq_pushhist (lua_State *L, const lpq_Hist *H) {
+  int i, n = 0;
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, H->max / 1e6);
+  lua_setfield(L, -2, "max");
+  lua_pushnumber(L, lpq_histquantile(H, 0.5) / 1e6);
+  lua_setfield(L, -2, "p50");
+  lua_pushnumber(L, lpq_histquantile(H, 0.9) / 1e6);
+  lua_setfield(L, -2, "p90");
+  lua_pushnumber(L, lpq_histquantile(H, 0.99) / 1e6);
+  lua_setfield(L, -2, "p99");
+  lua_newtable(L);
+  for (i = 0; i < LPQ_HIST_SIZE; i++) {
+    if (H->bucket[i] == 0) continue;
+    lua_createtable(L, 2, 0);
+    lua_pushnumber(L, lpq_histupper(i) / 1e6);
+    lua_rawseti(L, -2, 1);
+    lua_pushinteger(L, (lua_Integer) H->bucket[i]);
+    lua_rawseti(L, -2, 2);
+    lua_rawseti(L, -2, ++n);
+  }
+  lua_setfield(L, -2, "buckets");
+}
+
+
+/* =======   PSQL   ======= */
+
+static int lpq_pushconnection (lua_State *L, PGconn *conn) {
+  lpq_Conn *C;
+  if (conn == NULL) luaL_error(L, "libpq unable to alloc connection");
+  C = (lpq_Conn *) lua_newuserdata(L, sizeof(lpq_Conn));
+  C->conn = conn;
+  C->done = 0;
+  C->head = C->tail = NULL;
+  C->ncached = 0;
+  C->maxcached = LPQ_CACHE_SIZE;
+  C->nextid = 0;
+  C->stats = NULL;
+  C->trace = LUA_NOREF;
+  C->latency = 0;
+  C->nlatency = 0;
+  C->slowms = -1;
+  C->viewsize = 0;
+  C->types = LUA_NOREF;
+  C->numeric = lpq_decodenumeric;
+  C->timestamp = lpq_decodetimestamp;
+  lua_newtable(L);
+  lua_setuservalue(L, -2);
+  lua_pushvalue(L, lua_upvalueindex(1)); /* MT */
+  lua_setmetatable(L, -2);
+  C->stats = (lpq_Stats *) calloc(1, sizeof(lpq_Stats));
+  if (C->stats == NULL) luaL_error(L, "not enough memory for statistics");
+  C->stats->refs = 1;
+  return 1;
+}
+
+static int lpq_connect (lua_State *L) {
+  const char *conninfo = luaL_checkstring(L, 1);
+  return lpq_pushconnection(L, PQconnectdb(conninfo));
+}
+
+static int lpq_start (lua_State *L) {
+  const char *conninfo = luaL_checkstring(L, 1);
+  return lpq_pushconnection(L, PQconnectStart(conninfo));
+}
+
+/* connect_timeout of conn in ms (at least 2 s, as in libpq), or -1 if
+ * unset; PQconnectPoll does not enforce it */
+static int lpq_connecttimeout (PGconn *conn) {
+  PQconninfoOption *opt = PQconninfo(conn), *o;
+  int ms = -1;
+  if (opt == NULL) return -1;
+  for (o = opt; o->keyword != NULL; o++)
+    if (strcmp(o->keyword, "connect_timeout") == 0 && o->val != NULL) {
+      int t = atoi(o->val);
+      if (t > 0) ms = ((t < 2) ? 2 : t) * 1000;
+    }
+  PQconninfoFree(opt);
+  return ms;
+}
+
+/* drive PQconnectPoll on the n connections in C over one poll set until all
+ * are done or timed out, after ms or, if ms < 0, after their own
+ * connect_timeout (no limit if unset); pfd and deadline have room for n
+ * entries and state[i] is set to PGRES_POLLING_OK, PGRES_POLLING_FAILED, or,
+ * on timeout, the last polling state */
+static void lpq_connectpoll (lpq_Conn **C, PostgresPollingStatusType *state,
+                             struct pollfd *pfd, int *idx, double *deadline,
+                             int n, int ms) {
+  int i, k, npending, status;
+  double now = lpq_clockms();
+  for (i = 0; i < n; i++) { /* as if PQconnectPoll returned WRITING */
+    int t = (ms >= 0) ? ms : lpq_connecttimeout(C[i]->conn);
+    state[i] = (PQstatus(C[i]->conn) == CONNECTION_BAD)
+      ? PGRES_POLLING_FAILED : PGRES_POLLING_WRITING;
+    deadline[i] = (t >= 0) ? now + t : -1;
+  }
+  for (;;) {
+    int wait = -1;
+    now = lpq_clockms();
+    npending = 0;
+    for (i = 0; i < n; i++) {
+      if (state[i] != PGRES_POLLING_READING
+          && state[i] != PGRES_POLLING_WRITING) continue;
+      if (deadline[i] >= 0) { /* timed out, or nearest deadline? */
+        int left = (deadline[i] > now) ? (int) (deadline[i] - now) + 1 : 0;
+        if (left == 0) continue;
+        if (wait < 0 || left < wait) wait = left;
+      }
+      pfd[npending].fd = PQsocket(C[i]->conn); /* can change between hosts */
+      pfd[npending].events = (state[i] == PGRES_POLLING_READING)
+        ? POLLIN : POLLOUT;
+      pfd[npending].revents = 0;
+      idx[npending++] = i;
+    }
+    if (npending == 0) return;
+    do status = lpq_poll(pfd, npending, wait);
+    while (status < 0 && errno == EINTR);
+    if (status < 0) return; /* leave pending ones as they are */
+    for (k = 0; k < npending; k++)
+      if (pfd[k].revents != 0)
+        state[idx[k]] = PQconnectPoll(C[idx[k]]->conn);
+  }
+}
+
+/* connect_many(conninfos [, timeout]) */
+static int lpq_connect_many (lua_State *L) {
+  int i, n, ms = lpq_opttimeout(L, 2);
+  lpq_Conn **C;
+  PostgresPollingStatusType *state;
+  struct pollfd *pfd;
+  double *deadline;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = (int) lua_rawlen(L, 1);
+  lua_settop(L, 2);
+  deadline = (double *) lua_newuserdata(L, n * (sizeof(double)
+        + sizeof(lpq_Conn *) + sizeof(PostgresPollingStatusType)
+        + sizeof(struct pollfd) + sizeof(int)));
+  C = (lpq_Conn **) (deadline + n);
+  pfd = (struct pollfd *) (C + n);
+  state = (PostgresPollingStatusType *) (pfd + n);
+  lua_createtable(L, n, 0); /* conns */
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      luaL_error(L, "conninfo string expected at position %d", i + 1);
+    lpq_pushconnection(L, PQconnectStart(lua_tostring(L, -1)));
+    C[i] = (lpq_Conn *) lua_touserdata(L, -1);
+    lua_rawseti(L, -3, i + 1);
+    lua_pop(L, 1); /* conninfo */
+  }
+  lpq_connectpoll(C, state, pfd, (int *) (state + n), deadline, n, ms);
+  lua_newtable(L); /* errors */
+  for (i = 0; i < n; i++) {
+    if (state[i] == PGRES_POLLING_OK) continue;
+    if (state[i] == PGRES_POLLING_FAILED)
+      lua_pushstring(L, PQerrorMessage(C[i]->conn));
+    else
+      lua_pushliteral(L, "timeout");
+    lua_rawseti(L, -2, i + 1);
+    PQfinish(C[i]->conn);
+    C[i]->done = 1;
+    lua_pushnil(L);
+    lua_rawseti(L, -3, i + 1);
+  }
+  return 2;
+}
+
+/* clock(): monotonic time in seconds, for timing */
+static int lpq_clock (lua_State *L) {
+  lua_pushnumber(L, lpq_clockms() / 1000);
+  return 1;
+}
+
+/* register(oid [, metatable [, arrayoid]]) */
+static int lpq_register (lua_State *L) {
+  Oid type = (Oid) luaL_checkinteger(L, 1);
+  if (!lua_isnoneornil(L, 3)) { /* array of type? */
+    Oid array = (Oid) luaL_checkinteger(L, 3);
+    lua_pushlightuserdata(L, LPQ_ARRAY_TYPE);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushinteger(L, (int) type);
+    lua_rawseti(L, -2, (int) array);
+  }
+  lua_settop(L, 2);
+  lua_pushlightuserdata(L, LPQ_TYPE_MT);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  if (lua_type(L, 2) != LUA_TTABLE) 
+    lua_createtable(L, 0, 1);
+  else
+    lua_pushvalue(L, 2);
+  lua_pushinteger(L, (int) type);
+  lua_setfield(L, -2, LPQ_REGMT_OID);
+  lua_rawseti(L, -2, (int) type);
+  return 0;
+}
+
+
+/* =======   lpq_Conn   ======= */
+
+static lpq_Conn *lpq_checkconn (lua_State *L, int narg) {
+  lpq_Conn *C = NULL;
+  if (lua_getmetatable(L, narg)) { /* has metatable? */
+    if (lua_rawequal(L, -1, lua_upvalueindex(1))) /* MT == upvalue? */
+      C = (lpq_Conn *) lua_touserdata(L, narg);
+    lua_pop(L, 1); /* MT */
+  }
+  if (C == NULL) lpq_typeerror(L, narg, LPQ_CONN_NAME);
+  if (C->done) luaL_error(L, LPQ_CONN_NAME " is finished");
+  return C;
+}
+
+static void lpq_finishconn (lua_State *L, lpq_Conn *C) {
+  if (!C->done) {
+    PQfinish(C->conn);
+    /* mark plans that reference conn as invalid */
+    lua_getuservalue(L, 1);
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+      lpq_Plan *P = (lpq_Plan *) lua_touserdata(L, -1);
+      if (P != NULL) P->valid = 0;
+      lua_pop(L, 1);
+    }
+    C->done = 1;
+  }
+}
+
+/* drop P from cache of conn at stack pos 1; P is no longer valid */
+static void lpq_uncache (lua_State *L, lpq_Conn *C, lpq_Plan *P,
+                         int deallocate) {
+  if (deallocate) {
+    PGresult *result = PQexec(C->conn,
+        lua_pushfstring(L, "DEALLOCATE %s", P->name));
+    PQclear(result);
+    lua_pop(L, 1);
+  }
+  if (P->prev != NULL) P->prev->next = P->next;
+  else C->head = P->next;
+  if (P->next != NULL) P->next->prev = P->prev;
+  else C->tail = P->prev;
+  C->ncached--;
+  P->valid = 0;
+  lua_getuservalue(L, 1);
+  lua_getfield(L, -1, LPQ_CONN_CACHE);
+  lua_pushlstring(L, P->stmt, P->stmtlen);
+  lua_pushnil(L);
+  lua_rawset(L, -3); /* env(conn).cache[stmt] = nil */
+  lua_pop(L, 1);
+  lua_pushlightuserdata(L, P);
+  lua_pushnil(L);
+  lua_rawset(L, -3); /* env(conn)[light(P)] = nil */
+  lua_pop(L, 1);
+}
+
+/* empty cache of conn at stack pos 1 */
+static void lpq_clearcache (lua_State *L, lpq_Conn *C, int deallocate) {
+  while (C->head != NULL) lpq_uncache(L, C, C->head, deallocate);
+}
+
+static int lpq_conn__tostring (lua_State *L) {
+  lua_pushfstring(L, LPQ_CONN_NAME ": %p", (void *) lua_touserdata(L, 1));
+  return 1;
+}
+
+static int lpq_conn__gc (lua_State *L) {
+  lpq_Conn *C = (lpq_Conn *) lua_touserdata(L, 1);
+  lpq_finishconn(L, C);
+  lpq_releasestats(C->stats);
+  luaL_unref(L, LUA_REGISTRYINDEX, C->trace);
+  luaL_unref(L, LUA_REGISTRYINDEX, C->types);
+  return 0;
+}
+
+
+/* push trace table of C, creating it if needed */
+static void lpq_pushtrace (lua_State *L, lpq_Conn *C) {
+  if (C->trace == LUA_NOREF) {
+    lua_createtable(L, 0, 2);
+    lua_newtable(L);
+    lua_setfield(L, -2, LPQ_TRACE_LATENCY);
+    lua_pushvalue(L, -1);
+    C->trace = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  else lua_rawgeti(L, LUA_REGISTRYINDEX, C->trace);
+}
+
+/* push type catalog of C and return its stack position, or return 0 */
+static int lpq_pushcatalog (lua_State *L, lpq_Conn *C) {
+  if (C->types == LUA_NOREF) return 0;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, C->types);
+  return lua_gettop(L);
+}
+
+/* conn:loadtypes([load]): load catalog of enum, domain and composite types
+ * and their arrays, used to decode later results; returns catalog, or nil
+ * and error message; with load false, drops catalog */
+static int lpq_conn_loadtypes (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  PGresult *result;
+  int i, n;
+  Oid last = 0;
+  double t;
+  if (!lua_isnoneornil(L, 2) && !lua_toboolean(L, 2)) {
+    luaL_unref(L, LUA_REGISTRYINDEX, C->types);
+    C->types = LUA_NOREF;
+    return 0;
+  }
+  t = lpq_clockms();
+  result = PQexec(C->conn, LPQ_CATALOG_QUERY);
+  C->stats->exectime += lpq_clockms() - t;
+  C->stats->queries++;
+  if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+    lua_pushnil(L);
+    lua_pushstring(L, PQresultErrorMessage(result));
+    PQclear(result);
+    return 2;
+  }
+  n = PQntuples(result);
+  lua_createtable(L, 0, n);
+  for (i = 0; i < n; i++) {
+    Oid type = (Oid) strtoul(PQgetvalue(result, i, 0), NULL, 10);
+    if (i == 0 || type != last) { /* new entry? */
+      char kind = *PQgetvalue(result, i, 1);
+      Oid array = (Oid) strtoul(PQgetvalue(result, i, 3), NULL, 10);
+      if (i > 0) lua_pop(L, 1); /* last entry */
+      lua_createtable(L, 0, 4);
+      lua_pushstring(L, (kind == 'e') ? "enum"
+          : (kind == 'd') ? "domain" : "composite");
+      lua_setfield(L, -2, "kind");
+      lua_pushstring(L, PQgetvalue(result, i, 4));
+      lua_setfield(L, -2, "name");
+      if (kind == 'd') {
+        lua_pushinteger(L, (lua_Integer) strtoul(PQgetvalue(result, i, 2),
+              NULL, 10));
+        lua_setfield(L, -2, "base");
+      }
+      else if (kind == 'c') {
+        lua_newtable(L);
+        lua_setfield(L, -2, "fields");
+        lua_newtable(L);
+        lua_setfield(L, -2, "types");
+      }
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, -3, (int) type);
+      if (array != 0) {
+        lua_createtable(L, 0, 2);
+        lua_pushliteral(L, "array");
+        lua_setfield(L, -2, "kind");
+        lua_pushinteger(L, (lua_Integer) type);
+        lua_setfield(L, -2, "elem");
+        lua_rawseti(L, -3, (int) array);
+      }
+      last = type;
+    }
+    if (!PQgetisnull(result, i, 5)) { /* composite attribute? */
+      int k;
+      lua_getfield(L, -1, "fields");
+      k = (int) lua_rawlen(L, -1) + 1;
+      lua_pushstring(L, PQgetvalue(result, i, 5));
+      lua_rawseti(L, -2, k);
+      lua_getfield(L, -2, "types");
+      lua_pushinteger(L, (lua_Integer) strtoul(PQgetvalue(result, i, 6),
+            NULL, 10));
+      lua_rawseti(L, -2, k);
+      lua_pop(L, 2);
+    }
+  }
+  if (n > 0) lua_pop(L, 1); /* last entry */
+  PQclear(result);
+  luaL_unref(L, LUA_REGISTRYINDEX, C->types);
+  lua_pushvalue(L, -1);
+  C->types = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+/* record latencies of statement with key on top of stack and result set
+ * below it, sent at t0 and received at t1 (from lpq_clockms); pops key */
+static void lpq_trace (lua_State *L, lpq_Conn *C, int nparams,
+                       double t0, double t1) {
+  double wait = t1 - t0, build = lpq_clockms() - t1;
+  int key = lua_gettop(L);
+  lpq_pushtrace(L, C);
+  if (C->latency) {
+    lpq_Hist *H;
+    lua_getfield(L, -1, LPQ_TRACE_LATENCY);
+    lua_pushvalue(L, key);
+    lua_rawget(L, -2);
+    H = (lpq_Hist *) lua_touserdata(L, -1);
+    if (H == NULL && C->nlatency < C->latency) { /* first for statement? */
+      lua_pop(L, 1);
+      H = (lpq_Hist *) lua_newuserdata(L, 2 * sizeof(lpq_Hist));
+      memset(H, 0, 2 * sizeof(lpq_Hist));
+      lua_pushvalue(L, key);
+      lua_pushvalue(L, -2);
+      lua_rawset(L, -4); /* trace.latency[key] = H */
+      C->nlatency++;
+    }
+    if (H != NULL) {
+      lpq_histadd(&H[0], wait * 1000);
+      lpq_histadd(&H[1], build * 1000);
+    }
+    lua_pop(L, 2);
+  }
+  if (C->slowms >= 0 && wait + build >= C->slowms) {
+    lpq_Rset *R = (lpq_Rset *) lua_touserdata(L, key - 1);
+    lua_getfield(L, -1, LPQ_TRACE_SLOWLOG);
+    lua_pushvalue(L, key);
+    lua_pushinteger(L, nparams);
+    lua_pushinteger(L, (R != NULL) ? PQntuples(R->result) : 0);
+    lua_pushnumber(L, wait / 1000);
+    lua_pushnumber(L, build / 1000);
+    lua_call(L, 5, 0); /* slowlog(stmt, nparams, rows, wait, build) */
+  }
+  lua_settop(L, key - 1);
+}
+
+/* conn:setlatency(on [, maxstatements]): record latency histograms per
+ * statement; statements past the first maxstatements are not recorded */
+static int lpq_conn_setlatency (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  int n = (int) luaL_optinteger(L, 3, LPQ_LATENCY_SIZE);
+  luaL_argcheck(L, n > 0, 3, "positive size expected");
+  C->latency = lua_toboolean(L, 2) ? n : 0;
+  return 0;
+}
+
+/* conn:latency(): table of {count, wait, build} histograms by statement */
+static int lpq_conn_latency (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  lua_settop(L, 1);
+  lpq_pushtrace(L, C);
+  lua_getfield(L, 2, LPQ_TRACE_LATENCY);
+  lua_newtable(L); /* 4: result */
+  lua_pushnil(L);
+  while (lua_next(L, 3)) {
+    lpq_Hist *H = (lpq_Hist *) lua_touserdata(L, -1);
+    lua_pushvalue(L, -2);
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, (lua_Integer) H[0].count);
+    lua_setfield(L, -2, "count");
+    lpq_pushhist(L, &H[0]);
+    lua_setfield(L, -2, "wait");
+    lpq_pushhist(L, &H[1]);
+    lua_setfield(L, -2, "build");
+    lua_rawset(L, 4);
+    lua_pop(L, 1);
+  }
+  return 1;
+}
+
+static int lpq_conn_resetlatency (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  lpq_pushtrace(L, C);
+  lua_newtable(L);
+  lua_setfield(L, -2, LPQ_TRACE_LATENCY);
+  C->nlatency = 0;
+  return 0;
+}
+
+/* conn:setslowlog([threshold, f]): call f(stmt, nparams, rows, wait, build)
+ * after exec, execp and plan:exec taking at least threshold seconds */
+static int lpq_conn_setslowlog (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  if (lua_isnoneornil(L, 2)) {
+    C->slowms = -1;
+    return 0;
+  }
+  luaL_checknumber(L, 2);
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  lua_settop(L, 3);
+  lpq_pushtrace(L, C);
+  lua_pushvalue(L, 3);
+  lua_setfield(L, -2, LPQ_TRACE_SLOWLOG);
+  C->slowms = (lua_tonumber(L, 2) > 0) ? lua_tonumber(L, 2) * 1000 : 0;
+  return 0;
+}
+
+/* conn:stats(): table of counters; times are in seconds */
+static int lpq_conn_stats (lua_State *L) {
+  lpq_Stats *S = lpq_checkconn(L, 1)->stats;
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, (lua_Integer) S->queries);
+  lua_setfield(L, -2, "queries");
+  lua_pushinteger(L, (lua_Integer) S->results);
+  lua_setfield(L, -2, "results");
+  lua_pushinteger(L, (lua_Integer) S->rows);
+  lua_setfield(L, -2, "rows");
+  lua_pushinteger(L, (lua_Integer) S->bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushinteger(L, (lua_Integer) S->parambytes);
+  lua_setfield(L, -2, "parambytes");
+  lua_pushinteger(L, (lua_Integer) S->prepares);
+  lua_setfield(L, -2, "prepares");
+  lua_pushnumber(L, S->exectime / 1000);
+  lua_setfield(L, -2, "exectime");
+  lua_pushnumber(L, S->decodetime / 1000);
+  lua_setfield(L, -2, "decodetime");
+  return 1;
+}
+
+static int lpq_conn_resetstats (lua_State *L) {
+  lpq_Stats *S = lpq_checkconn(L, 1)->stats;
+  int refs = S->refs;
+  memset(S, 0, sizeof(lpq_Stats));
+  S->refs = refs;
+  return 0;
+}
+
+/* push table in field of environment of conn at 1, created on first use */
+static void lpq_pushconnenv (lua_State *L, const char *field) {
+  lua_getuservalue(L, 1);
+  lua_getfield(L, -1, field);
+  if (lua_isnil(L, -1)) { /* first use? */
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, field);
+  }
+  lua_remove(L, -2); /* env(conn) */
+}
+
+/* integer field k of table at narg, 0 if unset */
+static int lpq_getcounter (lua_State *L, int narg, const char *k) {
+  int n;
+  lua_getfield(L, narg, k);
+  n = (int) lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return n;
+}
+
+static void lpq_setcounter (lua_State *L, int narg, const char *k, int n) {
+  lua_pushinteger(L, n);
+  lua_setfield(L, narg, k);
+}
+
+/* channel, pid, payload = conn:notifies(): next notification, first those
+ * left unrouted by conn:dispatch */
+static int lpq_conn_notifies (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  PGnotify *p;
+  int head, tail;
+  lua_settop(L, 1);
+  lpq_pushconnenv(L, LPQ_CONN_UNROUTED); /* 2 */
+  head = lpq_getcounter(L, 2, "head");
+  tail = lpq_getcounter(L, 2, "tail");
+  if (head < tail) { /* unrouted one? */
+    lua_rawgeti(L, 2, ++head);
+    lua_pushnil(L);
+    lua_rawseti(L, 2, head);
+    lpq_setcounter(L, 2, "head", head);
+    lua_rawgeti(L, 3, 1);
+    lua_rawgeti(L, 3, 2);
+    lua_rawgeti(L, 3, 3);
+    return 3;
+  }
+  p = PQnotifies(C->conn);
+  if (p == NULL) { /* queue is empty? */
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushstring(L, p->relname);
+  lua_pushinteger(L, p->be_pid);
+  lua_pushstring(L, p->extra);
+  PQfreemem(p);
+  return 3;
+}
+
+static int lpq_conn_poll (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  PostgresPollingStatusType status = PQconnectPoll(C->conn);
+  lua_pushboolean(L, status == PGRES_POLLING_OK);
+  switch (status) {
+    case PGRES_POLLING_OK:
+      lua_pushstring(L, "PGRES_POLLING_OK"); break;
+    case PGRES_POLLING_READING:
+      lua_pushstring(L, "PGRES_POLLING_READING"); break;
+    case PGRES_POLLING_WRITING:
+      lua_pushstring(L, "PGRES_POLLING_WRITING"); break;
+    default:
+      lua_pushstring(L, "PGRES_POLLING_FAILED");
+  }
+  return 2;
+}
+
+static int lpq_conn_status (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  ConnStatusType status = PQstatus(C->conn);
+  lua_pushboolean(L, status == CONNECTION_OK);
+  switch (status) {
+    case CONNECTION_OK:
+      lua_pushstring(L, "CONNECTION_OK"); break;
+    case CONNECTION_STARTED:
+      lua_pushstring(L, "CONNECTION_STARTED"); break;
+    case CONNECTION_MADE:
+      lua_pushstring(L, "CONNECTION_MADE"); break;
+    case CONNECTION_AWAITING_RESPONSE:
+      lua_pushstring(L, "CONNECTION_AWAITING_RESPONSE"); break;
+    case CONNECTION_AUTH_OK:
+      lua_pushstring(L, "CONNECTION_AUTH_OK"); break;
+    case CONNECTION_SSL_STARTUP:
+      lua_pushstring(L, "CONNECTION_SSL_STARTUP"); break;
+    case CONNECTION_SETENV:
+      lua_pushstring(L, "CONNECTION_SETENV"); break;
+    default:
+      lua_pushstring(L, "CONNECTION_BAD");
+  }
+  return 2;
+}
+
+static int lpq_conn_finish (lua_State *L) {
+  lpq_finishconn(L, lpq_checkconn(L, 1));
+  return 0;
+}
+
+static int lpq_conn_reset (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  lpq_clearcache(L, C, 0); /* statements are lost with the session */
+  PQreset(C->conn);
+  return 0;
+}
+
+static int lpq_conn_resetstart (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  lpq_clearcache(L, C, 0);
+  lua_pushboolean(L, PQresetStart(C->conn));
+  return 1;
+}
+
+static int lpq_conn_resetpoll (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  PostgresPollingStatusType status = PQresetPoll(C->conn);
+  lua_pushboolean(L, status == PGRES_POLLING_OK);
+  switch (status) {
+    case PGRES_POLLING_OK: lua_pushstring(L, "OK"); break;
+    case PGRES_POLLING_READING: lua_pushstring(L, "READING"); break;
+    case PGRES_POLLING_WRITING: lua_pushstring(L, "WRITING"); break;
+    default: lua_pushstring(L, "FAILED");
+  }
+  return 2;
+}
+
+static int lpq_conn_socket (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  lua_pushinteger(L, PQsocket(C->conn));
+  return 1;
+}
+
+static int lpq_conn_error (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  lua_pushstring(L, PQerrorMessage(C->conn));
+  return 1;
+}
+
+#define lpq_conn_string(name) \
+  static int lpq_conn_ ## name (lua_State *L) { \
+    lpq_Conn *C = lpq_checkconn(L, 1); \
+    lua_pushstring(L, PQ ## name (C->conn)); \
+    return 1; \
+  }
+
+lpq_conn_string(db)
+lpq_conn_string(user)
+lpq_conn_string(pass)
+lpq_conn_string(host)
+lpq_conn_string(port)
+lpq_conn_string(tty)
+lpq_conn_string(options)
+
+static int lpq_conn_escape (lua_State *L) {
+  int error;
+  size_t length;
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  const char *from = luaL_checklstring(L, 2, &length);
+  char *to = (char *) lua_newuserdata(L, 2 * length + 1);
+  length = PQescapeStringConn(C->conn, to, from, length, &error);
+  if (!error) lua_pushlstring(L, to, length);
+  else lua_pushnil(L);
+  return 1;
+}
+
+static int lpq_conn_isbusy (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  lua_pushboolean(L, PQisBusy(C->conn));
+  return 1;
+}
+
+static int lpq_conn_consume (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  return lpq_pushstatus(L, PQconsumeInput(C->conn), C->conn);
+}
+
+/* push status of wait: 1 (ready), 0 (timed out) or -1 (error) */
+static int lpq_pushwait (lua_State *L, int status, PGconn *conn) {
+  if (status > 0) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  lua_pushboolean(L, 0);
+  if (status == 0) lua_pushliteral(L, "timeout");
+  else if (*PQerrorMessage(conn) != '\0') lua_pushstring(L, PQerrorMessage(conn));
+  else lua_pushstring(L, strerror(errno));
+  return 2;
+}
+
+/* ok = conn:wait(mode [, timeout]): wait until socket is ready for reading
+ * or writing; timeout in seconds */
+static int lpq_conn_wait (lua_State *L) {
+  static const char *const modes[] = {"read", "write", NULL};
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  int events = luaL_checkoption(L, 2, NULL, modes) ? POLLOUT : POLLIN;
+  int status = lpq_waitsocket(C->conn, events, lpq_opttimeout(L, 3));
+  return lpq_pushwait(L, (status > 0) ? 1 : status, C->conn);
+}
+
+/* ok = conn:ready([timeout]): consume input until conn:getresult would not
+ * block; timeout in seconds */
+static int lpq_conn_ready (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  return lpq_pushwait(L, lpq_waitready(C->conn, lpq_opttimeout(L, 2)),
+      C->conn);
+}
+
+/* onnotify(channel [, f]): route notifications on channel to f */
+static int lpq_conn_onnotify (lua_State *L) {
+  lpq_checkconn(L, 1);
+  luaL_checkstring(L, 2);
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TFUNCTION);
+  lua_settop(L, 3);
+  lpq_pushconnenv(L, LPQ_CONN_NOTIFY);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 3);
+  lua_rawset(L, -3); /* env(conn).notify[channel] = f */
+  return 0;
+}
+
+/* append value on top to array in field k of table at narg, created on
+ * first use; pops value */
+static void lpq_append (lua_State *L, int narg, const char *k) {
+  lua_getfield(L, narg, k);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, narg, k);
+  }
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, (int) lua_rawlen(L, -2) + 1);
+  lua_pop(L, 1); /* array */
+}
+
+/* route queued notifications to handlers at stack pos 2 as
+ * handler(payload, channel, pid) or, if batch, collect them for
+ * handler(payloads, channel, pids) in tables at 3 (payloads) and 4 (pids)
+ * by channel, with channels in arrival order in the array part of 3;
+ * notifications without handler are queued at 5 for conn:notifies; returns
+ * number of notifications with a handler */
+static int lpq_drainnotifies (lua_State *L, PGconn *conn, int batch) {
+  PGnotify *p;
+  int n = 0;
+  while ((p = PQnotifies(conn)) != NULL) {
+    lua_pushstring(L, p->relname);
+    lua_pushstring(L, p->extra);
+    lua_pushinteger(L, p->be_pid);
+    PQfreemem(p);
+    lua_pushvalue(L, -3);
+    lua_rawget(L, 2); /* handler */
+    if (lua_isnil(L, -1)) { /* not routed: queue {channel, pid, payload} */
+      int tail = lpq_getcounter(L, 5, "tail") + 1;
+      lua_pop(L, 1);
+      lua_createtable(L, 3, 0);
+      lua_insert(L, -4);
+      lua_rawseti(L, -4, 2);
+      lua_rawseti(L, -3, 3);
+      lua_rawseti(L, -2, 1);
+      lua_rawseti(L, 5, tail);
+      lpq_setcounter(L, 5, "tail", tail);
+      continue;
+    }
+    n++;
+    if (!batch) {
+      lua_insert(L, -3); /* channel, handler, payload, pid */
+      lua_pushvalue(L, -4);
+      lua_insert(L, -2);
+      lua_call(L, 3, 0); /* handler(payload, channel, pid) */
+      lua_pop(L, 1); /* channel */
+      continue;
+    }
+    lua_pop(L, 1); /* handler */
+    lua_pushvalue(L, -3);
+    lua_rawget(L, 3);
+    if (lua_isnil(L, -1)) { /* first for channel? */
+      lua_pushvalue(L, -4);
+      lua_rawseti(L, 3, (int) lua_rawlen(L, 3) + 1);
+    }
+    lua_pop(L, 1);
+    lpq_append(L, 4, lua_tostring(L, -3)); /* pid */
+    lpq_append(L, 3, lua_tostring(L, -2)); /* payload */
+    lua_pop(L, 1); /* channel */
+  }
+  return n;
+}
+
+/* dispatch([timeout [, batch]]): wait for notifications up to timeout and
+ * route all queued ones; returns number of notifications routed */
+static int lpq_conn_dispatch (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  int ms = lpq_opttimeout(L, 2);
+  int batch = lua_toboolean(L, 3);
+  double deadline = lpq_clockms() + ms;
+  int i, n, status;
+  lua_settop(L, 1);
+  lpq_pushconnenv(L, LPQ_CONN_NOTIFY); /* 2 */
+  lua_newtable(L); /* 3: batched payloads */
+  lua_newtable(L); /* 4: batched pids */
+  lpq_pushconnenv(L, LPQ_CONN_UNROUTED); /* 5 */
+  if (!PQconsumeInput(C->conn)) return lpq_pushwait(L, -1, C->conn);
+  while ((n = lpq_drainnotifies(L, C->conn, batch)) == 0) {
+    status = lpq_waitsocket(C->conn, POLLIN,
+        (ms < 0) ? -1 : lpq_timeleft(deadline));
+    if (status == 0) break; /* timeout */
+    if (status < 0 || !PQconsumeInput(C->conn))
+      return lpq_pushwait(L, -1, C->conn);
+  }
+  for (i = 1; batch && i <= (int) lua_rawlen(L, 3); i++) {
+    lua_rawgeti(L, 3, i); /* channel */
+    lua_pushvalue(L, -1);
+    lua_rawget(L, 2); /* handler, possibly changed by previous ones */
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 2);
+      continue;
+    }
+    lua_pushvalue(L, -2);
+    lua_rawget(L, 3); /* payloads */
+    lua_pushvalue(L, -3);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, 4); /* pids */
+    lua_call(L, 3, 0); /* handler(payloads, channel, pids) */
+    lua_pop(L, 1); /* channel */
+  }
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+static int lpq_conn_query (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  const char *cmd = luaL_checkstring(L, 2);
+  C->stats->queries++;
+  return lpq_pushstatus(L, PQsendQueryParams(C->conn, cmd,
+      0, NULL, NULL, NULL, NULL, 1), /* binary, no params */
+      C->conn);
+}
+
+static int lpq_conn_flush (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  int status = PQflush(C->conn);
+  if (status < 0) return lpq_pushstatus(L, 0, C->conn);
+  lua_pushboolean(L, status == 0); /* all data sent? */
+  return 1;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+static int lpq_conn_enterpipeline (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  return lpq_pushstatus(L, PQenterPipelineMode(C->conn), C->conn);
+}
+
+static int lpq_conn_exitpipeline (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  return lpq_pushstatus(L, PQexitPipelineMode(C->conn), C->conn);
+}
+
+static int lpq_conn_pipelinesync (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  return lpq_pushstatus(L, PQpipelineSync(C->conn), C->conn);
+}
+
+static int lpq_conn_sendflushrequest (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  return lpq_pushstatus(L, PQsendFlushRequest(C->conn), C->conn);
+}
+
+static int lpq_conn_pipelinestatus (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  PGpipelineStatus status = PQpipelineStatus(C->conn);
+  lua_pushboolean(L, status == PQ_PIPELINE_ON);
   switch (status) {
-    case CONNECTION_OK:
-      lua_pushstring(L, "CONNECTION_OK"); break;
-    case CONNECTION_STARTED:
-      lua_pushstring(L, "CONNECTION_STARTED"); break;
-    case CONNECTION_MADE:
-      lua_pushstring(L, "CONNECTION_MADE"); break;
-    case CONNECTION_AWAITING_RESPONSE:
-      lua_pushstring(L, "CONNECTION_AWAITING_RESPONSE"); break;
-    case CONNECTION_AUTH_OK:
-      lua_pushstring(L, "CONNECTION_AUTH_OK"); break;
-    case CONNECTION_SSL_STARTUP:
-      lua_pushstring(L, "CONNECTION_SSL_STARTUP"); break;
-    case CONNECTION_SETENV:
-      lua_pushstring(L, "CONNECTION_SETENV"); break;
+    case PQ_PIPELINE_ON:
+      lua_pushstring(L, "PQ_PIPELINE_ON"); break;
+    case PQ_PIPELINE_ABORTED:
+      lua_pushstring(L, "PQ_PIPELINE_ABORTED"); break;
+    default:
+      lua_pushstring(L, "PQ_PIPELINE_OFF");
+  }
+  return 2;
+}
+#endif
+
+/* move result of R (on top) to an anchor referenced by its text-like
+ * columns, so that their values may be returned as views */
+static void lpq_anchorviews (lua_State *L, lpq_Rset *R, int viewsize) {
+  int f, ref = LUA_NOREF;
+  for (f = 0; f < R->n; f++) {
+    lpq_Column *c = &R->col[f];
+    if (c->decode != lpq_decodetext) continue;
+    if (ref == LUA_NOREF) { /* first view column? */
+      PGresult **A = (PGresult **) lua_newuserdata(L, sizeof(PGresult *));
+      *A = R->result;
+      lua_pushlightuserdata(L, LPQ_ANCHOR_MT);
+      lua_rawget(L, LUA_REGISTRYINDEX);
+      lua_setmetatable(L, -2);
+      R->anchored = 1;
+      ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      c->ref = ref;
+    }
+    else {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+      c->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    c->viewsize = viewsize;
+    c->decode = lpq_decodeview;
+  }
+}
+
+/* related to lpq_Rset */
+/* lpq_Rset MT as second upvalue */
+/* C is the connection of result, or NULL */
+static int lpq_pushresult (lua_State *L, lpq_Conn *C, PGresult *result) {
+  if (result == NULL) lua_pushnil(L);
+  else {
+    int f, nf = PQnfields(result), cat = 0;
+    lpq_Rset *R = (lpq_Rset *) lua_newuserdata(L, sizeof(lpq_Rset)
+        + nf * sizeof(lpq_Column));
+    ExecStatusType status = PQresultStatus(result);
+    R->result = result;
+    R->status = status;
+    R->stats = NULL;
+    R->anchored = 0;
+    R->n = 0;
+    R->col = (lpq_Column *) (R + 1);
+    lua_pushvalue(L, lua_upvalueindex(2)); /* lpq_Rset MT */
+    lua_setmetatable(L, -2);
+    if (C != NULL) {
+      R->stats = C->stats;
+      R->stats->refs++;
+      lpq_countresult(R->stats, result);
+    }
+    if (C != NULL) cat = lpq_pushcatalog(L, C);
+    for (f = 0; f < nf; f++, R->n++) /* resolve decoders */
+      lpq_initcolumn(L, &R->col[f], PQftype(result, f), PQfmod(result, f),
+          cat);
+    if (cat != 0) lua_pop(L, 1);
+    if (C != NULL) lpq_setmodes(R->col, R->n, C);
+    if (C != NULL && C->viewsize > 0) lpq_anchorviews(L, R, C->viewsize);
+    if (status == PGRES_TUPLES_OK) { /* from SELECT? */
+      /* store field name table in udata environment */
+      int i, n = PQnfields(R->result);
+      lua_newtable(L);
+      lua_createtable(L, 0, n);
+      for (i = 0; i < n; i++) {
+        lua_pushstring(L, PQfname(R->result, i));
+        lua_pushinteger(L, i);
+        lua_rawset(L, -3);
+      }
+      lua_setfield(L, -2, LPQ_RSET_FIELDS);
+      lua_setuservalue(L, -2);
+    }
+  }
+  return 1;
+}
+
+static int lpq_conn_getresult (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  return lpq_pushresult(L, C, PQgetResult(C->conn));
+}
+
+static int lpq_conn_exec (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  const char *cmd = luaL_checkstring(L, 2);
+  double t = lpq_clockms(), t1;
+  PGresult *result = PQexecParams(C->conn, cmd,
+      0, NULL, NULL, NULL, NULL, 1); /* binary, no params */
+  t1 = lpq_clockms();
+  C->stats->exectime += t1 - t;
+  C->stats->queries++;
+  lpq_pushresult(L, C, result);
+  if (C->latency || C->slowms >= 0) {
+    lua_pushvalue(L, 2); /* cmd */
+    lpq_trace(L, C, 0, t, t1);
+  }
+  return 1;
+}
+
+#if LUA_VERSION_NUM >= 502
+/* async exec: object (conn or plan) at stack pos 1, last result at 2 */
+#define LPQ_AEXEC_CONN 0
+#define LPQ_AEXEC_PLAN 1
+
+static int lpq_aexecaux (lua_State *L, int kind);
+
+#if LUA_VERSION_NUM >= 503
+static int lpq_aexeck (lua_State *L, int status, lua_KContext ctx) {
+  (void) status;
+  return lpq_aexecaux(L, (int) ctx);
+}
+#else
+static int lpq_aexeck (lua_State *L) {
+  int ctx = 0;
+  lua_getctx(L, &ctx);
+  return lpq_aexecaux(L, ctx);
+}
+#endif
+
+static int lpq_aexecfail (lua_State *L, PGconn *conn) {
+  PQsetnonblocking(conn, 0);
+  lua_pushnil(L);
+  lua_pushstring(L, PQerrorMessage(conn));
+  return 2;
+}
+
+/* hand socket and wanted event to scheduler; resume in lpq_aexeck */
+static int lpq_aexecyield (lua_State *L, PGconn *conn, const char *event,
+                           int kind) {
+  lua_pushinteger(L, PQsocket(conn));
+  lua_pushstring(L, event);
+  return lua_yieldk(L, 2, kind, lpq_aexeck);
+}
+
+static int lpq_aexecaux (lua_State *L, int kind) {
+  lpq_Conn *C;
+  PGconn *conn;
+  PGresult *result;
+  int status;
+  lua_settop(L, 2); /* discard values passed to resume */
+  if (kind == LPQ_AEXEC_PLAN) {
+    lpq_Plan *P = (lpq_Plan *) lua_touserdata(L, 1);
+    if (!P->valid)
+      luaL_error(L, "referenced " LPQ_CONN_NAME " is finished");
+    C = P->conn;
+  }
+  else {
+    C = (lpq_Conn *) lua_touserdata(L, 1);
+    if (C->done) luaL_error(L, LPQ_CONN_NAME " is finished");
+  }
+  conn = C->conn;
+  if ((status = PQflush(conn)) != 0) { /* query not sent yet? */
+    if (status < 0) return lpq_aexecfail(L, conn);
+    return lpq_aexecyield(L, conn, "write", kind);
+  }
+  for (;;) { /* collect results, keep last as PQexec does */
+    if (!PQconsumeInput(conn)) return lpq_aexecfail(L, conn);
+    if (PQisBusy(conn)) return lpq_aexecyield(L, conn, "read", kind);
+    result = PQgetResult(conn);
+    if (result == NULL) break;
+    lpq_pushresult(L, C, result);
+    lua_replace(L, 2);
+    status = PQresultStatus(result);
+    if (status == PGRES_COPY_IN || status == PGRES_COPY_OUT
+        || status == PGRES_COPY_BOTH) break;
+  }
+  PQsetnonblocking(conn, 0);
+  return 1;
+}
+
+static void lpq_checkyieldable (lua_State *L) {
+#if LUA_VERSION_NUM >= 503
+  if (!lua_isyieldable(L)) luaL_error(L, "aexec called outside a coroutine");
+#else
+  (void) L;
+#endif
+}
+
+static int lpq_conn_aexec (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  const char *cmd = luaL_checkstring(L, 2);
+  lpq_checkyieldable(L);
+  if (PQsetnonblocking(C->conn, 1) != 0
+      || !PQsendQueryParams(C->conn, cmd, 0, NULL, NULL, NULL, NULL, 1))
+    return lpq_aexecfail(L, C->conn);
+  C->stats->queries++;
+  lua_settop(L, 1);
+  lua_pushnil(L); /* last result */
+  return lpq_aexecaux(L, LPQ_AEXEC_CONN);
+}
+#endif
+
+/* related to lpq_Copy */
+static const char lpq_copysignature[] = "PGCOPY\n\377\r\n"; /* and '\0' */
+
+static void lpq_copyabort (PGconn *conn, const char *errmsg) {
+  PGresult *result;
+  PQputCopyEnd(conn, errmsg);
+  while ((result = PQgetResult(conn)) != NULL) PQclear(result);
+}
+
+/* discard what is left of a COPY TO STDOUT; a cancel request could abort
+ * the enclosing transaction or, if late, hit the next command */
+static void lpq_copydrain (PGconn *conn) {
+  char *buf;
+  PGresult *result;
+  while (PQgetCopyData(conn, &buf, 0) > 0) PQfreemem(buf);
+  while ((result = PQgetResult(conn)) != NULL) PQclear(result);
+}
+
+/* make room for sz bytes at the end of pending COPY data */
+static char *lpq_copyreserve (lua_State *L, lpq_Copy *K, size_t sz) {
+  if (K->used + sz > K->size) {
+    size_t size = (K->size > 0) ? K->size : LPQ_COPY_BUFSIZE;
+    char *buf;
+    while (size < K->used + sz) size *= 2;
+    buf = (char *) realloc(K->buf, size);
+    if (buf == NULL) luaL_error(L, "not enough memory for " LPQ_COPY_NAME);
+    K->buf = buf;
+    K->size = size;
+  }
+  return K->buf + K->used;
+}
+
+/* lpq_Copy for a COPY result with column types in table at stack pos 3 */
+/* lpq_Copy MT as second upvalue */
+static lpq_Copy *lpq_newcopy (lua_State *L, lpq_Conn *C, PGresult *result) {
+  int i, n = PQnfields(result);
+  int hastypes = (lua_type(L, 3) == LUA_TTABLE);
+  lpq_Copy *K = (lpq_Copy *) lua_newuserdata(L, sizeof(lpq_Copy)
+      + n * (sizeof(lpq_Column) + sizeof(Oid) + sizeof(int)));
+  K->conn = C;
+  K->n = n;
+  K->binary = PQbinaryTuples(result);
+  K->out = (PQresultStatus(result) == PGRES_COPY_OUT);
+  K->done = 0;
+  K->row = K->binary ? -1 : 0; /* binary header pending? */
+  K->col = (lpq_Column *) (K + 1);
+  K->type = (Oid *) (K->col + n);
+  K->length = (int *) (K->type + n);
+  K->buf = NULL;
+  K->used = K->size = 0;
+  for (i = 0; i < n; i++) {
+    if (hastypes) {
+      lua_rawgeti(L, 3, i + 1);
+      K->type[i] = (Oid) lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    }
+    else K->type[i] = 0; /* raw */
+    K->col[i].ref = LUA_NOREF;
+    K->col[i].elem = NULL;
+    K->col[i].n = 0;
+  }
+  lua_pushvalue(L, lua_upvalueindex(2)); /* lpq_Copy MT */
+  lua_setmetatable(L, -2);
+  if (K->out) { /* resolve decoders */
+    int cat = lpq_pushcatalog(L, C);
+    for (i = 0; i < n; i++)
+      lpq_initcolumn(L, &K->col[i], K->type[i], -1, cat);
+    if (cat != 0) lua_pop(L, 1);
+    lpq_setmodes(K->col, n, C);
+  }
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1); /* env(copy)[1] = conn */
+  lua_setuservalue(L, -2);
+  return K;
+}
+
+/* copy = conn:copyin(stmt [, types]) */
+/* lpq_Copy MT as second upvalue */
+static int lpq_conn_copyin (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  const char *cmd = luaL_checkstring(L, 2);
+  lpq_Copy *K;
+  double t = lpq_clockms();
+  PGresult *result = PQexec(C->conn, cmd);
+  C->stats->exectime += lpq_clockms() - t;
+  C->stats->queries++;
+  if (PQresultStatus(result) != PGRES_COPY_IN) {
+    const char *msg = PQerrorMessage(C->conn);
+    PQclear(result);
+    lua_pushnil(L);
+    lua_pushstring(L, (*msg != '\0') ? msg : "COPY FROM STDIN expected");
+    return 2;
+  }
+  if (PQbinaryTuples(result) && (lua_type(L, 3) != LUA_TTABLE
+        || (int) lua_rawlen(L, 3) < PQnfields(result))) {
+    PQclear(result);
+    lpq_copyabort(C->conn, "column types not provided");
+    return luaL_argerror(L, 3, "column types expected for binary COPY");
+  }
+  K = lpq_newcopy(L, C, result);
+  PQclear(result);
+  if (K->binary) { /* signature, flags, and header extension length */
+    char *v = lpq_copyreserve(L, K, LPQ_COPY_SIGLEN + 8);
+    memcpy(v, lpq_copysignature, LPQ_COPY_SIGLEN);
+    lpq_putuint32(v + LPQ_COPY_SIGLEN, 0);
+    lpq_putuint32(v + LPQ_COPY_SIGLEN + 4, 0);
+    K->used += LPQ_COPY_SIGLEN + 8;
+  }
+  return 1;
+}
+
+static int lpq_copyoutaux (lua_State *L);
+
+/* iterator, copy = conn:copyout(stmt [, types [, rowindex]]) */
+/* lpq_Copy MT as second upvalue */
+static int lpq_conn_copyout (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  const char *cmd = luaL_checkstring(L, 2);
+  int rowindex = lua_toboolean(L, 4);
+  double t = lpq_clockms();
+  PGresult *result = PQexec(C->conn, cmd);
+  C->stats->exectime += lpq_clockms() - t;
+  C->stats->queries++;
+  if (PQresultStatus(result) != PGRES_COPY_OUT) {
+    const char *msg = PQerrorMessage(C->conn);
+    PQclear(result);
+    lua_pushnil(L);
+    lua_pushstring(L, (*msg != '\0') ? msg : "COPY TO STDOUT expected");
+    return 2;
+  }
+  lpq_newcopy(L, C, result);
+  PQclear(result);
+  lua_pushvalue(L, -1);
+  lua_pushboolean(L, rowindex);
+  lua_pushcclosure(L, lpq_copyoutaux, 2);
+  lua_insert(L, -2);
+  return 2; /* iterator, copy */
+}
+
+/* related to lpq_Stream */
+static int lpq_streamaux (lua_State *L);
+
+static int lpq_setchunkmode (PGconn *conn, int chunksize) {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+  return PQsetChunkedRowsMode(conn, chunksize);
+#else
+  (void) conn; (void) chunksize;
+  return 0; /* libpq < 17 */
+#endif
+}
+
+/* iterator, stream = conn:stream(stmt [, params [, chunksize]]) */
+/* lpq_Stream MT as second upvalue */
+static int lpq_conn_stream (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  const char *cmd = luaL_checkstring(L, 2);
+  int chunksize = (int) luaL_optinteger(L, 4, 1);
+  int i, n = 0, status;
+  const char **value = NULL;
+  lpq_Stream *S;
+  if (!lua_isnoneornil(L, 3)) { /* params, sent as text */
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "n");
+    n = lua_isnumber(L, -1) ? (int) lua_tointeger(L, -1) : (int) lua_rawlen(L, 3);
+    lua_pop(L, 1);
+    luaL_checkstack(L, n + 1, "too many parameters");
+    value = (const char **) lua_newuserdata(L, n * sizeof(char *));
+    for (i = 0; i < n; i++) { /* converted values are kept in the stack */
+      lua_rawgeti(L, 3, i + 1);
+      switch (lua_type(L, -1)) {
+        case LUA_TNIL: value[i] = NULL; break;
+        case LUA_TBOOLEAN:
+          value[i] = lua_toboolean(L, -1) ? "t" : "f"; break;
+        case LUA_TNUMBER:
+          value[i] = lpq_pushnumstring(L, -1);
+          lua_replace(L, -2);
+          break;
+        default:
+          value[i] = lua_tostring(L, -1);
+          if (value[i] == NULL)
+            luaL_error(L, "parameter %d: %s not supported", i + 1,
+                luaL_typename(L, -1));
+      }
+    }
+  }
+  status = PQsendQueryParams(C->conn, cmd, n, NULL, value, NULL, NULL, 1);
+  if (!status) return lpq_pushstatus(L, status, C->conn);
+  C->stats->queries++;
+  if (chunksize <= 1 || !lpq_setchunkmode(C->conn, chunksize))
+    PQsetSingleRowMode(C->conn); /* or fall back to a single result */
+  S = (lpq_Stream *) lua_newuserdata(L, sizeof(lpq_Stream));
+  S->conn = C;
+  S->result = NULL;
+  S->row = S->count = 0;
+  S->done = 0;
+  S->n = 0;
+  S->col = NULL;
+  lua_pushvalue(L, lua_upvalueindex(2)); /* lpq_Stream MT */
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1); /* env(stream)[1] = conn */
+  lua_setuservalue(L, -2);
+  lua_pushvalue(L, -1);
+  lua_pushcclosure(L, lpq_streamaux, 1);
+  lua_insert(L, -2);
+  return 2; /* iterator, stream */
+}
+
+/* related to lpq_Plan */
+/* lpq_Plan MT at stack pos mt */
+static lpq_Plan *lpq_getplan (lua_State *L, lpq_Conn *C, const char *name,
+                              int mt) {
+  lpq_Plan *P = NULL;
+  double t = lpq_clockms();
+  PGresult *result = PQdescribePrepared(C->conn, name);
+  ExecStatusType status = PQresultStatus(result);
+  C->stats->exectime += lpq_clockms() - t;
+  C->stats->prepares++;
+  if (status == PGRES_COMMAND_OK) {
+    int i, n = PQnparams(result);
+    P = (lpq_Plan *) lua_newuserdata(L, sizeof(lpq_Plan)
+        + n * (sizeof(Oid) + sizeof(char *) + 2 * sizeof(int)));
+    P->conn = C;
+    /* keep reference in conn env and set P->name */
+    lua_getuservalue(L, 1); /* note: conn at stack pos 1 */
+    lua_pushlightuserdata(L, P);
+    lua_pushstring(L, name);
+    P->name = lua_tostring(L, -1);
+    lua_rawset(L, -3); /* env(conn)[light(P)] = name */
+    lua_pop(L, 1); /* env */
+    /* set param pointers */
+    P->n = n;
+    P->type = (Oid *) (P + 1);
+    P->value = (const char **) (P->type + n);
+    P->length = (int *) (P->value + n);
+    P->format = (int *) (P->length + n);
+    for (i = 0; i < n; i++) {
+      P->type[i] = PQparamtype(result, i);
+      P->format[i] = 1; /* binary */
+    }
+    P->valid = 1;
+    P->stmt = NULL;
+    P->stmtlen = 0;
+    P->prev = P->next = NULL;
+    /* set lpq_Plan MT */
+    lua_pushvalue(L, mt);
+    lua_setmetatable(L, -2);
+  }
+  else lua_pushnil(L);
+  PQclear(result);
+  return P;
+}
+
+/* plan = conn:prepare(stmt [, name]) */
+/* lpq_Plan MT as upvalue */
+static int lpq_conn_prepare (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  const char *query = luaL_checkstring(L, 2);
+  const char *name = luaL_optstring(L, 3, "");
+  lpq_Plan *P = NULL;
+  double t = lpq_clockms();
+  /* types are inferred by the server */
+  PGresult *result = PQprepare(C->conn, name, query, 0, NULL);
+  ExecStatusType status = PQresultStatus(result);
+  PQclear(result);
+  C->stats->exectime += lpq_clockms() - t;
+  C->stats->prepares++;
+  if (status == PGRES_COMMAND_OK)
+    P = lpq_getplan(L, C, name, lua_upvalueindex(2));
+  else lua_pushnil(L);
+  if (P == NULL) {
+    lua_pushstring(L, PQerrorMessage(C->conn));
+    return 2;
+  }
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2); /* env(plan) = {query} */
+  return 1;
+}
+
+/* plan = conn:getplan([name]) */
+/* lpq_Plan MT as upvalue */
+static int lpq_conn_getplan (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  const char *name = luaL_optstring(L, 2, "");
+  lpq_Plan *P = lpq_getplan(L, C, name, lua_upvalueindex(2));
+  if (P == NULL) {
+    lua_pushstring(L, PQerrorMessage(C->conn));
+    return 2;
+  }
+  return 1;
+}
+
+
+static void lpq_setparamsat (lua_State *L, lpq_Plan *P, int narg);
+
+/* cached plan for stmt at stack pos 2, prepared if not cached */
+/* lpq_Plan MT as third upvalue */
+static lpq_Plan *lpq_cachedplan (lua_State *L, lpq_Conn *C) {
+  size_t l;
+  const char *stmt = luaL_checklstring(L, 2, &l);
+  const char *name;
+  lpq_Plan *P;
+  PGresult *result;
+  ExecStatusType status;
+  double t;
+  lua_getuservalue(L, 1);
+  lua_getfield(L, -1, LPQ_CONN_CACHE);
+  if (lua_isnil(L, -1)) { /* first use? */
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, LPQ_CONN_CACHE);
+  }
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  P = (lpq_Plan *) lua_touserdata(L, -1);
+  if (P != NULL) { /* hit: move to front */
+    lua_pop(L, 3);
+    if (P != C->head) {
+      P->prev->next = P->next;
+      if (P->next != NULL) P->next->prev = P->prev;
+      else C->tail = P->prev;
+      P->prev = NULL;
+      P->next = C->head;
+      C->head->prev = P;
+      C->head = P;
+    }
+    return P;
+  }
+  lua_pop(L, 3);
+  while (C->ncached >= C->maxcached && C->tail != NULL)
+    lpq_uncache(L, C, C->tail, 1); /* evict least recently used */
+  name = (C->maxcached > 0) /* unnamed statement if cache is disabled */
+    ? lua_pushfstring(L, "lpq_stmt_%d", ++C->nextid) : "";
+  t = lpq_clockms();
+  result = PQprepare(C->conn, name, stmt, 0, NULL);
+  status = PQresultStatus(result);
+  PQclear(result);
+  C->stats->exectime += lpq_clockms() - t;
+  C->stats->prepares++;
+  if (status != PGRES_COMMAND_OK) return NULL;
+  P = lpq_getplan(L, C, name, lua_upvalueindex(3));
+  if (P == NULL) return NULL;
+  if (C->maxcached > 0) {
+    lua_getuservalue(L, 1);
+    lua_getfield(L, -1, LPQ_CONN_CACHE);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -4); /* plan */
+    lua_rawset(L, -3); /* env(conn).cache[stmt] = plan */
+    lua_pop(L, 2);
+    P->stmt = stmt; /* anchored as cache key */
+    P->stmtlen = l;
+    P->next = C->head;
+    if (C->head != NULL) C->head->prev = P;
+    else C->tail = P;
+    C->head = P;
+    C->ncached++;
+  }
+  return P;
+}
+
+/* rset = conn:execp(stmt, ...): prepared and cached by statement text */
+/* lpq_Rset MT as second and lpq_Plan MT as third upvalue */
+static int lpq_conn_execp (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  int nargs = lua_gettop(L);
+  lpq_Plan *P = lpq_cachedplan(L, C);
+  PGresult *result;
+  double t, t1;
+  int base = 3; /* first parameter */
+  if (P == NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, PQerrorMessage(C->conn));
+    return 2;
+  }
+  if (P->stmt == NULL) { /* not cached: plan only lives for this call */
+    lua_insert(L, 2); /* below stmt */
+    base++;
+    nargs++;
+    lua_getuservalue(L, 1);
+    lua_pushlightuserdata(L, P);
+    lua_pushnil(L);
+    lua_rawset(L, -3); /* env(conn)[light(P)] = nil */
+    P->valid = 0;
+  }
+  lua_settop(L, nargs);
+  lua_settop(L, P->n + base - 1);
+  lpq_setparamsat(L, P, base);
+  t = lpq_clockms();
+  result = PQexecPrepared(C->conn, P->name, P->n, P->value,
+      P->length, P->format, 1); /* binary */
+  t1 = lpq_clockms();
+  C->stats->exectime += t1 - t;
+  C->stats->queries++;
+  lpq_pushresult(L, C, result);
+  if (C->latency || C->slowms >= 0) {
+    lua_pushvalue(L, base - 1); /* stmt */
+    lpq_trace(L, C, P->n, t, t1);
+  }
+  return 1;
+}
+
+/* n = conn:setcachesize(n): #statements cached by conn:execp; returns
+ * previous size */
+static int lpq_conn_setcachesize (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  int n = (int) luaL_checkinteger(L, 2);
+  luaL_argcheck(L, n >= 0, 2, "non-negative size expected");
+  lua_pushinteger(L, C->maxcached);
+  C->maxcached = n;
+  while (C->ncached > n) lpq_uncache(L, C, C->tail, 1);
+  return 1;
+}
+
+/* conn:setnumeric(mode): decode numeric values in later results as "number"
+ * (default), exact "string" or "integer"; returns previous mode */
+static int lpq_conn_setnumeric (lua_State *L) {
+  static const char *const modes[] = {"number", "string", "integer", NULL};
+  static const lpq_Decoder decoders[] = {lpq_decodenumeric,
+    lpq_decodenumericstr, lpq_decodenumericint};
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  int i, mode = luaL_checkoption(L, 2, NULL, modes);
+  for (i = 0; decoders[i] != C->numeric; i++) ;
+  lua_pushstring(L, modes[i]);
+  C->numeric = decoders[mode];
+  return 1;
+}
+
+/* conn:settimestamp(mode): decode timestamp and timestamptz values in later
+ * results as "number" of seconds (default), "integer" microseconds since
+ * the Unix epoch, or "table"; returns previous mode */
+static int lpq_conn_settimestamp (lua_State *L) {
+  static const char *const modes[] = {"number", "integer", "table", NULL};
+  static const lpq_Decoder decoders[] = {lpq_decodetimestamp,
+    lpq_decodetimestampint, lpq_decodetimestamptable};
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  int i, mode = luaL_checkoption(L, 2, NULL, modes);
+  for (i = 0; decoders[i] != C->timestamp; i++) ;
+  lua_pushstring(L, modes[i]);
+  C->timestamp = decoders[mode];
+  return 1;
+}
+
+/* conn:setviews([minsize]): text-like values of at least minsize bytes
+ * in later results are returned as views; nil or 0 turns views off */
+static int lpq_conn_setviews (lua_State *L) {
+  lpq_Conn *C = lpq_checkconn(L, 1);
+  int n = (int) luaL_optinteger(L, 2, 0);
+  luaL_argcheck(L, n >= 0, 2, "non-negative size expected");
+  lua_pushinteger(L, C->viewsize);
+  C->viewsize = n;
+  return 1;
+}
+
+
+/* =======   lpq_Plan   ======= */
+
+static lpq_Plan *lpq_checkplan (lua_State *L, int narg) {
+  lpq_Plan *P = NULL;
+  if (lua_getmetatable(L, narg)) { /* has metatable? */
+    if (lua_rawequal(L, -1, lua_upvalueindex(1))) /* MT == upvalue? */
+      P = (lpq_Plan *) lua_touserdata(L, narg);
+    lua_pop(L, 1); /* MT */
+  }
+  if (P == NULL) lpq_typeerror(L, narg, LPQ_PLAN_NAME);
+  if (!P->valid)
+    luaL_error(L, "referenced " LPQ_CONN_NAME " is finished");
+  return P;
+}
+
+
+static int lpq_plan__len (lua_State *L) {
+  lpq_Plan *P = (lpq_Plan *) lua_touserdata(L, 1);
+  lua_pushinteger(L, P->n);
+  return 1;
+}
+
+static int lpq_plan__tostring (lua_State *L) {
+  lua_pushfstring(L, LPQ_PLAN_NAME ": %p", (void *) lua_touserdata(L, 1));
+  return 1;
+}
+
+/* encode params at stack positions narg, ..., narg + P->n - 1 */
+static void lpq_setparamsat (lua_State *L, lpq_Plan *P, int narg) {
+  int i;
+  luaL_Buffer buf;
+  lpq_encodetables(L, P->type, narg, P->n);
+  luaL_buffinit(L, &buf);
+  for (i = 0; i < P->n; i++)
+    P->length[i] = lpq_tovalue(L, narg + i, P->type[i], &buf);
+  luaL_pushresult(&buf);
+  P->conn->stats->parambytes += lua_rawlen(L, -1);
+  if (P->n > 0) P->value[0] = lua_tostring(L, -1);
+  for (i = 0; i < P->n - 1; i++)
+    P->value[i + 1] = P->value[i] + P->length[i];
+}
+
+static void lpq_setparams (lua_State *L, lpq_Plan *P) {
+  lua_settop(L, P->n + 1);
+  lpq_setparamsat(L, P, 2);
+}
+
+static int lpq_plan_query (lua_State *L) {
+  lpq_Plan *P = lpq_checkplan(L, 1);
+  lpq_setparams(L, P);
+  P->conn->stats->queries++;
+  return lpq_pushstatus(L, PQsendQueryPrepared(P->conn->conn, P->name, P->n,
+      P->value, P->length, P->format, 1), /* binary */
+      P->conn->conn);
+}
+
+#if LUA_VERSION_NUM >= 502
+static int lpq_plan_aexec (lua_State *L) {
+  lpq_Plan *P = lpq_checkplan(L, 1);
+  PGconn *conn = P->conn->conn;
+  lpq_checkyieldable(L);
+  lpq_setparams(L, P);
+  if (PQsetnonblocking(conn, 1) != 0
+      || !PQsendQueryPrepared(conn, P->name, P->n,
+        P->value, P->length, P->format, 1)) /* binary */
+    return lpq_aexecfail(L, conn);
+  P->conn->stats->queries++;
+  lua_settop(L, 1);
+  lua_pushnil(L); /* last result */
+  return lpq_aexecaux(L, LPQ_AEXEC_PLAN);
+}
+#endif
+
+static int lpq_plan_exec (lua_State *L) {
+  lpq_Plan *P = lpq_checkplan(L, 1);
+  lpq_Stats *S = P->conn->stats;
+  PGresult *result;
+  double t, t1;
+  lpq_setparams(L, P);
+  t = lpq_clockms();
+  result = PQexecPrepared(P->conn->conn, P->name, P->n,
+      P->value, P->length, P->format, 1); /* binary */
+  t1 = lpq_clockms();
+  S->exectime += t1 - t;
+  S->queries++;
+  lpq_pushresult(L, P->conn, result);
+  if (P->conn->latency || P->conn->slowms >= 0) {
+    lua_getuservalue(L, 1);
+    if (lua_istable(L, -1)) lua_rawgeti(L, -1, 1); /* query from prepare */
+    else lua_pushnil(L);
+    lua_remove(L, -2);
+    if (lua_type(L, -1) != LUA_TSTRING) { /* plan from getplan? */
+      lua_pop(L, 1);
+      lua_pushstring(L, P->name);
+    }
+    lpq_trace(L, P->conn, P->n, t, t1);
+  }
+  return 1;
+}
+
+/* push params of row at stack pos 2 and encode them */
+static void lpq_setrowparams (lua_State *L, lpq_Plan *P, int i) {
+  int j;
+  lua_settop(L, 3);
+  lua_rawgeti(L, 2, i);
+  if (lua_type(L, 4) != LUA_TTABLE)
+    luaL_error(L, "row %d: table expected, got %s", i, luaL_typename(L, 4));
+  luaL_checkstack(L, P->n + 1, "too many parameters");
+  for (j = 1; j <= P->n; j++) lua_rawgeti(L, 4, j);
+  lpq_setparamsat(L, P, 5);
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+/* queue rows in table at 2 for plan at 1 (light userdata) in blocking
+ * pipeline mode, where libpq sends when its buffer fills and reads results
+ * while a send waits; called protected, as encoding may raise errors;
+ * returns #rows queued */
+static int lpq_sendrows (lua_State *L) {
+  lpq_Plan *P = (lpq_Plan *) lua_touserdata(L, 1);
+  PGconn *conn = P->conn->conn;
+  lpq_Stats *S = P->conn->stats;
+  int i, n = (int) lua_rawlen(L, 2);
+  for (i = 1; i <= n; i++) {
+    double t;
+    int sent;
+    lpq_setrowparams(L, P, i);
+    t = lpq_clockms();
+    sent = PQsendQueryPrepared(conn, P->name, P->n, P->value, P->length,
+        P->format, 1); /* binary */
+    S->exectime += lpq_clockms() - t;
+    if (!sent) break;
+    S->queries++;
+  }
+  lua_pushinteger(L, i - 1);
+  return 1;
+}
+
+/* leave pipeline of failed plan:execmany: send a sync unless synced, drain
+ * results up to the sync and restore nonblocking mode */
+static void lpq_abortpipeline (PGconn *conn, int nonblocking, int synced) {
+  if ((synced || PQpipelineSync(conn)) && lpq_flushsocket(conn)) {
+    for (;;) {
+      PGresult *result = PQgetResult(conn);
+      ExecStatusType status;
+      if (result == NULL) { /* end of a query's results */
+        if (PQstatus(conn) == CONNECTION_BAD) break;
+        continue;
+      }
+      status = PQresultStatus(result);
+      PQclear(result);
+      if (status == PGRES_PIPELINE_SYNC) break;
+    }
+  }
+  PQsetnonblocking(conn, nonblocking);
+  PQexitPipelineMode(conn);
+}
+#endif
+
+/* rsets = plan:execmany(rows) */
+/* lpq_Rset MT as second upvalue */
+static int lpq_plan_execmany (lua_State *L) {
+  lpq_Plan *P = lpq_checkplan(L, 1);
+  PGconn *conn = P->conn->conn;
+  lpq_Stats *S = P->conn->stats;
+  double t;
+  int i, n;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = (int) lua_rawlen(L, 2);
+  lua_settop(L, 2);
+  lua_createtable(L, n, 0); /* results at 3 */
+#ifdef LIBPQ_HAS_PIPELINING
+  {
+    int nonblocking = PQisnonblocking(conn);
+    int synced = 0;
+    PGresult *result;
+    if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF)
+      luaL_error(L, LPQ_CONN_NAME " already in pipeline mode");
+    if (!PQenterPipelineMode(conn)) return lpq_pushstatus(L, 0, conn);
+    PQsetnonblocking(conn, 0); /* libpq reads while its sends wait */
+    lua_pushcfunction(L, lpq_sendrows);
+    lua_pushlightuserdata(L, P);
+    lua_pushvalue(L, 2);
+    if (lua_pcall(L, 2, 1, 0) != 0) { /* bad row: error after cleanup */
+      t = lpq_clockms();
+      lpq_abortpipeline(conn, nonblocking, 0);
+      S->exectime += lpq_clockms() - t;
+      return lua_error(L);
+    }
+    t = lpq_clockms();
+    if (lua_tointeger(L, -1) == n) synced = PQpipelineSync(conn);
+    if (!synced || !lpq_flushsocket(conn)) { /* failed to send */
+      lua_pushnil(L);
+      lua_pushstring(L, PQerrorMessage(conn));
+      lpq_abortpipeline(conn, nonblocking, synced);
+      S->exectime += lpq_clockms() - t;
+      return 2;
+    }
+    PQsetnonblocking(conn, nonblocking);
+    S->exectime += lpq_clockms() - t;
+    lua_settop(L, 3);
+    for (i = 1; i <= n; i++) { /* collect results in order */
+      t = lpq_clockms();
+      result = PQgetResult(conn);
+      S->exectime += lpq_clockms() - t;
+      lpq_pushresult(L, P->conn, result);
+      lua_rawseti(L, 3, i);
+      while ((result = PQgetResult(conn)) != NULL) PQclear(result);
+    }
+    result = PQgetResult(conn); /* PGRES_PIPELINE_SYNC */
+    PQclear(result);
+    PQexitPipelineMode(conn);
+  }
+#else
+  for (i = 1; i <= n; i++) { /* one round trip per row */
+    PGresult *result;
+    lpq_setrowparams(L, P, i);
+    t = lpq_clockms();
+    result = PQexecPrepared(conn, P->name, P->n, P->value, P->length,
+        P->format, 1); /* binary */
+    S->exectime += lpq_clockms() - t;
+    lpq_pushresult(L, P->conn, result);
+    lua_rawseti(L, 3, i);
+    S->queries++;
+  }
+  lua_settop(L, 3);
+#endif
+  return 1;
+}
+
+
+/* =======   lpq_Rset   ======= */
+
+static lpq_Rset *lpq_checkrset (lua_State *L, int narg) {
+  lpq_Rset *R = NULL;
+  if (lua_getmetatable(L, narg)) { /* has metatable? */
+    if (lua_rawequal(L, -1, lua_upvalueindex(1))) /* MT == upvalue? */
+      R = (lpq_Rset *) lua_touserdata(L, narg);
+    lua_pop(L, 1); /* MT */
+  }
+  if (R == NULL) lpq_typeerror(L, narg, LPQ_RSET_NAME);
+  return R;
+}
+
+static int lpq_rset__tostring (lua_State *L) {
+  lua_pushfstring(L, LPQ_RSET_NAME ": %p", (void *) lua_touserdata(L, 1));
+  return 1;
+}
+
+static int lpq_rset__gc (lua_State *L) {
+  lpq_Rset *R = (lpq_Rset *) lua_touserdata(L, 1);
+  /* on lua_close the anchor may be collected first: do not touch result */
+  if (R->status == PGRES_TUPLES_OK) {
+    /* mark tuples that reference rset as invalid */
+    lua_getuservalue(L, 1);
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+      if (lua_tointeger(L, -2) > 0) { /* tuple? */
+        lpq_Tuple *T = (lpq_Tuple *) lua_touserdata(L, -1);
+        T->valid = 0;
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lpq_freecolumns(L, R->col, R->n);
+  if (!R->anchored) PQclear(R->result); /* else cleared by anchor */
+  lpq_releasestats(R->stats);
+  return 0;
+}
+
+static int lpq_rset__len (lua_State *L) {
+  lpq_Rset *R = (lpq_Rset *) lua_touserdata(L, 1);
+  ExecStatusType status = PQresultStatus(R->result);
+  if (status == PGRES_TUPLES_OK)
+    lua_pushinteger(L, PQntuples(R->result));
+  else if (status == PGRES_COMMAND_OK)
+    lua_pushinteger(L, atoi(PQcmdTuples(R->result)));
+  else lua_pushnil(L);
+  return 1;
+}
+
+/* lpq_Tuple MT as second upvalue */
+static int lpq_rset__index (lua_State *L) {
+  lpq_Rset *R = (lpq_Rset *) lua_touserdata(L, 1);
+  if (lua_isnumber(L, 2)) {
+    int n = lua_tointeger(L, 2);
+    if (PQresultStatus(R->result) != PGRES_TUPLES_OK
+        || n < 1 || n > PQntuples(R->result))
+      lua_pushnil(L);
+    else {
+      lua_getuservalue(L, 1);
+      lua_rawgeti(L, -1, n);
+      if (lua_isnil(L, -1)) {
+        lpq_Tuple *T = (lpq_Tuple *) lua_newuserdata(L, sizeof(lpq_Tuple));
+        T->rset = R;
+        T->row = n - 1; /* zero-based */
+        T->valid = 1;
+        lua_pushvalue(L, lua_upvalueindex(2)); /* lpq_Tuple MT */
+        lua_setmetatable(L, -2);
+        lua_getfield(L, 3, LPQ_RSET_FIELDS); /* rset_env.fields */
+        lua_setuservalue(L, -2); /* tuple env is rset env fields */
+        lua_pushvalue(L, -1); /* tuple */
+        lua_rawseti(L, 3, n); /* rset_env[n] = tuple */
+      }
+    }
+  }
+  else lua_rawget(L, lua_upvalueindex(1)); /* lpq_Rset class */
+  return 1;
+}
+
+static int lpq_rset_fields (lua_State *L) {
+  lpq_Rset *R = lpq_checkrset(L, 1);
+  if (PQresultStatus(R->result) != PGRES_TUPLES_OK)
+    lua_pushnil(L);
+  else {
+    lua_getuservalue(L, 1);
+    lua_getfield(L, -1, LPQ_RSET_FIELDS);
+  }
+  return 1;
+}
+
+static int lpq_rset_status (lua_State *L) {
+  lpq_Rset *R = lpq_checkrset(L, 1);
+  lua_pushstring(L, PQresStatus(PQresultStatus(R->result)));
+  return 1;
+}
+
+static int lpq_rset_error (lua_State *L) {
+  lpq_Rset *R = lpq_checkrset(L, 1);
+  lua_pushstring(L, PQresultErrorMessage(R->result));
+  return 1;
+}
+
+static int lpq_rset_cmdstatus (lua_State *L) {
+  lpq_Rset *R = lpq_checkrset(L, 1);
+  if (PQresultStatus(R->result) == PGRES_COMMAND_OK)
+    lua_pushstring(L, PQcmdStatus(R->result));
+  else lua_pushnil(L);
+  return 1;
+}
+
+static int lpq_rset_fetchaux (lua_State *L) {
+  lpq_Rset *R = (lpq_Rset *) lua_touserdata(L, lua_upvalueindex(1));
+  int rowindex = lua_toboolean(L, lua_upvalueindex(2));
+  int i = lua_tointeger(L, lua_upvalueindex(3)); /* current row */
+  if (i < PQntuples(R->result)) {
+    int f, n = R->n;
+    double t = lpq_clockms(), bytes = 0;
+    luaL_checkstack(L, n + 1, "too many columns");
+    if (rowindex) lua_pushinteger(L, i + 1);
+    for (f = 0; f < n; f++)
+      bytes += lpq_pushfield(L, R->result, &R->col[f], i, f);
+    lpq_countdecode(R->stats, t, bytes);
+    if (rowindex) n++;
+    lua_pushinteger(L, i + 1);
+    lua_replace(L, lua_upvalueindex(3));
+    return n;
+  }
+  return 0;
+}
+
+/* rset:fetch(rowindex?) */
+static int lpq_rset_fetch (lua_State *L) {
+  lpq_checkrset(L, 1);
+  lua_settop(L, 2);
+  lua_pushinteger(L, 0); /* current row */
+  lua_pushcclosure(L, lpq_rset_fetchaux, 3);
+  return 1;
+}
+
+
+/* auxiliar closure (on tuple) to lpq_rset_rows */
+static int lpq_rset_rowsaux (lua_State *L) {
+  lpq_Rset *R = (lpq_Rset *) lua_touserdata(L, 1);
+  int n = lua_tointeger(L, 2);
+  lpq_Tuple *T = (lpq_Tuple *) lua_touserdata(L, lua_upvalueindex(1));
+  if (PQresultStatus(R->result) != PGRES_TUPLES_OK
+      || n == PQntuples(R->result)) {
+    T->valid = 0;
+    lua_pushnil(L);
+    return 1;
+  }
+  T->row = n;
+  lua_pushinteger(L, n + 1);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  return 2;
+}
+
+/* lpq_Tuple MT as upvalue */
+static int lpq_rset_rows (lua_State *L) {
+  lpq_Rset *R = lpq_checkrset(L, 1);
+  lpq_Tuple *T;
+  lua_getuservalue(L, 1);
+  T = (lpq_Tuple *) lua_newuserdata(L, sizeof(lpq_Tuple));
+  T->rset = R;
+  T->valid = 1;
+  lua_pushvalue(L, lua_upvalueindex(2)); /* lpq_Tuple MT */
+  lua_setmetatable(L, -2);
+  lua_getfield(L, 2, LPQ_RSET_FIELDS); /* rset_env.fields */
+  lua_setuservalue(L, -2); /* tuple env is rset env fields */
+  lua_pushcclosure(L, lpq_rset_rowsaux, 1);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+
+/* push field names at stack positions 2, ..., R->n + 1 */
+static void lpq_rset_pushnames (lua_State *L, lpq_Rset *R) {
+  int f;
+  lua_settop(L, 1);
+  luaL_checkstack(L, R->n + 3, "too many columns");
+  for (f = 0; f < R->n; f++)
+    lua_pushstring(L, PQfname(R->result, f));
+}
+
+/* rset:totable(): array of rows, each a table keyed by field name */
+static int lpq_rset_totable (lua_State *L) {
+  lpq_Rset *R = lpq_checkrset(L, 1);
+  PGresult *result = R->result;
+  int i, f, n = R->n, nrows;
+  double t, bytes = 0;
+  if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+    lua_pushnil(L);
+    return 1;
+  }
+  nrows = PQntuples(result);
+  t = lpq_clockms();
+  lpq_rset_pushnames(L, R);
+  lua_createtable(L, nrows, 0);
+  for (i = 0; i < nrows; i++) {
+    lua_createtable(L, 0, n);
+    for (f = 0; f < n; f++) {
+      if (PQgetisnull(result, i, f)) continue;
+      lua_pushvalue(L, f + 2); /* name */
+      bytes += lpq_pushfield(L, result, &R->col[f], i, f);
+      lua_rawset(L, -3);
+    }
+    lua_rawseti(L, -2, i + 1);
+  }
+  lpq_countdecode(R->stats, t, bytes);
+  return 1;
+}
+
+/* rset:columns(): table of arrays of column values keyed by field name */
+static int lpq_rset_columns (lua_State *L) {
+  lpq_Rset *R = lpq_checkrset(L, 1);
+  PGresult *result = R->result;
+  int i, f, n = R->n, nrows;
+  double t, bytes = 0;
+  if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+    lua_pushnil(L);
+    return 1;
+  }
+  nrows = PQntuples(result);
+  t = lpq_clockms();
+  lpq_rset_pushnames(L, R);
+  lua_createtable(L, 0, n);
+  for (f = 0; f < n; f++) {
+    lua_pushvalue(L, f + 2); /* name */
+    lua_createtable(L, nrows, 0);
+    for (i = 0; i < nrows; i++) {
+      if (PQgetisnull(result, i, f)) continue;
+      bytes += lpq_pushfield(L, result, &R->col[f], i, f);
+      lua_rawseti(L, -2, i + 1);
+    }
+    lua_rawset(L, -3);
+  }
+  lpq_countdecode(R->stats, t, bytes);
+  return 1;
+}
+
+
+/* rset:column_buffer(col): values of numeric column col (number or field
+ * name) in a lpq_Buffer; lpq_Buffer MT as second upvalue */
+static int lpq_rset_column_buffer (lua_State *L) {
+  lpq_Rset *R = lpq_checkrset(L, 1);
+  PGresult *result = R->result;
+  lpq_Buffer *B;
+  int i, f, n, elemsize, hasnull = 0;
+  Oid type;
+  size_t size;
+  double t, bytes = 0;
+  if (PQresultStatus(result) != PGRES_TUPLES_OK)
+    return luaL_error(L, "tuples expected in " LPQ_RSET_NAME);
+  if (lua_type(L, 2) == LUA_TSTRING) { /* field name? */
+    lua_getuservalue(L, 1);
+    lua_getfield(L, -1, LPQ_RSET_FIELDS);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    if (!lua_isnumber(L, -1))
+      return luaL_argerror(L, 2, "unknown field name");
+    f = (int) lua_tointeger(L, -1);
+  }
+  else {
+    f = (int) luaL_checkinteger(L, 2) - 1;
+    luaL_argcheck(L, f >= 0 && f < R->n, 2, "column out of range");
+  }
+  type = R->col[f].type;
+  switch (type) {
+    case INT4OID: elemsize = 4; break;
+    case INT8OID: elemsize = 8; break;
+    case FLOAT4OID: elemsize = 4; break;
+    case FLOAT8OID: elemsize = 8; break;
     default:
-      lua_pushstring(L, "CONNECTION_BAD");
+      return luaL_argerror(L, 2, "int4, int8, float4 or float8 column expected");
   }
+  n = PQntuples(result);
+  for (i = 0; i < n && !hasnull; i++)
+    hasnull = PQgetisnull(result, i, f);
+  size = LPQ_BUFFER_HDRSIZE + (size_t) n * elemsize;
+  B = (lpq_Buffer *) lua_newuserdata(L, size + (hasnull ? (n + 7) / 8 : 0));
+  B->type = type;
+  B->n = n;
+  B->elemsize = elemsize;
+  B->data = (char *) B + LPQ_BUFFER_HDRSIZE;
+  B->nulls = hasnull ? (unsigned char *) B + size : NULL;
+  if (hasnull) memset(B->nulls, 0, (n + 7) / 8);
+  lua_pushvalue(L, lua_upvalueindex(2)); /* lpq_Buffer MT */
+  lua_setmetatable(L, -2);
+  t = lpq_clockms();
+  for (i = 0; i < n; i++) {
+    const char *v = PQgetvalue(result, i, f);
+    char *d = B->data + (size_t) i * elemsize;
+    if (hasnull && PQgetisnull(result, i, f)) {
+      B->nulls[i >> 3] |= (unsigned char) (1 << (i & 7));
+      memset(d, 0, elemsize);
+      continue;
+    }
+    bytes += elemsize;
+    switch (type) {
+      case INT4OID: {
+        int x = (int) lpq_getuint32(v);
+        memcpy(d, &x, 4);
+        break;
+      }
+      case INT8OID: {
+        int64 x = lpq_getint64(v);
+        memcpy(d, &x, 8);
+        break;
+      }
+      case FLOAT4OID: {
+        float4 x = lpq_getfloat4(v);
+        memcpy(d, &x, 4);
+        break;
+      }
+      default: {
+        float8 x = lpq_getfloat8(v);
+        memcpy(d, &x, 8);
+        break;
+      }
+    }
+  }
+  lpq_countdecode(R->stats, t, bytes);
+  return 1;
+}
+
+
+/* rset = psql.makeresult(types, rows [, names]): result set built locally,
+ * without a connection, from rows of values encoded as plan parameters
+ * (nil is NULL); for tests and benchmarks */
+/* lpq_Rset MT as second upvalue */
+static int lpq_makeresult (lua_State *L) {
+  int i, f, n, nrows;
+  Oid *type;
+  PGresAttDesc *attr;
+  PGresult *result;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+  n = (int) lua_rawlen(L, 1);
+  nrows = (int) lua_rawlen(L, 2);
+  lua_settop(L, 3);
+  luaL_checkstack(L, n + 2, "too many columns");
+  type = (Oid *) lua_newuserdata(L, n * (sizeof(Oid) + sizeof(PGresAttDesc)));
+  attr = (PGresAttDesc *) (type + n); /* 4: scratch */
+  for (f = 0; f < n; f++) { /* names at 5.. */
+    lua_rawgeti(L, 1, f + 1);
+    type[f] = (Oid) luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+    if (lua_isnil(L, 3)) lua_pushfstring(L, "c%d", f + 1);
+    else lua_rawgeti(L, 3, f + 1);
+    attr[f].name = (char *) luaL_checkstring(L, -1);
+    attr[f].tableid = 0;
+    attr[f].columnid = 0;
+    attr[f].format = 1; /* binary */
+    attr[f].typid = type[f];
+    attr[f].typlen = -1;
+    attr[f].atttypmod = -1;
+  }
+  result = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+  if (result == NULL || !PQsetResultAttrs(result, n, attr)) {
+    PQclear(result);
+    return luaL_error(L, "not enough memory for " LPQ_RSET_NAME);
+  }
+  lua_settop(L, 4);
+  lpq_pushresult(L, NULL, result); /* 5: owns result from now on */
+  for (i = 0; i < nrows; i++) {
+    luaL_Buffer buf;
+    const char *value;
+    lua_settop(L, 5);
+    lua_rawgeti(L, 2, i + 1); /* 6: row */
+    luaL_checktype(L, 6, LUA_TTABLE);
+    for (f = 0; f < n; f++) lua_rawgeti(L, 6, f + 1); /* values at 7.. */
+    lpq_encodetables(L, type, 7, n);
+    luaL_buffinit(L, &buf);
+    for (f = 0; f < n; f++) /* lengths in attr[f].typlen */
+      attr[f].typlen = lua_isnil(L, 7 + f) ? -1
+        : lpq_tovalue(L, 7 + f, type[f], &buf);
+    luaL_pushresult(&buf);
+    value = lua_tostring(L, -1);
+    for (f = 0; f < n; f++) {
+      int length = attr[f].typlen;
+      if (!PQsetvalue(result, i, f, (char *) value, length))
+        return luaL_error(L, "not enough memory for " LPQ_RSET_NAME);
+      if (length > 0) value += length;
+    }
+  }
+  lua_settop(L, 5);
+  return 1;
+}
+
+/* =======   lpq_Buffer   ======= */
+
+static lpq_Buffer *lpq_checkbuffer (lua_State *L, int narg) {
+  lpq_Buffer *B = NULL;
+  if (lua_getmetatable(L, narg)) { /* has metatable? */
+    if (lua_rawequal(L, -1, lua_upvalueindex(1))) /* MT == upvalue? */
+      B = (lpq_Buffer *) lua_touserdata(L, narg);
+    lua_pop(L, 1); /* MT */
+  }
+  if (B == NULL) lpq_typeerror(L, narg, LPQ_BUFFER_NAME);
+  return B;
+}
+
+static int lpq_buffer__tostring (lua_State *L) {
+  lua_pushfstring(L, LPQ_BUFFER_NAME ": %p", lua_touserdata(L, 1));
+  return 1;
+}
+
+static int lpq_buffer__len (lua_State *L) {
+  lpq_Buffer *B = (lpq_Buffer *) lua_touserdata(L, 1);
+  lua_pushinteger(L, B->n);
+  return 1;
+}
+
+/* lpq_Buffer class as upvalue */
+static int lpq_buffer__index (lua_State *L) {
+  lpq_Buffer *B = (lpq_Buffer *) lua_touserdata(L, 1);
+  if (lua_isnumber(L, 2)) {
+    int i = (int) lua_tointeger(L, 2) - 1;
+    const char *d = B->data + (size_t) i * B->elemsize;
+    if (i < 0 || i >= B->n) lua_pushnil(L);
+    else switch (B->type) {
+      case INT4OID: lua_pushinteger(L, *(const int *) d); break;
+      case INT8OID: lua_pushinteger(L, (lua_Integer) *(const int64 *) d); break;
+      case FLOAT4OID: lua_pushnumber(L, *(const float4 *) d); break;
+      default: lua_pushnumber(L, *(const float8 *) d);
+    }
+  }
+  else lua_rawget(L, lua_upvalueindex(1)); /* lpq_Buffer class */
+  return 1;
+}
+
+/* buffer:type(): element C type name */
+static int lpq_buffer_type (lua_State *L) {
+  lpq_Buffer *B = lpq_checkbuffer(L, 1);
+  switch (B->type) {
+    case INT4OID: lua_pushliteral(L, "int32_t"); break;
+    case INT8OID: lua_pushliteral(L, "int64_t"); break;
+    case FLOAT4OID: lua_pushliteral(L, "float"); break;
+    default: lua_pushliteral(L, "double");
+  }
+  return 1;
+}
+
+/* buffer:pointer(): address and size in bytes of values */
+static int lpq_buffer_pointer (lua_State *L) {
+  lpq_Buffer *B = lpq_checkbuffer(L, 1);
+  lua_pushlightuserdata(L, B->data);
+  lua_pushinteger(L, (lua_Integer) B->n * B->elemsize);
   return 2;
 }
 
-static int lpq_conn_finish (lua_State *L) {
-  lpq_finishconn(L, lpq_checkconn(L, 1));
+/* buffer:nulls(): address and size in bytes of NULL bitmap, or nil */
+static int lpq_buffer_nulls (lua_State *L) {
+  lpq_Buffer *B = lpq_checkbuffer(L, 1);
+  if (B->nulls == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushlightuserdata(L, B->nulls);
+  lua_pushinteger(L, (B->n + 7) / 8);
+  return 2;
+}
+
+static int lpq_buffer_isnull (lua_State *L) {
+  lpq_Buffer *B = lpq_checkbuffer(L, 1);
+  int i = (int) luaL_checkinteger(L, 2) - 1;
+  luaL_argcheck(L, i >= 0 && i < B->n, 2, "index out of range");
+  lua_pushboolean(L, B->nulls != NULL && (B->nulls[i >> 3] & (1 << (i & 7))));
+  return 1;
+}
+
+
+/* =======   lpq_View   ======= */
+
+static int lpq_anchor__gc (lua_State *L) {
+  PQclear(*(PGresult **) lua_touserdata(L, 1));
+  return 0;
+}
+
+static lpq_View *lpq_checkview (lua_State *L, int narg) {
+  lpq_View *V = NULL;
+  if (lua_getmetatable(L, narg)) { /* has metatable? */
+    if (lua_rawequal(L, -1, lua_upvalueindex(1))) /* MT == upvalue? */
+      V = (lpq_View *) lua_touserdata(L, narg);
+    lua_pop(L, 1); /* MT */
+  }
+  if (V == NULL) lpq_typeerror(L, narg, LPQ_VIEW_NAME);
+  return V;
+}
+
+static int lpq_view__tostring (lua_State *L) {
+  lpq_View *V = (lpq_View *) lua_touserdata(L, 1);
+  lua_pushfstring(L, LPQ_VIEW_NAME ": %p (%d bytes)", (void *) V,
+      (int) V->length);
+  return 1;
+}
+
+static int lpq_view__len (lua_State *L) {
+  lpq_View *V = (lpq_View *) lua_touserdata(L, 1);
+  lua_pushinteger(L, (lua_Integer) V->length);
+  return 1;
+}
+
+/* view:sub([i [, j]]): copy of bytes i..j, as string.sub */
+static int lpq_view_sub (lua_State *L) {
+  lpq_View *V = lpq_checkview(L, 1);
+  lua_Integer l = (lua_Integer) V->length;
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+  lua_Integer j = luaL_optinteger(L, 3, -1);
+  if (i < 0) i = (-i > l) ? 1 : l + i + 1;
+  else if (i == 0) i = 1;
+  if (j < 0) j = l + j + 1;
+  else if (j > l) j = l;
+  if (i > j) lua_pushliteral(L, "");
+  else lua_pushlstring(L, V->data + i - 1, (size_t) (j - i + 1));
+  return 1;
+}
+
+/* view:tostring(): copy of all bytes */
+static int lpq_view_tostring (lua_State *L) {
+  lpq_View *V = lpq_checkview(L, 1);
+  lua_pushlstring(L, V->data, V->length);
+  return 1;
+}
+
+/* view:pointer(): address and size in bytes, valid while view is alive */
+static int lpq_view_pointer (lua_State *L) {
+  lpq_View *V = lpq_checkview(L, 1);
+  lua_pushlightuserdata(L, (void *) V->data);
+  lua_pushinteger(L, (lua_Integer) V->length);
+  return 2;
+}
+
+
+/* =======   lpq_Range   ======= */
+
+static int lpq_isrange (lua_State *L, int narg) {
+  int isrange = 0;
+  if (lua_getmetatable(L, narg)) { /* has metatable? */
+    isrange = lua_rawequal(L, -1, lua_upvalueindex(1)); /* MT == upvalue? */
+    lua_pop(L, 1); /* MT */
+  }
+  return isrange;
+}
+
+static void lpq_checkrange (lua_State *L, int narg) {
+  if (!lpq_isrange(L, narg)) lpq_typeerror(L, narg, LPQ_RANGE_NAME);
+}
+
+/* compare bounds as range_cmp_bounds in utils/adt/rangetypes.c, with
+ * values compared by Lua's < */
+static int lpq_cmpbounds (lua_State *L, const lpq_Bound *a,
+                          const lpq_Bound *b) {
+  if (a->value == 0 || b->value == 0) { /* infinite? */
+    if (a->value == 0 && b->value == 0 && a->lower == b->lower) return 0;
+    if (a->value == 0) return a->lower ? -1 : 1;
+    return b->lower ? 1 : -1;
+  }
+  if (lpq_lessthan(L, a->value, b->value)) return -1;
+  if (lpq_lessthan(L, b->value, a->value)) return 1;
+  if (!a->inclusive && !b->inclusive)
+    return (a->lower == b->lower) ? 0 : a->lower ? 1 : -1;
+  if (!a->inclusive) return a->lower ? 1 : -1;
+  if (!b->inclusive) return b->lower ? -1 : 1;
   return 0;
 }
 
-static int lpq_conn_reset (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  PQreset(C->conn);
-  return 0;
+/* psql.range([lower [, upper [, bounds]]]): range with bounds "[)" (the
+ * default), "[]", "(]" or "()", nil bounds being infinite; or empty range
+ * if bounds is "empty" */
+static int lpq_range (lua_State *L) {
+  const char *bounds = luaL_optstring(L, 3, "[)");
+  lua_settop(L, 2);
+  lua_createtable(L, 0, 4);
+  if (strcmp(bounds, "empty") == 0) {
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "empty");
+  }
+  else {
+    if ((bounds[0] != '[' && bounds[0] != '(')
+        || (bounds[1] != ']' && bounds[1] != ')') || bounds[2] != '\0')
+      return luaL_argerror(L, 3, "invalid range bounds");
+    lua_pushvalue(L, 1);
+    lua_setfield(L, -2, "lower");
+    lua_pushvalue(L, 2);
+    lua_setfield(L, -2, "upper");
+    lua_pushboolean(L, bounds[0] == '[' && !lua_isnil(L, 1));
+    lua_setfield(L, -2, "lowerinc");
+    lua_pushboolean(L, bounds[1] == ']' && !lua_isnil(L, 2));
+    lua_setfield(L, -2, "upperinc");
+  }
+  lua_pushlightuserdata(L, LPQ_RANGE_MT);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int lpq_range__tostring (lua_State *L) {
+  lpq_Bound lo, up;
+  const char *s[2];
+  int i;
+  if (!lpq_getbounds(L, 1, &lo, &up)) {
+    lua_pushliteral(L, "empty");
+    return 1;
+  }
+  for (i = 0; i < 2; i++) {
+    int v = (i == 0) ? lo.value : up.value;
+    s[i] = (v == 0) ? "" : lua_isstring(L, v) ? lua_tostring(L, v)
+      : luaL_typename(L, v);
+  }
+  lua_pushfstring(L, "%c%s,%s%c", lo.inclusive ? '[' : '(', s[0], s[1],
+      up.inclusive ? ']' : ')');
+  return 1;
+}
+
+/* range:contains(x): range contains value or range x? */
+static int lpq_range_contains (lua_State *L) {
+  lpq_Bound lo, up, x[2];
+  int nonempty;
+  lpq_checkrange(L, 1);
+  luaL_checkany(L, 2);
+  nonempty = lpq_getbounds(L, 1, &lo, &up);
+  if (lpq_isrange(L, 2)) {
+    if (!lpq_getbounds(L, 2, &x[0], &x[1])) { /* empty? */
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+  }
+  else { /* value as bounds [x, x] */
+    x[0].value = x[1].value = 2;
+    x[0].inclusive = x[1].inclusive = 1;
+    x[0].lower = 1;
+    x[1].lower = 0;
+  }
+  lua_pushboolean(L, nonempty && lpq_cmpbounds(L, &lo, &x[0]) <= 0
+      && lpq_cmpbounds(L, &up, &x[1]) >= 0);
+  return 1;
+}
+
+/* range:overlaps(r): ranges have values in common? */
+static int lpq_range_overlaps (lua_State *L) {
+  lpq_Bound lo1, up1, lo2, up2;
+  lpq_checkrange(L, 1);
+  lpq_checkrange(L, 2);
+  if (!lpq_getbounds(L, 1, &lo1, &up1) || !lpq_getbounds(L, 2, &lo2, &up2))
+    lua_pushboolean(L, 0);
+  else
+    lua_pushboolean(L, (lpq_cmpbounds(L, &lo1, &lo2) >= 0
+          && lpq_cmpbounds(L, &lo1, &up2) <= 0)
+        || (lpq_cmpbounds(L, &lo2, &lo1) >= 0
+          && lpq_cmpbounds(L, &lo2, &up1) <= 0));
+  return 1;
+}
+
+
+/* =======   lpq_Tuple   ======= */
+
+static int lpq_tuple__tostring (lua_State *L) {
+  lua_pushfstring(L, LPQ_TUPLE_NAME ": %p", lua_touserdata(L, 1));
+  return 1;
+}
+
+static int lpq_tuple__len (lua_State *L) {
+  lpq_Tuple *T = (lpq_Tuple *) lua_touserdata(L, 1);
+  if (!T->valid) lua_pushnil(L);
+  else lua_pushinteger(L, T->row);
+  return 1;
 }
 
-static int lpq_conn_resetstart (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  lua_pushboolean(L, PQresetStart(C->conn));
+static int lpq_tuple__index (lua_State *L) {
+  lpq_Tuple *T = (lpq_Tuple *) lua_touserdata(L, 1);
+  PGresult *result = T->rset->result;
+  if (!T->valid) lua_pushnil(L);
+  else {
+    lua_getuservalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    if (lua_isnumber(L, -1)) { /* field name match? */
+      int f = lua_tointeger(L, -1); /* field number */
+      double t = lpq_clockms();
+      int length = lpq_pushfield(L, result, &T->rset->col[f], T->row, f);
+      lpq_countdecode(T->rset->stats, t, length);
+    }
+  }
   return 1;
 }
 
-static int lpq_conn_resetpoll (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  PostgresPollingStatusType status = PQresetPoll(C->conn);
-  lua_pushboolean(L, status == PGRES_POLLING_OK);
-  switch (status) {
-    case PGRES_POLLING_OK: lua_pushstring(L, "OK"); break;
-    case PGRES_POLLING_READING: lua_pushstring(L, "READING"); break;
-    case PGRES_POLLING_WRITING: lua_pushstring(L, "WRITING"); break;
-    default: lua_pushstring(L, "FAILED");
+
+
+/* =======   lpq_Copy   ======= */
+
+static lpq_Copy *lpq_checkcopy (lua_State *L, int narg) {
+  lpq_Copy *K = NULL;
+  if (lua_getmetatable(L, narg)) { /* has metatable? */
+    if (lua_rawequal(L, -1, lua_upvalueindex(1))) /* MT == upvalue? */
+      K = (lpq_Copy *) lua_touserdata(L, narg);
+    lua_pop(L, 1); /* MT */
   }
-  return 2;
+  if (K == NULL) lpq_typeerror(L, narg, LPQ_COPY_NAME);
+  if (K->done) luaL_error(L, LPQ_COPY_NAME " is finished");
+  if (K->conn->done)
+    luaL_error(L, "referenced " LPQ_CONN_NAME " is finished");
+  return K;
 }
 
-static int lpq_conn_socket (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  lua_pushinteger(L, PQsocket(C->conn));
+static int lpq_copyflush (lpq_Copy *K) {
+  if (K->used > 0) {
+    if (PQputCopyData(K->conn->conn, K->buf, (int) K->used) != 1)
+      return 0;
+    K->used = 0;
+  }
   return 1;
 }
 
-static int lpq_conn_error (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  lua_pushstring(L, PQerrorMessage(C->conn));
-  return 1;
+static void lpq_copyfree (lua_State *L, lpq_Copy *K) {
+  if (K->out) lpq_freecolumns(L, K->col, K->n);
+  free(K->buf);
+  K->buf = NULL;
+  K->used = K->size = 0;
+  K->done = 1;
 }
 
-#define lpq_conn_string(name) \
-  static int lpq_conn_ ## name (lua_State *L) { \
-    lpq_Conn *C = lpq_checkconn(L, 1); \
-    lua_pushstring(L, PQ ## name (C->conn)); \
-    return 1; \
+/* append binary tuple with values at stack positions 2, ..., K->n + 1 */
+static void lpq_copyrow (lua_State *L, lpq_Copy *K) {
+  int i, n = K->n;
+  size_t l;
+  const char *s;
+  char *v;
+  luaL_Buffer buf;
+  lua_settop(L, n + 1);
+  lpq_encodetables(L, K->type, 2, n);
+  luaL_buffinit(L, &buf);
+  for (i = 0; i < n; i++)
+    K->length[i] = lua_isnil(L, i + 2) ? -1 /* NULL */
+      : lpq_tovalue(L, i + 2, K->type[i], &buf);
+  luaL_pushresult(&buf);
+  s = lua_tolstring(L, -1, &l);
+  v = lpq_copyreserve(L, K, 2 + 4 * n + l);
+  lpq_putint16(v, n); v += 2;
+  for (i = 0; i < n; i++) {
+    lpq_putuint32(v, (uint32) K->length[i]); v += 4;
+    if (K->length[i] > 0) {
+      memcpy(v, s, K->length[i]);
+      v += K->length[i];
+      s += K->length[i];
+    }
   }
-
-lpq_conn_string(db)
-lpq_conn_string(user)
-lpq_conn_string(pass)
-lpq_conn_string(host)
-lpq_conn_string(port)
-lpq_conn_string(tty)
-lpq_conn_string(options)
-
-static int lpq_conn_escape (lua_State *L) {
-  int error;
-  size_t length;
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  const char *from = luaL_checklstring(L, 2, &length);
-  char *to = (char *) lua_newuserdata(L, 2 * length + 1);
-  length = PQescapeStringConn(C->conn, to, from, length, &error);
-  if (!error) lua_pushlstring(L, to, length);
-  else lua_pushnil(L);
-  return 1;
+  K->used = v - K->buf;
+  lua_pop(L, 1); /* encoded values */
 }
 
-static int lpq_conn_isbusy (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  lua_pushboolean(L, PQisBusy(C->conn));
+static int lpq_copy__tostring (lua_State *L) {
+  lua_pushfstring(L, LPQ_COPY_NAME ": %p", lua_touserdata(L, 1));
   return 1;
 }
 
-static int lpq_conn_consume (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  return lpq_pushstatus(L, PQconsumeInput(C->conn), C->conn);
-}
-
-static int lpq_conn_query (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  const char *cmd = luaL_checkstring(L, 2);
-  return lpq_pushstatus(L, PQsendQueryParams(C->conn, cmd,
-      0, NULL, NULL, NULL, NULL, 1), /* binary, no params */
-      C->conn);
+static int lpq_copy__gc (lua_State *L) {
+  lpq_Copy *K = (lpq_Copy *) lua_touserdata(L, 1);
+  if (!K->done) {
+    if (!K->conn->done) {
+      if (K->out) lpq_copydrain(K->conn->conn);
+      else lpq_copyabort(K->conn->conn, "COPY abandoned");
+    }
+    lpq_copyfree(L, K);
+  }
+  return 0;
 }
 
-/* related to lpq_Rset */
-/* lpq_Rset MT as second upvalue */
-static int lpq_pushresult (lua_State *L, PGresult *result) {
-  if (result == NULL) lua_pushnil(L);
+/* copy:put(...): a row of values if binary, otherwise raw data */
+static int lpq_copy_put (lua_State *L) {
+  lpq_Copy *K = lpq_checkcopy(L, 1);
+  if (K->out) luaL_error(L, "COPY TO STDOUT is read only");
+  if (K->binary) lpq_copyrow(L, K);
   else {
-    lpq_Rset *R = (lpq_Rset *) lua_newuserdata(L, sizeof(lpq_Rset));
-    ExecStatusType status = PQresultStatus(result);
-    R->result = result;
-    lua_pushvalue(L, lua_upvalueindex(2)); /* lpq_Rset MT */
-    lua_setmetatable(L, -2);
-    if (status == PGRES_TUPLES_OK) { /* from SELECT? */
-      /* store field name table in udata environment */
-      int i, n = PQnfields(R->result);
-      lua_newtable(L);
-      lua_createtable(L, 0, n);
-      for (i = 0; i < n; i++) {
-        lua_pushstring(L, PQfname(R->result, i));
-        lua_pushinteger(L, i);
-        lua_rawset(L, -3);
-      }
-      lua_setfield(L, -2, LPQ_RSET_FIELDS);
-      lua_setuservalue(L, -2);
+    int i, n = lua_gettop(L);
+    for (i = 2; i <= n; i++) {
+      size_t l;
+      const char *s = luaL_checklstring(L, i, &l);
+      memcpy(lpq_copyreserve(L, K, l), s, l);
+      K->used += l;
     }
   }
+  if (K->used >= LPQ_COPY_BUFSIZE)
+    return lpq_pushstatus(L, lpq_copyflush(K), K->conn->conn);
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-static int lpq_conn_getresult (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  return lpq_pushresult(L, PQgetResult(C->conn));
-}
-
-static int lpq_conn_exec (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  const char *cmd = luaL_checkstring(L, 2);
-  return lpq_pushresult(L, PQexecParams(C->conn, cmd,
-      0, NULL, NULL, NULL, NULL, 1)); /* binary, no params */
+static int lpq_copy_flush (lua_State *L) {
+  lpq_Copy *K = lpq_checkcopy(L, 1);
+  return lpq_pushstatus(L, lpq_copyflush(K), K->conn->conn);
 }
 
-/* related to lpq_Plan */
-/* lpq_Plan MT as second upvalue */
-static lpq_Plan *lpq_getplan (lua_State *L, lpq_Conn *C, const char *name) {
-  lpq_Plan *P = NULL;
-  PGresult *result = PQdescribePrepared(C->conn, name);
-  ExecStatusType status = PQresultStatus(result);
-  if (status == PGRES_COMMAND_OK) {
-    int i, n = PQnparams(result);
-    P = (lpq_Plan *) lua_newuserdata(L, sizeof(lpq_Plan)
-        + n * (sizeof(Oid) + sizeof(char *) + 2 * sizeof(int)));
-    P->conn = C;
-    /* keep reference in conn env and set P->name */
-    lua_getuservalue(L, 1); /* note: conn at stack pos 1 */
-    lua_pushlightuserdata(L, P);
-    lua_pushstring(L, name);
-    P->name = lua_tostring(L, -1);
-    lua_rawset(L, -3); /* env(conn)[light(P)] = name */
-    lua_pop(L, 1); /* env */
-    /* set param pointers */
-    P->n = n;
-    P->type = (Oid *) (P + 1);
-    P->value = (const char **) (P->type + n);
-    P->length = (int *) (P->value + n);
-    P->format = (int *) (P->length + n);
-    for (i = 0; i < n; i++) {
-      P->type[i] = PQparamtype(result, i);
-      P->format[i] = 1; /* binary */
+/* push values of binary tuple in [v, e) */
+static int lpq_copytuple (lua_State *L, lpq_Copy *K, const char *v,
+                          const char *e) {
+  int f, n;
+  if (e - v < 2) return -1;
+  n = (short) ntohs(*(unsigned short *) v);
+  v += 2;
+  if (n < 0) return 0; /* trailer */
+  luaL_checkstack(L, n, "too many columns");
+  for (f = 0; f < n; f++) {
+    int length;
+    if (e - v < 4) return -1;
+    length = (int) lpq_getuint32(v);
+    v += 4;
+    if (length < 0) lua_pushnil(L);
+    else {
+      if (e - v < length) return -1;
+      if (f >= K->n || K->type[f] == 0) /* raw? */
+        lua_pushlstring(L, v, length);
+      else
+        K->col[f].decode(L, &K->col[f], v, length, K->row);
+      v += length;
     }
-    P->valid = 1;
-    /* set lpq_Plan MT */
-    lua_pushvalue(L, lua_upvalueindex(2));
-    lua_setmetatable(L, -2);
   }
-  else lua_pushnil(L);
-  PQclear(result);
-  return P;
+  return n;
 }
 
-/* plan = conn:prepare(stmt [, name]) */
-/* lpq_Plan MT as upvalue */
-static int lpq_conn_prepare (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  const char *query = luaL_checkstring(L, 2);
-  const char *name = luaL_optstring(L, 3, "");
-  lpq_Plan *P = NULL;
-  /* types are inferred by the server */
-  PGresult *result = PQprepare(C->conn, name, query, 0, NULL);
-  ExecStatusType status = PQresultStatus(result);
-  PQclear(result);
-  if (status == PGRES_COMMAND_OK) P = lpq_getplan(L, C, name);
-  else lua_pushnil(L);
-  if (P == NULL) {
-    lua_pushstring(L, PQerrorMessage(C->conn));
-    return 2;
+/* iterator from conn:copyout */
+static int lpq_copyoutaux (lua_State *L) {
+  lpq_Copy *K = (lpq_Copy *) lua_touserdata(L, lua_upvalueindex(1));
+  int rowindex = lua_toboolean(L, lua_upvalueindex(2));
+  PGconn *conn;
+  if (K->done) return 0;
+  if (K->conn->done)
+    luaL_error(L, "referenced " LPQ_CONN_NAME " is finished");
+  conn = K->conn->conn;
+  for (;;) {
+    char *buf;
+    const char *v, *e;
+    int n = PQgetCopyData(conn, &buf, 0);
+    if (n < 0) { /* done or failed? */
+      PGresult *result;
+      const char *msg = NULL;
+      K->done = 1;
+      while ((result = PQgetResult(conn)) != NULL) {
+        if (msg == NULL && PQresultStatus(result) != PGRES_COMMAND_OK)
+          msg = lua_pushstring(L, PQresultErrorMessage(result));
+        PQclear(result);
+      }
+      if (n == -2 && msg == NULL) msg = PQerrorMessage(conn);
+      if (msg != NULL) luaL_error(L, "%s", msg);
+      return 0;
+    }
+    v = buf;
+    e = buf + n;
+    if (!K->binary) { /* one data row per message */
+      if (rowindex) lua_pushinteger(L, ++K->row);
+      lua_pushlstring(L, v, n);
+      PQfreemem(buf);
+      return rowindex ? 2 : 1;
+    }
+    if (K->row < 0) { /* skip header */
+      if (n < LPQ_COPY_SIGLEN + 8
+          || memcmp(v, lpq_copysignature, LPQ_COPY_SIGLEN) != 0) {
+        PQfreemem(buf);
+        lpq_copydrain(conn);
+        K->done = 1;
+        luaL_error(L, "invalid COPY file header");
+      }
+      v += LPQ_COPY_SIGLEN + 8 + lpq_getuint32(v + LPQ_COPY_SIGLEN + 4);
+      K->row = 0;
+    }
+    if (v < e) { /* tuple in message? */
+      int top = lua_gettop(L);
+      if (rowindex) lua_pushinteger(L, K->row + 1);
+      n = lpq_copytuple(L, K, v, e);
+      PQfreemem(buf);
+      if (n < 0) {
+        lpq_copydrain(conn);
+        K->done = 1;
+        luaL_error(L, "invalid COPY data");
+      }
+      if (n > 0) {
+        K->row++;
+        return lua_gettop(L) - top;
+      }
+      lua_settop(L, top); /* trailer */
+    }
+    else PQfreemem(buf);
   }
-  return 1;
 }
 
-/* plan = conn:getplan([name]) */
-/* lpq_Plan MT as upvalue */
-static int lpq_conn_getplan (lua_State *L) {
-  lpq_Conn *C = lpq_checkconn(L, 1);
-  const char *name = luaL_optstring(L, 2, "");
-  lpq_Plan *P = lpq_getplan(L, C, name);
-  if (P == NULL) {
-    lua_pushstring(L, PQerrorMessage(C->conn));
+/* rset = copy:finish([errmsg]) */
+/* lpq_Rset MT as second upvalue */
+static int lpq_copy_finish (lua_State *L) {
+  lpq_Copy *K = lpq_checkcopy(L, 1);
+  const char *errmsg = luaL_optstring(L, 2, NULL);
+  PGconn *conn = K->conn->conn;
+  PGresult *result, *last = NULL;
+  if (K->out) { /* discard remaining data */
+    lpq_copydrain(conn);
+    lpq_copyfree(L, K);
+    return 0;
+  }
+  if (errmsg == NULL) {
+    if (K->binary) { /* file trailer */
+      lpq_putint16(lpq_copyreserve(L, K, 2), -1);
+      K->used += 2;
+    }
+    if (!lpq_copyflush(K)) errmsg = "COPY data could not be sent";
+  }
+  lpq_copyfree(L, K);
+  PQputCopyEnd(conn, errmsg);
+  while ((result = PQgetResult(conn)) != NULL) { /* keep last result */
+    PQclear(last);
+    last = result;
+  }
+  if (last == NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, PQerrorMessage(conn));
     return 2;
   }
-  return 1;
+  return lpq_pushresult(L, K->conn, last);
 }
 
 
-/* =======   lpq_Plan   ======= */
+/* =======   lpq_Stream   ======= */
 
-static lpq_Plan *lpq_checkplan (lua_State *L, int narg) {
-  lpq_Plan *P = NULL;
+static lpq_Stream *lpq_checkstream (lua_State *L, int narg) {
+  lpq_Stream *S = NULL;
   if (lua_getmetatable(L, narg)) { /* has metatable? */
     if (lua_rawequal(L, -1, lua_upvalueindex(1))) /* MT == upvalue? */
-      P = (lpq_Plan *) lua_touserdata(L, narg);
+      S = (lpq_Stream *) lua_touserdata(L, narg);
     lua_pop(L, 1); /* MT */
   }
-  if (P == NULL) lpq_typeerror(L, narg, LPQ_PLAN_NAME);
-  if (!P->valid)
-    luaL_error(L, "referenced " LPQ_CONN_NAME " is finished");
-  return P;
+  if (S == NULL) lpq_typeerror(L, narg, LPQ_STREAM_NAME);
+  return S;
 }
 
+/* discard current and remaining rows */
+static void lpq_streamclose (lua_State *L, lpq_Stream *S) {
+  lpq_freecolumns(L, S->col, S->n);
+  free(S->col);
+  S->col = NULL;
+  S->n = 0;
+  PQclear(S->result);
+  S->result = NULL;
+  if (!S->done) {
+    if (!S->conn->done) {
+      PGresult *result;
+      while ((result = PQgetResult(S->conn->conn)) != NULL) PQclear(result);
+    }
+    S->done = 1;
+  }
+}
 
-static int lpq_plan__len (lua_State *L) {
-  lpq_Plan *P = (lpq_Plan *) lua_touserdata(L, 1);
-  lua_pushinteger(L, P->n);
+static int lpq_stream__tostring (lua_State *L) {
+  lua_pushfstring(L, LPQ_STREAM_NAME ": %p", lua_touserdata(L, 1));
   return 1;
 }
 
-static int lpq_plan__tostring (lua_State *L) {
-  lua_pushfstring(L, LPQ_PLAN_NAME ": %p", (void *) lua_touserdata(L, 1));
-  return 1;
+static int lpq_stream__gc (lua_State *L) {
+  lpq_streamclose(L, (lpq_Stream *) lua_touserdata(L, 1));
+  return 0;
 }
 
-static void lpq_setparams (lua_State *L, lpq_Plan *P) {
-  int i;
-  luaL_Buffer buf;
-  lua_settop(L, P->n + 1);
-  luaL_buffinit(L, &buf);
-  for (i = 0; i < P->n; i++)
-    P->length[i] = lpq_tovalue(L, i + 2, P->type[i], &buf);
-  luaL_pushresult(&buf);
-  P->value[0] = lua_tostring(L, -1);
-  for (i = 0; i < P->n - 1; i++)
-    P->value[i + 1] = P->value[i] + P->length[i];
+static int lpq_stream_finish (lua_State *L) {
+  lpq_streamclose(L, lpq_checkstream(L, 1));
+  return 0;
 }
 
-static int lpq_plan_query (lua_State *L) {
-  lpq_Plan *P = lpq_checkplan(L, 1);
-  lpq_setparams(L, P);
-  return lpq_pushstatus(L, PQsendQueryPrepared(P->conn->conn, P->name, P->n,
-      P->value, P->length, P->format, 1), /* binary */
-      P->conn->conn);
+/* iterator from conn:stream: row number and values of next row */
+static int lpq_streamaux (lua_State *L) {
+  lpq_Stream *S = (lpq_Stream *) lua_touserdata(L, lua_upvalueindex(1));
+  for (;;) {
+    PGresult *result = S->result;
+    if (result != NULL && S->row < PQntuples(result)) {
+      int f, n = S->n, i = S->row++;
+      double t = lpq_clockms(), bytes = 0;
+      luaL_checkstack(L, n + 1, "too many columns");
+      lua_pushinteger(L, ++S->count);
+      for (f = 0; f < n; f++)
+        bytes += lpq_pushfield(L, result, &S->col[f], i, f);
+      lpq_countdecode(S->conn->stats, t, bytes);
+      return n + 1;
+    }
+    PQclear(result);
+    S->result = NULL;
+    if (S->done) return 0;
+    if (S->conn->done)
+      luaL_error(L, "referenced " LPQ_CONN_NAME " is finished");
+    result = PQgetResult(S->conn->conn);
+    if (result == NULL) {
+      S->done = 1;
+      return 0;
+    }
+    switch (PQresultStatus(result)) {
+      case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+      case PGRES_TUPLES_CHUNK:
+#endif
+      case PGRES_TUPLES_OK:
+        lpq_countresult(S->conn->stats, result);
+        S->result = result;
+        S->row = 0;
+        if (S->col == NULL && PQnfields(result) > 0) { /* resolve decoders */
+          int f, n = PQnfields(result), cat;
+          S->col = (lpq_Column *) malloc(n * sizeof(lpq_Column));
+          if (S->col == NULL) luaL_error(L, "not enough memory");
+          cat = lpq_pushcatalog(L, S->conn);
+          for (f = 0; f < n; f++, S->n++)
+            lpq_initcolumn(L, &S->col[f], PQftype(result, f),
+                PQfmod(result, f), cat);
+          if (cat != 0) lua_pop(L, 1);
+          lpq_setmodes(S->col, S->n, S->conn);
+        }
+        break;
+      case PGRES_COMMAND_OK:
+      case PGRES_EMPTY_QUERY:
+        PQclear(result);
+        break;
+      default:
+        lua_pushstring(L, PQresultErrorMessage(result));
+        PQclear(result);
+        lpq_streamclose(L, S);
+        return lua_error(L);
+    }
+  }
 }
 
-static int lpq_plan_exec (lua_State *L) {
-  lpq_Plan *P = lpq_checkplan(L, 1);
-  lpq_setparams(L, P);
-  lpq_pushresult(L, PQexecPrepared(P->conn->conn, P->name, P->n,
-      P->value, P->length, P->format, 1)); /* binary */
+
+/* =======   lpq_Pool   ======= */
+
+static lpq_Pool *lpq_checkpool (lua_State *L, int narg) {
+  lpq_Pool *P = NULL;
+  if (lua_getmetatable(L, narg)) { /* has metatable? */
+    if (lua_rawequal(L, -1, lua_upvalueindex(1))) /* MT == upvalue? */
+      P = (lpq_Pool *) lua_touserdata(L, narg);
+    lua_pop(L, 1); /* MT */
+  }
+  if (P == NULL) lpq_typeerror(L, narg, LPQ_POOL_NAME);
+  if (P->closed) luaL_error(L, LPQ_POOL_NAME " is closed");
+  return P;
+}
+
+/* pool = psql.pool(conninfo, n [, maxinflight]) */
+/* lpq_Conn MT as first and lpq_Pool MT as second upvalue */
+static int lpq_pool (lua_State *L) {
+  const char *conninfo = luaL_checkstring(L, 1);
+  int i, n = (int) luaL_checkinteger(L, 2);
+  int maxinflight = (int) luaL_optinteger(L, 3, n);
+  lpq_Pool *P;
+  lpq_Conn **C;
+  PostgresPollingStatusType *state;
+  double *deadline;
+  luaL_argcheck(L, n > 0, 2, "positive number of connections expected");
+  luaL_argcheck(L, maxinflight > 0, 3, "positive limit expected");
+  lua_settop(L, 3);
+  P = (lpq_Pool *) lua_newuserdata(L, sizeof(lpq_Pool)
+      + n * (sizeof(lpq_PoolSlot) + sizeof(struct pollfd) + 2 * sizeof(int)));
+  P->n = 0;
+  P->maxinflight = maxinflight;
+  P->inflight = 0;
+  P->nextid = P->dispatched = 0;
+  P->nidle = P->nready = 0;
+  P->closed = 0;
+  P->slot = (lpq_PoolSlot *) (P + 1);
+  P->pfd = (struct pollfd *) (P->slot + n);
+  P->idle = (int *) (P->pfd + n);
+  P->ready = P->idle + n;
+#ifdef LPQ_HAS_EPOLL
+  P->epfd = epoll_create(n);
+#else
+  P->epfd = -1;
+#endif
+  lua_pushvalue(L, lua_upvalueindex(2)); /* lpq_Pool MT */
+  lua_setmetatable(L, -2);
+  lua_createtable(L, n, n + 1); /* env(pool) */
+  lua_newtable(L);
+  lua_setfield(L, -2, LPQ_POOL_QUEUE);
+  for (i = 0; i < n; i++) { /* connect concurrently */
+    lpq_pushconnection(L, PQconnectStart(conninfo));
+    P->slot[i].conn = (lpq_Conn *) lua_touserdata(L, -1);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, i + 1); /* env(pool)[i + 1] = conn */
+    lua_pushinteger(L, i);
+    lua_rawset(L, -3); /* env(pool)[conn] = i */
+  }
+  deadline = (double *) lua_newuserdata(L, n * (sizeof(double)
+        + sizeof(lpq_Conn *) + sizeof(PostgresPollingStatusType)));
+  C = (lpq_Conn **) (deadline + n);
+  state = (PostgresPollingStatusType *) (C + n);
+  for (i = 0; i < n; i++) C[i] = P->slot[i].conn;
+  /* pfd, idle unused yet */
+  lpq_connectpoll(C, state, P->pfd, P->idle, deadline, n, -1);
+  for (i = 0; i < n; i++) {
+    if (state[i] != PGRES_POLLING_OK) {
+      lua_pushnil(L);
+      if (state[i] == PGRES_POLLING_FAILED)
+        lua_pushstring(L, PQerrorMessage(C[i]->conn));
+      else
+        lua_pushliteral(L, "timeout");
+      return 2; /* connections are finished when collected */
+    }
+    P->slot[i].id = 0;
+    P->slot[i].leased = 0;
+    P->slot[i].result = NULL;
+    P->slot[i].copy = 0;
+    P->idle[P->nidle++] = n - 1 - i; /* first slots on top */
+    P->n++;
+  }
+  lua_pop(L, 1); /* deadline, C and state */
+  lua_setuservalue(L, -2);
   return 1;
 }
 
-
-/* =======   lpq_Rset   ======= */
-
-static lpq_Rset *lpq_checkrset (lua_State *L, int narg) {
-  lpq_Rset *R = NULL;
-  if (lua_getmetatable(L, narg)) { /* has metatable? */
-    if (lua_rawequal(L, -1, lua_upvalueindex(1))) /* MT == upvalue? */
-      R = (lpq_Rset *) lua_touserdata(L, narg);
-    lua_pop(L, 1); /* MT */
+static void lpq_poolwatch (lpq_Pool *P, int i, int add) {
+#ifdef LPQ_HAS_EPOLL
+  if (P->epfd >= 0) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = (uint32) i;
+    epoll_ctl(P->epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+        PQsocket(P->slot[i].conn->conn), &ev);
   }
-  if (R == NULL) lpq_typeerror(L, narg, LPQ_RSET_NAME);
-  return R;
-}
-
-static int lpq_rset__tostring (lua_State *L) {
-  lua_pushfstring(L, LPQ_RSET_NAME ": %p", (void *) lua_touserdata(L, 1));
-  return 1;
+#else
+  (void) P; (void) i; (void) add;
+#endif
 }
 
-static int lpq_rset__gc (lua_State *L) {
-  lpq_Rset *R = (lpq_Rset *) lua_touserdata(L, 1);
-  ExecStatusType status = PQresultStatus(R->result);
-  if (status == PGRES_TUPLES_OK) {
-    /* mark tuples that reference rset as invalid */
-    lua_getuservalue(L, 1);
-    lua_pushnil(L);
-    while (lua_next(L, 2)) {
-      if (lua_tointeger(L, -2) > 0) { /* tuple? */
-        lpq_Tuple *T = (lpq_Tuple *) lua_touserdata(L, -1);
-        T->valid = 0;
+/* read what is available for query in slot i; move it to ready stack
+ * when all its results are in */
+static void lpq_poolread (lpq_Pool *P, int i) {
+  lpq_PoolSlot *S = &P->slot[i];
+  PGconn *conn = S->conn->conn;
+  if (!PQconsumeInput(conn) && PQstatus(conn) == CONNECTION_BAD) {
+    if (S->result == NULL) /* report error */
+      S->result = PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+  }
+  else {
+    for (;;) { /* keep last result, or that of COPY */
+      PGresult *result;
+      ExecStatusType status;
+      if (S->copy == 1) { /* discard COPY data */
+        char *buf;
+        int n = PQgetCopyData(conn, &buf, 1);
+        if (n > 0) {
+          PQfreemem(buf);
+          continue;
+        }
+        if (n == 0) return; /* wait for more */
+        S->copy = 2;
       }
-      lua_pop(L, 1);
+      if (PQisBusy(conn)) return;
+      result = PQgetResult(conn);
+      if (result == NULL) break;
+      status = PQresultStatus(result);
+      if (status == PGRES_COPY_IN) { /* no data to send: fail COPY */
+        PQclear(result);
+        PQputCopyEnd(conn, "COPY FROM STDIN is not supported by pool");
+        continue;
+      }
+      if (status == PGRES_COPY_OUT || status == PGRES_COPY_BOTH) {
+        if (status == PGRES_COPY_BOTH) PQputCopyEnd(conn, NULL);
+        S->copy = 1;
+      }
+      else if (S->copy == 2) { /* result after COPY */
+        PQclear(result);
+        continue;
+      }
+      PQclear(S->result);
+      S->result = result;
     }
   }
-  PQclear(R->result);
-  return 0;
+  lpq_poolwatch(P, i, 0);
+  P->ready[P->nready++] = i;
 }
 
-static int lpq_rset__len (lua_State *L) {
-  lpq_Rset *R = (lpq_Rset *) lua_touserdata(L, 1);
-  ExecStatusType status = PQresultStatus(R->result);
-  if (status == PGRES_TUPLES_OK)
-    lua_pushinteger(L, PQntuples(R->result));
-  else if (status == PGRES_COMMAND_OK)
-    lua_pushinteger(L, atoi(PQcmdTuples(R->result)));
-  else lua_pushnil(L);
-  return 1;
+/* send queued queries to idle connections */
+/* pool at stack pos 1 */
+static void lpq_pooldispatch (lua_State *L, lpq_Pool *P) {
+  if (P->dispatched == P->nextid || P->nidle == 0
+      || P->inflight >= P->maxinflight)
+    return;
+  lua_getuservalue(L, 1);
+  lua_getfield(L, -1, LPQ_POOL_QUEUE);
+  while (P->dispatched < P->nextid && P->nidle > 0
+      && P->inflight < P->maxinflight) {
+    int i = P->idle[--P->nidle];
+    lpq_PoolSlot *S = &P->slot[i];
+    int id = ++P->dispatched;
+    lua_rawgeti(L, -1, id);
+    S->id = id;
+    S->result = NULL;
+    S->copy = 0;
+    P->inflight++;
+    if (PQsendQueryParams(S->conn->conn, lua_tostring(L, -1),
+          0, NULL, NULL, NULL, NULL, 1)) { /* binary, no params */
+      S->conn->stats->queries++;
+      lpq_poolwatch(P, i, 1);
+    }
+    else { /* report error */
+      S->result = PQmakeEmptyPGresult(S->conn->conn, PGRES_FATAL_ERROR);
+      P->ready[P->nready++] = i;
+    }
+    lua_pop(L, 1); /* query */
+    lua_pushnil(L);
+    lua_rawseti(L, -2, id); /* env(pool).queue[id] = nil */
+  }
+  lua_pop(L, 2);
 }
 
-/* lpq_Tuple MT as second upvalue */
-static int lpq_rset__index (lua_State *L) {
-  lpq_Rset *R = (lpq_Rset *) lua_touserdata(L, 1);
-  if (lua_isnumber(L, 2)) {
-    int n = lua_tointeger(L, 2);
-    if (PQresultStatus(R->result) != PGRES_TUPLES_OK
-        || n < 1 || n > PQntuples(R->result))
-      lua_pushnil(L);
-    else {
-      lua_getuservalue(L, 1);
-      lua_rawgeti(L, -1, n);
-      if (lua_isnil(L, -1)) {
-        lpq_Tuple *T = (lpq_Tuple *) lua_newuserdata(L, sizeof(lpq_Tuple));
-        T->rset = R;
-        T->row = n - 1; /* zero-based */
-        T->valid = 1;
-        lua_pushvalue(L, lua_upvalueindex(2)); /* lpq_Tuple MT */
-        lua_setmetatable(L, -2);
-        lua_getfield(L, 3, LPQ_RSET_FIELDS); /* rset_env.fields */
-        lua_setuservalue(L, -2); /* tuple env is rset env fields */
-        lua_pushvalue(L, -1); /* tuple */
-        lua_rawseti(L, 3, n); /* rset_env[n] = tuple */
-      }
+/* wait for sockets of queries in flight; timeout in ms, -1 to block */
+static int lpq_poolwait (lpq_Pool *P, int timeout) {
+  int i, k, status;
+#ifdef LPQ_HAS_EPOLL
+  if (P->epfd >= 0) {
+    struct epoll_event ev[64];
+    do status = epoll_wait(P->epfd, ev, 64, timeout);
+    while (status < 0 && errno == EINTR);
+    for (k = 0; k < status; k++)
+      lpq_poolread(P, (int) ev[k].data.u32);
+    return status;
+  }
+#endif
+  for (i = k = 0; i < P->n; i++) {
+    if (P->slot[i].id != 0) {
+      P->pfd[k].fd = PQsocket(P->slot[i].conn->conn);
+      P->pfd[k].events = POLLIN;
+      P->pfd[k].revents = 0;
+      P->idle[P->nidle + k] = i; /* scratch after idle stack */
+      k++;
     }
   }
-  else lua_rawget(L, lua_upvalueindex(1)); /* lpq_Rset class */
-  return 1;
+  do status = lpq_poll(P->pfd, k, timeout);
+  while (status < 0 && errno == EINTR);
+  for (i = 0; status > 0 && i < k; i++)
+    if (P->pfd[i].revents != 0) lpq_poolread(P, P->idle[P->nidle + i]);
+  return status;
 }
 
-static int lpq_rset_fields (lua_State *L) {
-  lpq_Rset *R = lpq_checkrset(L, 1);
-  if (PQresultStatus(R->result) != PGRES_TUPLES_OK)
-    lua_pushnil(L);
-  else {
-    lua_getuservalue(L, 1);
-    lua_getfield(L, -1, LPQ_RSET_FIELDS);
+/* push id and result of a finished query */
+/* pool at stack pos 1, lpq_Rset MT as second upvalue */
+static int lpq_poolpop (lua_State *L, lpq_Pool *P) {
+  int i = P->ready[--P->nready];
+  lpq_PoolSlot *S = &P->slot[i];
+  PGresult *result = S->result;
+  lua_pushinteger(L, S->id);
+  S->id = 0;
+  S->result = NULL;
+  P->inflight--;
+  P->idle[P->nidle++] = i;
+  lpq_pushresult(L, S->conn, result);
+  lpq_pooldispatch(L, P);
+  return 2;
+}
+
+static void lpq_poolclose (lpq_Pool *P) {
+  int i;
+  for (i = 0; i < P->n; i++) {
+    PQclear(P->slot[i].result);
+    P->slot[i].result = NULL;
   }
-  return 1;
+#ifdef LPQ_HAS_EPOLL
+  if (P->epfd >= 0) close(P->epfd);
+#endif
+  P->epfd = -1;
+  P->closed = 1;
 }
 
-static int lpq_rset_status (lua_State *L) {
-  lpq_Rset *R = lpq_checkrset(L, 1);
-  lua_pushstring(L, PQresStatus(PQresultStatus(R->result)));
+static int lpq_pool__gc (lua_State *L) {
+  lpq_Pool *P = (lpq_Pool *) lua_touserdata(L, 1);
+  if (!P->closed) lpq_poolclose(P);
+  return 0;
+}
+
+static int lpq_pool__tostring (lua_State *L) {
+  lua_pushfstring(L, LPQ_POOL_NAME ": %p", lua_touserdata(L, 1));
   return 1;
 }
 
-static int lpq_rset_error (lua_State *L) {
-  lpq_Rset *R = lpq_checkrset(L, 1);
-  lua_pushstring(L, PQresultErrorMessage(R->result));
+static int lpq_pool__len (lua_State *L) {
+  lpq_Pool *P = (lpq_Pool *) lua_touserdata(L, 1);
+  lua_pushinteger(L, P->n);
   return 1;
 }
 
-static int lpq_rset_cmdstatus (lua_State *L) {
-  lpq_Rset *R = lpq_checkrset(L, 1);
-  if (PQresultStatus(R->result) == PGRES_COMMAND_OK)
-    lua_pushstring(L, PQcmdStatus(R->result));
-  else lua_pushnil(L);
+/* id = pool:submit(cmd): queue cmd; id identifies its result */
+static int lpq_pool_submit (lua_State *L) {
+  lpq_Pool *P = lpq_checkpool(L, 1);
+  luaL_checkstring(L, 2);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+  lua_getfield(L, -1, LPQ_POOL_QUEUE);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, ++P->nextid); /* env(pool).queue[id] = cmd */
+  lua_pop(L, 2);
+  lpq_pooldispatch(L, P);
+  lua_pushinteger(L, P->nextid);
   return 1;
 }
 
-static int lpq_rset_fetchaux (lua_State *L) {
-  lpq_Rset *R = (lpq_Rset *) lua_touserdata(L, lua_upvalueindex(1));
-  int rowindex = lua_toboolean(L, lua_upvalueindex(2));
-  int i = lua_tointeger(L, lua_upvalueindex(3)); /* current row */
-  if (i < PQntuples(R->result)) {
-    int f, n = PQnfields(R->result);
-    if (rowindex) lua_pushinteger(L, i + 1);
-    for (f = 0; f < n; f++) {
-      if (PQgetisnull(R->result, i, f)) lua_pushnil(L);
-      else lpq_pushvalue(L, PQftype(R->result, f), PQfmod(R->result, f),
-                         PQgetvalue(R->result, i, f), PQgetlength(R->result, i, f), R->result, f, rowindex);
+/* id, rset = pool:wait([timeout]): next finished query in order of
+ * completion; nil if no query is pending, nil and "timeout" on timeout */
+/* lpq_Rset MT as second upvalue */
+static int lpq_pool_wait (lua_State *L) {
+  lpq_Pool *P = lpq_checkpool(L, 1);
+  int ms = lpq_opttimeout(L, 2);
+  double deadline = lpq_clockms() + ms;
+  lua_settop(L, 1);
+  lpq_pooldispatch(L, P);
+  while (P->nready == 0) {
+    if (P->inflight == 0) {
+      lua_pushnil(L);
+      if (P->dispatched == P->nextid) return 1; /* nothing to wait for */
+      lua_pushliteral(L, "no connection available");
+      return 2;
+    }
+    if (lpq_poolwait(P, ms) < 0) return luaL_error(L, "%s", strerror(errno));
+    if (P->nready == 0 && ms >= 0 && (ms = lpq_timeleft(deadline)) == 0) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "timeout");
+      return 2;
     }
-    if (rowindex) n++;
-    lua_pushinteger(L, i + 1);
-    lua_replace(L, lua_upvalueindex(3));
-    return n;
   }
-  return 0;
+  return lpq_poolpop(L, P);
 }
 
-/* rset:fetch(rowindex?) */
-static int lpq_rset_fetch (lua_State *L) {
-  lpq_checkrset(L, 1);
+/* rsets = pool:exec(cmds): run array of commands, results in same order */
+/* lpq_Rset MT as second upvalue */
+static int lpq_pool_exec (lua_State *L) {
+  lpq_Pool *P = lpq_checkpool(L, 1);
+  int i, first, n;
+  luaL_checktype(L, 2, LUA_TTABLE);
   lua_settop(L, 2);
-  lua_pushinteger(L, 0); /* current row */
-  lua_pushcclosure(L, lpq_rset_fetchaux, 3);
+  n = (int) lua_rawlen(L, 2);
+  if (P->inflight > 0 || P->dispatched < P->nextid)
+    return luaL_error(L, LPQ_POOL_NAME " has pending queries");
+  lua_getuservalue(L, 1);
+  lua_getfield(L, -1, LPQ_POOL_QUEUE);
+  first = P->nextid + 1;
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 2, i);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      luaL_error(L, "command %d: string expected", i);
+    lua_rawseti(L, -2, ++P->nextid);
+  }
+  lua_pop(L, 2);
+  lua_createtable(L, n, 0); /* results */
+  lua_replace(L, 2);
+  for (;;) {
+    lpq_pooldispatch(L, P);
+    if (P->nready == 0) {
+      if (P->inflight == 0) {
+        if (P->dispatched == P->nextid) break; /* done */
+        return luaL_error(L, "no connection available");
+      }
+      if (lpq_poolwait(P, -1) < 0) return luaL_error(L, "%s", strerror(errno));
+      continue;
+    }
+    lpq_poolpop(L, P);
+    lua_rawseti(L, 2, (int) lua_tointeger(L, -2) - first + 1);
+    lua_pop(L, 1); /* id */
+  }
   return 1;
 }
 
-
-/* auxiliar closure (on tuple) to lpq_rset_rows */
-static int lpq_rset_rowsaux (lua_State *L) {
-  lpq_Rset *R = (lpq_Rset *) lua_touserdata(L, 1);
-  int n = lua_tointeger(L, 2);
-  lpq_Tuple *T = (lpq_Tuple *) lua_touserdata(L, lua_upvalueindex(1));
-  if (PQresultStatus(R->result) != PGRES_TUPLES_OK
-      || n == PQntuples(R->result)) {
-    T->valid = 0;
+/* conn = pool:acquire(): idle connection, not used by the pool until
+ * released; nil if all are busy */
+static int lpq_pool_acquire (lua_State *L) {
+  lpq_Pool *P = lpq_checkpool(L, 1);
+  int i;
+  if (P->nidle == 0) {
     lua_pushnil(L);
     return 1;
   }
-  T->row = n;
-  lua_pushinteger(L, n + 1);
-  lua_pushvalue(L, lua_upvalueindex(1));
-  return 2;
-}
-
-/* lpq_Tuple MT as upvalue */
-static int lpq_rset_rows (lua_State *L) {
-  lpq_Rset *R = lpq_checkrset(L, 1);
-  lpq_Tuple *T;
+  i = P->idle[--P->nidle];
+  P->slot[i].leased = 1;
   lua_getuservalue(L, 1);
-  T = (lpq_Tuple *) lua_newuserdata(L, sizeof(lpq_Tuple));
-  T->rset = R;
-  T->valid = 1;
-  lua_pushvalue(L, lua_upvalueindex(2)); /* lpq_Tuple MT */
-  lua_setmetatable(L, -2);
-  lua_getfield(L, 2, LPQ_RSET_FIELDS); /* rset_env.fields */
-  lua_setuservalue(L, -2); /* tuple env is rset env fields */
-  lua_pushcclosure(L, lpq_rset_rowsaux, 1);
-  lua_pushvalue(L, 1);
-  lua_pushinteger(L, 0);
-  return 3;
-}
-
-
-/* =======   lpq_Tuple   ======= */
-
-static int lpq_tuple__tostring (lua_State *L) {
-  lua_pushfstring(L, LPQ_TUPLE_NAME ": %p", lua_touserdata(L, 1));
+  lua_rawgeti(L, -1, i + 1);
   return 1;
 }
 
-static int lpq_tuple__len (lua_State *L) {
-  lpq_Tuple *T = (lpq_Tuple *) lua_touserdata(L, 1);
-  if (!T->valid) lua_pushnil(L);
-  else lua_pushinteger(L, T->row);
-  return 1;
+/* pool:release(conn) */
+static int lpq_pool_release (lua_State *L) {
+  lpq_Pool *P = lpq_checkpool(L, 1);
+  int i;
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  if (!lua_isnumber(L, -1))
+    return luaL_argerror(L, 2, "connection from pool expected");
+  i = (int) lua_tointeger(L, -1);
+  if (!P->slot[i].leased)
+    return luaL_argerror(L, 2, "connection was not acquired");
+  P->slot[i].leased = 0;
+  P->idle[P->nidle++] = i;
+  lua_settop(L, 1);
+  lpq_pooldispatch(L, P);
+  return 0;
 }
 
-static int lpq_tuple__index (lua_State *L) {
-  lpq_Tuple *T = (lpq_Tuple *) lua_touserdata(L, 1);
-  PGresult *result = T->rset->result;
-  if (!T->valid) lua_pushnil(L);
-  else {
-    lua_getuservalue(L, 1);
-    lua_pushvalue(L, 2);
-    lua_rawget(L, -2);
-    if (lua_isnumber(L, -1)) { /* field name match? */
-      int f = lua_tointeger(L, -1); /* field number */
-      if (PQgetisnull(result, T->row, f)) lua_pushnil(L);
-      else {
-        lpq_pushvalue(L, PQftype(result, f), PQfmod(result, f),
-          PQgetvalue(result, T->row, f), PQgetlength(result, T->row, f), result, f, T->row);
-      }
-    }
+/* pool:close(): finish all connections */
+static int lpq_pool_close (lua_State *L) {
+  lpq_Pool *P = lpq_checkpool(L, 1);
+  int i;
+  lpq_poolclose(P);
+  lua_getuservalue(L, 1);
+  for (i = 1; i <= P->n; i++) {
+    if (P->slot[i - 1].conn->done) continue;
+    lua_rawgeti(L, -1, i);
+    lua_getfield(L, -1, "finish");
+    lua_insert(L, -2);
+    lua_call(L, 1, 0);
   }
-  return 1;
+  lua_newtable(L);
+  lua_setuservalue(L, 1);
+  return 0;
 }
 
 
-
 /* =======   Interface   ======= */
 
 static const luaL_Reg lpq_conn_mt[] = {
@@ -1010,9 +5074,22 @@ static const luaL_Reg lpq_conn_mt[] = {
 
 static const luaL_Reg lpq_conn_func[] = {
   {"notifies", lpq_conn_notifies},
+  {"stats", lpq_conn_stats},
+  {"resetstats", lpq_conn_resetstats},
+  {"setlatency", lpq_conn_setlatency},
+  {"latency", lpq_conn_latency},
+  {"resetlatency", lpq_conn_resetlatency},
+  {"setslowlog", lpq_conn_setslowlog},
+  {"onnotify", lpq_conn_onnotify},
+  {"dispatch", lpq_conn_dispatch},
   {"poll", lpq_conn_poll},
   {"status", lpq_conn_status},
   {"finish", lpq_conn_finish},
+  {"setcachesize", lpq_conn_setcachesize},
+  {"setviews", lpq_conn_setviews},
+  {"setnumeric", lpq_conn_setnumeric},
+  {"settimestamp", lpq_conn_settimestamp},
+  {"loadtypes", lpq_conn_loadtypes},
   {"reset", lpq_conn_reset},
   {"resetstart", lpq_conn_resetstart},
   {"resetpoll", lpq_conn_resetpoll},
@@ -1028,7 +5105,17 @@ static const luaL_Reg lpq_conn_func[] = {
   {"escape", lpq_conn_escape},
   {"isbusy", lpq_conn_isbusy},
   {"consume", lpq_conn_consume},
+  {"wait", lpq_conn_wait},
+  {"ready", lpq_conn_ready},
   {"query", lpq_conn_query},
+  {"flush", lpq_conn_flush},
+#ifdef LIBPQ_HAS_PIPELINING
+  {"enterpipeline", lpq_conn_enterpipeline},
+  {"exitpipeline", lpq_conn_exitpipeline},
+  {"pipelinesync", lpq_conn_pipelinesync},
+  {"sendflushrequest", lpq_conn_sendflushrequest},
+  {"pipelinestatus", lpq_conn_pipelinestatus},
+#endif
   {NULL, NULL}
 };
 
@@ -1056,6 +5143,61 @@ static const luaL_Reg lpq_rset_func[] = {
   {"error", lpq_rset_error},
   {"cmdstatus", lpq_rset_cmdstatus},
   {"fetch", lpq_rset_fetch},
+  {"totable", lpq_rset_totable},
+  {"columns", lpq_rset_columns},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lpq_buffer_mt[] = {
+  {"__tostring", lpq_buffer__tostring},
+  {"__len", lpq_buffer__len},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lpq_buffer_func[] = {
+  {"type", lpq_buffer_type},
+  {"pointer", lpq_buffer_pointer},
+  {"nulls", lpq_buffer_nulls},
+  {"isnull", lpq_buffer_isnull},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lpq_view_mt[] = {
+  {"__tostring", lpq_view__tostring},
+  {"__len", lpq_view__len},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lpq_view_func[] = {
+  {"sub", lpq_view_sub},
+  {"tostring", lpq_view_tostring},
+  {"pointer", lpq_view_pointer},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lpq_range_mt[] = {
+  {"__tostring", lpq_range__tostring},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lpq_range_func[] = {
+  {"contains", lpq_range_contains},
+  {"overlaps", lpq_range_overlaps},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lpq_pool_mt[] = {
+  {"__gc", lpq_pool__gc},
+  {"__tostring", lpq_pool__tostring},
+  {"__len", lpq_pool__len},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lpq_pool_func[] = {
+  {"submit", lpq_pool_submit},
+  {"acquire", lpq_pool_acquire},
+  {"release", lpq_pool_release},
+  {"close", lpq_pool_close},
   {NULL, NULL}
 };
 
@@ -1066,11 +5208,37 @@ static const luaL_Reg lpq_tuple_mt[] = {
   {NULL, NULL}
 };
 
+static const luaL_Reg lpq_copy_mt[] = {
+  {"__gc", lpq_copy__gc},
+  {"__tostring", lpq_copy__tostring},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lpq_copy_func[] = {
+  {"put", lpq_copy_put},
+  {"flush", lpq_copy_flush},
+  {"finish", lpq_copy_finish},
+  {NULL, NULL}
+};
+static const luaL_Reg lpq_stream_mt[] = {
+  {"__gc", lpq_stream__gc},
+  {"__tostring", lpq_stream__tostring},
+  {NULL, NULL}
+};
+
+static const luaL_Reg lpq_stream_func[] = {
+  {"finish", lpq_stream_finish},
+  {NULL, NULL}
+};
+
 
 static const luaL_Reg psql_func[] = {
   {"connect", lpq_connect},
   {"start", lpq_start},
+  {"connect_many", lpq_connect_many},
   {"register", lpq_register},
+  {"clock", lpq_clock},
+  {"range", lpq_range},
   {NULL, NULL}
 };
 
@@ -1078,6 +5246,30 @@ int luaopen_psql (lua_State *L) {
   lua_pushlightuserdata(L, LPQ_TYPE_MT);
   lua_newtable(L); /* type MT table */
   lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, LPQ_ARRAY_TYPE);
+  lua_newtable(L); /* array type table */
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, LPQ_ANCHOR_MT);
+  lua_createtable(L, 0, 1); /* anchor MT */
+  lua_pushcfunction(L, lpq_anchor__gc);
+  lua_setfield(L, -2, "__gc");
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, LPQ_VIEW_MT);
+  luaL_newlibtable(L, lpq_view_mt); /* lpq_View MT */
+  lpq_registerlib(L, lpq_view_mt, 0); /* push metamethods */
+  luaL_newlibtable(L, lpq_view_func); /* lpq_View class */
+  lua_pushvalue(L, -2);
+  lpq_registerlib(L, lpq_view_func, 1); /* push methods */
+  lua_setfield(L, -2, "__index");
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, LPQ_RANGE_MT);
+  luaL_newlibtable(L, lpq_range_mt); /* lpq_Range MT */
+  lpq_registerlib(L, lpq_range_mt, 0); /* push metamethods */
+  luaL_newlibtable(L, lpq_range_func); /* lpq_Range class */
+  lua_pushvalue(L, -2);
+  lpq_registerlib(L, lpq_range_func, 1); /* push methods */
+  lua_setfield(L, -2, "__index");
+  lua_rawset(L, LUA_REGISTRYINDEX);
   /* === lpq_Conn === */
   luaL_newlibtable(L, lpq_conn_mt); /* lpq_Conn MT */
   lpq_registerlib(L, lpq_conn_mt, 0); /* push metamethods */
@@ -1105,7 +5297,60 @@ int luaopen_psql (lua_State *L) {
   lua_pushvalue(L, -3); lua_pushvalue(L, -2); /* lpq_Conn and lpq_Rset MT */
   lua_pushcclosure(L, lpq_conn_exec, 2);
   lua_setfield(L, -3, "exec");
+#if LUA_VERSION_NUM >= 502
+  lua_pushvalue(L, -3); lua_pushvalue(L, -2); /* lpq_Conn and lpq_Rset MT */
+  lua_pushcclosure(L, lpq_conn_aexec, 2);
+  lua_setfield(L, -3, "aexec");
+#endif
+  lua_pushvalue(L, -3); lua_pushvalue(L, -2); lua_pushvalue(L, -6);
+  lua_pushcclosure(L, lpq_conn_execp, 3); /* lpq_Conn, Rset and Plan MT */
+  lua_setfield(L, -3, "execp");
+  lua_pushvalue(L, -3); lua_pushvalue(L, -2); /* lpq_Conn and lpq_Rset MT */
+  lua_pushcclosure(L, lpq_makeresult, 2);
+  lua_setfield(L, -6, "makeresult"); /* lib */
   lua_insert(L, -4); /* lpq_Rset MT below lpq_Conn MT, class, and lpq_Plan */
+  /* === lpq_Copy === */
+  luaL_newlibtable(L, lpq_copy_mt); /* lpq_Copy MT */
+  lpq_registerlib(L, lpq_copy_mt, 0); /* push metamethods */
+  lua_pushvalue(L, -3); lua_pushvalue(L, -2); /* lpq_Conn and lpq_Copy MT */
+  lua_pushcclosure(L, lpq_conn_copyin, 2);
+  lua_setfield(L, -3, "copyin");
+  lua_pushvalue(L, -3); lua_pushvalue(L, -2); /* lpq_Conn and lpq_Copy MT */
+  lua_pushcclosure(L, lpq_conn_copyout, 2);
+  lua_setfield(L, -3, "copyout");
+  luaL_newlibtable(L, lpq_copy_func); /* lpq_Copy class */
+  lua_pushvalue(L, -2); lua_pushvalue(L, -7); /* lpq_Copy and lpq_Rset MT */
+  lpq_registerlib(L, lpq_copy_func, 2); /* push methods */
+  lua_setfield(L, -2, "__index"); /* MT(copy).__index = class(copy) */
+  lua_pop(L, 1); /* lpq_Copy MT */
+  /* === lpq_Stream === */
+  luaL_newlibtable(L, lpq_stream_mt); /* lpq_Stream MT */
+  lpq_registerlib(L, lpq_stream_mt, 0); /* push metamethods */
+  lua_pushvalue(L, -3); lua_pushvalue(L, -2); /* lpq_Conn and lpq_Stream MT */
+  lua_pushcclosure(L, lpq_conn_stream, 2);
+  lua_setfield(L, -3, "stream");
+  luaL_newlibtable(L, lpq_stream_func); /* lpq_Stream class */
+  lua_pushvalue(L, -2);
+  lpq_registerlib(L, lpq_stream_func, 1); /* push methods */
+  lua_setfield(L, -2, "__index"); /* MT(stream).__index = class(stream) */
+  lua_pop(L, 1); /* lpq_Stream MT */
+  /* === lpq_Pool === */
+  luaL_newlibtable(L, lpq_pool_mt); /* lpq_Pool MT */
+  lpq_registerlib(L, lpq_pool_mt, 0); /* push metamethods */
+  lua_pushvalue(L, -3); lua_pushvalue(L, -2); /* lpq_Conn and lpq_Pool MT */
+  lua_pushcclosure(L, lpq_pool, 2);
+  lua_setfield(L, -7, "pool"); /* lib */
+  luaL_newlibtable(L, lpq_pool_func); /* lpq_Pool class */
+  lua_pushvalue(L, -2);
+  lpq_registerlib(L, lpq_pool_func, 1); /* push methods */
+  lua_pushvalue(L, -2); lua_pushvalue(L, -7); /* lpq_Pool and lpq_Rset MT */
+  lua_pushcclosure(L, lpq_pool_wait, 2);
+  lua_setfield(L, -2, "wait");
+  lua_pushvalue(L, -2); lua_pushvalue(L, -7); /* lpq_Pool and lpq_Rset MT */
+  lua_pushcclosure(L, lpq_pool_exec, 2);
+  lua_setfield(L, -2, "exec");
+  lua_setfield(L, -2, "__index"); /* MT(pool).__index = class(pool) */
+  lua_pop(L, 1); /* lpq_Pool MT */
   /* set lpq_Conn MT */
   lua_setfield(L, -2, "__index"); /* MT(conn).__index = class(conn) */
   lua_pop(L, 1); /* lpq_Conn MT */
@@ -1117,6 +5362,14 @@ int luaopen_psql (lua_State *L) {
   lua_pushvalue(L, -2); lua_pushvalue(L, -4); /* lpq_Plan and lpq_Rset MT */
   lua_pushcclosure(L, lpq_plan_exec, 2);
   lua_setfield(L, -2, "exec");
+#if LUA_VERSION_NUM >= 502
+  lua_pushvalue(L, -2); lua_pushvalue(L, -4); /* lpq_Plan and lpq_Rset MT */
+  lua_pushcclosure(L, lpq_plan_aexec, 2);
+  lua_setfield(L, -2, "aexec");
+#endif
+  lua_pushvalue(L, -2); lua_pushvalue(L, -4); /* lpq_Plan and lpq_Rset MT */
+  lua_pushcclosure(L, lpq_plan_execmany, 2);
+  lua_setfield(L, -2, "execmany");
   lua_setfield(L, -2, "__index"); /* MT(plan).__index = class(plan) */
   lua_pop(L, 1); /* lpq_Plan MT */
   /* === lpq_Rset === */
@@ -1124,6 +5377,18 @@ int luaopen_psql (lua_State *L) {
   luaL_newlibtable(L, lpq_rset_func); /* lpq_Rset class */
   lua_pushvalue(L, -2);
   lpq_registerlib(L, lpq_rset_func, 1); /* push methods */
+  /* === lpq_Buffer === */
+  luaL_newlibtable(L, lpq_buffer_mt); /* lpq_Buffer MT */
+  lpq_registerlib(L, lpq_buffer_mt, 0); /* push metamethods */
+  lua_pushvalue(L, -3); lua_pushvalue(L, -2); /* lpq_Rset and lpq_Buffer MT */
+  lua_pushcclosure(L, lpq_rset_column_buffer, 2);
+  lua_setfield(L, -3, "column_buffer");
+  luaL_newlibtable(L, lpq_buffer_func); /* lpq_Buffer class */
+  lua_pushvalue(L, -2);
+  lpq_registerlib(L, lpq_buffer_func, 1); /* push methods */
+  lua_pushcclosure(L, lpq_buffer__index, 1); /* lpq_Buffer class */
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1); /* lpq_Buffer MT */
   luaL_newlibtable(L, lpq_tuple_mt); /* lpq_Tuple MT */
   lpq_registerlib(L, lpq_tuple_mt, 0); /* push metamethods */
   lua_pushvalue(L, -3); lua_pushvalue(L, -2); /* lpq_Rset and lpq_Tuple MT */
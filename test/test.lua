@@ -11,22 +11,10 @@
 local psql = require "psql"
 
 -- ==========   non-blocking queries   =======
-require "socket"
-local socket_select = socket.select
-local function select_timeout (read, write, timeout)
-  local _, _, e = socket_select(read, write, timeout)
-  return e == "timeout"
-end
-
-local function connsocket (conn)
-  local fd = conn:socket() -- file descriptor
-  return { getfd = function () return fd end } -- luasocket socket object
-end
 
 -- === connect ===
 function connect (info, timeout)
   local conn = psql.start(info)
-  local list = { connsocket(conn) }
   local baderror = string.format("bad connection [%s]", info)
   local ok, status = conn:status()
   assert(status ~= "CONNECTION_BAD", baderror)
@@ -34,9 +22,9 @@ function connect (info, timeout)
   ok, status = false, "PGRES_POLLING_WRITING"
   repeat
     if status == "PGRES_POLLING_WRITING" then
-      assert(not select_timeout(nil, list, timeout), baderror) -- timed out?
+      assert(conn:wait("write", timeout), baderror) -- timed out?
     elseif status == "PGRES_POLLING_READING" then
-      assert(not select_timeout(list, nil, timeout), baderror) -- timed out?
+      assert(conn:wait("read", timeout), baderror) -- timed out?
     else
       error(baderror)
     end
@@ -47,16 +35,10 @@ end
 
 -- === query ===
 local function fetcher (conn)
-  local readlist = { connsocket(conn) }
   return function (timeout)
-    if not conn:isbusy() then -- ready to fetch?
-      return true, conn:getresult()
-    end
-    if select_timeout(readlist, nil, timeout) then -- not ready?
-      return false
-    end
-    assert(conn:consume()) -- consume some input
-    if conn:isbusy() then -- still busy?
+    local ready, e = conn:ready(timeout)
+    if not ready then -- not ready?
+      assert(e == "timeout", e)
       return false
     end
     return true, conn:getresult()
@@ -184,8 +166,9 @@ end
 
 local function register (typename)
   local class = require("pqtype." .. typename)
-  local o = c:exec("select '" .. typename .. "'::regtype::oid as o")[1].o
-  psql.register(o, getmetatable(class()))
+  local t = c:exec("select oid, typarray from pg_type" ..
+    " where oid = '" .. typename .. "'::regtype")[1]
+  psql.register(t.oid, getmetatable(class()), t.typarray)
   print("TYPE `" .. typename .. "' REGISTERED")
 end
 
@@ -255,3 +238,786 @@ print(string.rep("-", 40))
 checktest(test3, c)
 print(string.rep("=", 40))
 
+
+-- === fourth test ===
+local function test4 (conn, n)
+  -- create table
+  checkset(conn, conn:exec"CREATE TABLE copytest (i int, f double precision, t text)")
+  -- binary COPY: column types are needed to encode rows
+  local copy = assert(conn:copyin("COPY copytest FROM STDIN (FORMAT binary)",
+    {23, 701, 25})) -- int4, float8, text
+  for i = 1, n do
+    assert(copy:put(i, math.sin(i), i % 2 == 0 and tostring(i) or nil))
+  end
+  local r = copy:finish()
+  checkset(conn, r)
+  assert(#r == n, conn:error())
+  -- text COPY: raw data
+  copy = assert(conn:copyin("COPY copytest (i, t) FROM STDIN"))
+  assert(copy:put("0\tzero\n", "-1\t\\N\n"))
+  checkset(conn, copy:finish())
+  -- check table size and drop table
+  r = conn:exec("SELECT count(*) AS n, count(t) AS nt FROM copytest")
+  assert(r[1].n == n + 2 and r[1].nt == n / 2 + 1, conn:error())
+  checkset(conn, conn:exec"DROP TABLE copytest")
+end
+print("TEST 4")
+print(string.rep("-", 40))
+checktest(test4, c, 1e4)
+print(string.rep("=", 40))
+
+-- === fifth test ===
+local function test5 (conn, n)
+  -- create and populate table
+  checkset(conn, conn:exec"CREATE TABLE copytest (i int, f double precision, t text)")
+  checkset(conn, conn:exec("INSERT INTO copytest SELECT g, sin(g), " ..
+    "CASE WHEN g % 2 = 0 THEN g::text END FROM generate_series(1, " .. n .. ") g"))
+  -- binary COPY: values are decoded according to column types
+  local k = 0
+  for i, v, f, t in conn:copyout("COPY copytest TO STDOUT (FORMAT binary)",
+      {23, 701, 25}, true) do
+    assert(i == v and f == math.sin(v) and t == (v % 2 == 0 and tostring(v) or nil))
+    k = k + 1
+  end
+  assert(k == n)
+  -- text COPY: raw data
+  k = 0
+  for l in conn:copyout("COPY (SELECT i FROM copytest WHERE i < 3) TO STDOUT") do
+    k = k + 1
+    assert(l == k .. "\n")
+  end
+  assert(k == 2)
+  -- stop early
+  local iter, copy = conn:copyout("COPY copytest TO STDOUT (FORMAT binary)")
+  assert(#iter() == 4) -- raw int4
+  copy:finish()
+  checkset(conn, conn:exec"DROP TABLE copytest")
+end
+print("TEST 5")
+print(string.rep("-", 40))
+checktest(test5, c, 1e4)
+print(string.rep("=", 40))
+
+-- === sixth test ===
+local function test6 (conn, n)
+  -- rows are returned as they arrive
+  local k = 0
+  for i, v, s in conn:stream("SELECT g, g::text FROM generate_series(1, $1::int) g",
+      {n}) do
+    assert(i == v and s == tostring(v))
+    k = k + 1
+  end
+  assert(k == n)
+  -- NULL parameters and values
+  for i, v, b in conn:stream("SELECT $1::int, $2::bool", {nil, true, n = 2}) do
+    assert(i == 1 and v == nil and b == true)
+  end
+  -- stop early
+  local iter, stream = conn:stream("SELECT * FROM generate_series(1, $1::int)", {n})
+  assert(select(2, iter()) == 1)
+  stream:finish()
+  assert(iter() == nil)
+end
+print("TEST 6")
+print(string.rep("-", 40))
+checktest(test6, c, 1e4)
+print(string.rep("=", 40))
+
+-- === seventh test ===
+local function test7 (conn, n)
+  checkset(conn, conn:exec"CREATE TABLE pipetest (i int, f double precision)")
+  -- batch of inserts in one round trip
+  local plan = assert(conn:prepare("INSERT INTO pipetest VALUES ($1, $2)", "pipeins"))
+  local rows = {}
+  for i = 1, n do rows[i] = {i, math.sin(i)} end
+  local r = assert(plan:execmany(rows))
+  assert(#r == n)
+  for i = 1, n do assert(r[i]:status() == "PGRES_COMMAND_OK", conn:error()) end
+  -- bad row: pipeline is left and connection stays usable
+  local ok, e = pcall(plan.execmany, plan, {{1, 0.5}, "bad"})
+  assert(not ok and e:find("row 2", 1, true))
+  assert(select(2, conn:pipelinestatus()) == "PQ_PIPELINE_OFF")
+  assert(conn:exec("SELECT 1 AS one")[1].one == 1)
+  checkset(conn, conn:exec"DELETE FROM pipetest WHERE i = 1 AND f = 0.5")
+  -- pipelined queries, results in order
+  plan = assert(conn:prepare("SELECT f FROM pipetest WHERE i = $1", "pipesel"))
+  assert(conn:enterpipeline())
+  for i = 1, 3 do assert(plan:query(i)) end
+  assert(conn:query("SELECT count(*) AS n FROM pipetest"))
+  assert(conn:pipelinesync())
+  for i = 1, 3 do
+    assert(conn:getresult()[1].f == math.sin(i))
+    assert(conn:getresult() == nil)
+  end
+  assert(conn:getresult()[1].n == n)
+  assert(conn:getresult() == nil)
+  assert(conn:getresult():status() == "PGRES_PIPELINE_SYNC")
+  assert(conn:exitpipeline())
+  checkset(conn, conn:exec"DEALLOCATE pipeins")
+  checkset(conn, conn:exec"DEALLOCATE pipesel")
+  checkset(conn, conn:exec"DROP TABLE pipetest")
+end
+print("TEST 7")
+print(string.rep("-", 40))
+checktest(test7, c, 1e3)
+print(string.rep("=", 40))
+
+-- === eighth test ===
+local function test8 (conn, n)
+  checkset(conn, conn:exec"CREATE TABLE arraytest (i int[], m float8[], s text[])")
+  checkset(conn, conn:exec(string.format([=[INSERT INTO arraytest
+    SELECT array_agg(g), array[array[max(g), -max(g)], array[max(g) / 2.0, NULL]],
+      array['x' || max(g), NULL]
+    FROM generate_series(1, %d) g]=], n)))
+  local r = conn:exec"SELECT * FROM arraytest"
+  assert(r:status() == "PGRES_TUPLES_OK", conn:error())
+  local i, m, s = r:fetch()()
+  assert(#i == n and i[n] == n)
+  assert(#m == 2 and m[1][2] == -n and m[2][1] == n / 2 and m[2][2] == nil)
+  assert(s[1] == string.format("x%d", n) and s[2] == nil)
+  r = conn:exec"SELECT '{}'::int[] AS e, '[0:1]={a,b}'::varchar[] AS v"
+  assert(r:status() == "PGRES_TUPLES_OK", conn:error())
+  assert(next(r[1].e) == nil)
+  assert(r[1].v[1] == "a" and r[1].v[2] == "b")
+  checkset(conn, conn:exec"DROP TABLE arraytest")
+end
+print("TEST 8")
+print(string.rep("-", 40))
+checktest(test8, c, 1e4)
+print(string.rep("=", 40))
+
+-- === ninth test ===
+local function test9 (conn, n)
+  checkset(conn, conn:exec"CREATE TABLE unnesttest (i bigint, s text)")
+  -- bulk insert: one array parameter per column, NULL every third text
+  local ids, names = {}, {n = n}
+  for i = 1, n do
+    ids[i] = i
+    if i % 3 ~= 0 then names[i] = "name" .. i end
+  end
+  local plan = assert(conn:prepare("INSERT INTO unnesttest" ..
+    " SELECT * FROM unnest($1::bigint[], $2::text[])"))
+  checkset(conn, plan:exec(ids, names))
+  plan = assert(conn:prepare("SELECT count(*) AS n, count(s) AS s" ..
+    " FROM unnesttest WHERE i = ANY($1)"))
+  local r = plan:exec(ids)[1]
+  assert(r.n == n and r.s == n - math.floor(n / 3))
+  -- multi-dimensional and registered element types
+  local point = require"pqtype.point"
+  plan = assert(conn:prepare"SELECT $1::int[] AS m, $2::point[] AS p")
+  r = plan:exec({{1, 2, 3}, {4, 5, 6}}, {point(1, 2), point(3, 4)})[1]
+  assert(#r.m == 2 and r.m[2][3] == 6)
+  assert(tostring(r.p[2]) == tostring(point(3, 4)))
+  checkset(conn, conn:exec"DROP TABLE unnesttest")
+end
+print("TEST 9")
+print(string.rep("-", 40))
+checktest(test9, c, 1e4)
+print(string.rep("=", 40))
+
+-- === tenth test ===
+local function test10 (conn, n)
+  local r = conn:exec(string.format("SELECT g AS i, g::text AS s," ..
+    " NULLIF(g %% 2, 0) AS o FROM generate_series(1, %d) g", n))
+  assert(r:status() == "PGRES_TUPLES_OK", conn:error())
+  local rows, cols = r:totable(), r:columns()
+  assert(#rows == n and #cols.i == n)
+  for i = 1, n do
+    local t = rows[i]
+    assert(t.i == i and t.s == tostring(i) and t.o == (i % 2 == 1 and 1 or nil))
+    assert(cols.i[i] == t.i and cols.s[i] == t.s and cols.o[i] == t.o)
+  end
+  assert(conn:exec"SELECT 1":totable()[1]["?column?"] == 1)
+end
+print("TEST 10")
+print(string.rep("-", 40))
+checktest(test10, c, 1e3)
+print(string.rep("=", 40))
+
+-- === eleventh test ===
+local function test11 (conn, n)
+  local r = conn:exec(string.format("SELECT g::int8 AS i," ..
+    " NULLIF(g %% 10, 0)::float8 / 2 AS f FROM generate_series(1, %d) g", n))
+  assert(r:status() == "PGRES_TUPLES_OK", conn:error())
+  local i, f = r:column_buffer"i", r:column_buffer(2)
+  assert(#i == n and #f == n and i:type() == "int64_t")
+  assert(i:nulls() == nil and select(2, f:nulls()) == math.ceil(n / 8))
+  assert(select(2, f:pointer()) == 8 * n)
+  for k = 1, n do
+    assert(i[k] == k)
+    assert(f:isnull(k) == (k % 10 == 0))
+    assert(f[k] == (k % 10) / 2)
+  end
+  assert(not pcall(r.column_buffer, r, 3))
+end
+print("TEST 11")
+print(string.rep("-", 40))
+checktest(test11, c, 1e3)
+print(string.rep("=", 40))
+
+-- === twelfth test ===
+local function test12 (conn, n)
+  local function nprepared ()
+    return conn:exec"SELECT count(*) AS n FROM pg_prepared_statements"[1].n
+  end
+  local base = nprepared()
+  assert(conn:setcachesize(n) == 128)
+  for i = 1, 2 * n do
+    local k = i % (n + 1) -- one statement more than fits
+    local r = assert(conn:execp("SELECT $1::int + " .. k .. " AS x", i))
+    assert(r[1].x == i + k)
+  end
+  assert(nprepared() == base + n)
+  assert(conn:setcachesize(0) == n)
+  assert(nprepared() == base)
+  assert(conn:execp("SELECT $1::text AS s", "x")[1].s == "x")
+  conn:setcachesize(128)
+end
+print("TEST 12")
+print(string.rep("-", 40))
+checktest(test12, c, 10)
+print(string.rep("=", 40))
+
+-- === thirteenth test ===
+local function test13 (conn, conninfo, n)
+  local pool = assert(psql.pool(conninfo, n, n - 1))
+  assert(#pool == n)
+  -- longer queries first: results come in order of completion
+  local ids = {}
+  for i = 1, 2 * n do
+    local id = pool:submit(string.format("SELECT %d AS i, pg_sleep(%g)",
+      i, (2 * n - i) * 0.02))
+    ids[id] = i
+  end
+  local seen = 0
+  for k = 1, 2 * n do
+    local id, r = pool:wait()
+    assert(r[1].i == ids[id])
+    seen = seen + 1
+  end
+  assert(seen == 2 * n and pool:wait() == nil)
+  local r = pool:exec{"SELECT 1 AS x", "SELECT nonsense", "SELECT 3 AS x"}
+  assert(r[1][1].x == 1 and r[2]:status() == "PGRES_FATAL_ERROR" and r[3][1].x == 3)
+  -- COPY data is not moved, but connections stay usable
+  pool:exec{"CREATE TABLE IF NOT EXISTS lpq_poolcopy (i int4)"}
+  r = pool:exec{"COPY (SELECT generate_series(1, 100000)) TO STDOUT",
+    "COPY lpq_poolcopy FROM STDIN"}
+  assert(r[1]:status() == "PGRES_COPY_OUT")
+  assert(r[2]:status() == "PGRES_FATAL_ERROR")
+  local cmds = {"DROP TABLE lpq_poolcopy"}
+  for i = 2, 2 * n do cmds[i] = "SELECT " .. i .. " AS x" end
+  r = pool:exec(cmds)
+  assert(r[1]:status() == "PGRES_COMMAND_OK")
+  for i = 2, 2 * n do assert(r[i][1].x == i) end
+  -- acquired connections are left alone
+  local leased = {}
+  for i = 1, n do leased[i] = assert(pool:acquire()) end
+  assert(pool:acquire() == nil)
+  pool:submit"SELECT 1"
+  assert(select(2, pool:wait(0.1)) == "no connection available")
+  pool:release(leased[1])
+  assert(pool:wait(1) ~= nil)
+  pool:close()
+end
+print("TEST 13")
+print(string.rep("-", 40))
+checktest(test13, c, arg[1], 4)
+print(string.rep("=", 40))
+
+-- === fourteenth test ===
+local function test14 (conn)
+  assert(conn:query"SELECT 1 AS slept FROM pg_sleep(0.2)")
+  local ok, e = conn:ready(0.01)
+  assert(not ok and e == "timeout")
+  assert(conn:ready(5))
+  assert(conn:getresult()[1].slept == 1)
+  assert(conn:ready(0)) -- end of results is ready too
+  assert(conn:getresult() == nil)
+  assert(conn:wait("write", 0))
+end
+print("TEST 14")
+print(string.rep("-", 40))
+checktest(test14, c)
+print(string.rep("=", 40))
+
+-- === fifteenth test ===
+local function test15 (conn, conninfo, n)
+  if conn.aexec == nil then return end -- Lua 5.1: see etc/aexec.lua
+  local aexec = require "aexec"
+  local conns, tasks, results = {}, {}, {}
+  for i = 1, n do
+    conns[i] = connect(conninfo)
+    local plan = assert(conns[i]:prepare(
+      "SELECT $1::int4 AS i, pg_sleep(0.1)", "aexec"))
+    tasks[i] = coroutine.create(function ()
+      local r = assert(conns[i]:aexec"SELECT 1 AS one, pg_sleep(0.1)")
+      assert(r:status() == "PGRES_TUPLES_OK" and r[1].one == 1)
+      r = assert(aexec.execplan(conns[i], plan, i))
+      results[i] = r[1].i
+    end)
+  end
+  -- round-robin scheduler: wait briefly on each yielded socket
+  local pending, yields = n, 0
+  local wants = {}
+  while pending > 0 do
+    for i = 1, n do
+      local co = tasks[i]
+      if coroutine.status(co) == "suspended"
+          and (wants[i] == nil or conns[i]:wait(wants[i], 0.01)) then
+        local ok, fd, event = coroutine.resume(co)
+        assert(ok, fd)
+        if coroutine.status(co) == "dead" then
+          pending = pending - 1
+        else
+          assert(fd == conns[i]:socket())
+          assert(event == "read" or event == "write")
+          wants[i], yields = event, yields + 1
+        end
+      end
+    end
+  end
+  assert(yields >= 2 * n) -- each query yielded at least once
+  for i = 1, n do
+    assert(results[i] == i)
+    conns[i]:finish()
+  end
+  -- outside a coroutine
+  assert(not pcall(conn.aexec, conn, "SELECT 1"))
+end
+print("TEST 15")
+print(string.rep("-", 40))
+checktest(test15, c, arg[1], 3)
+print(string.rep("=", 40))
+
+-- === sixteenth test ===
+local function test16 (conninfo, n)
+  local infos = {}
+  for i = 1, n do infos[i] = conninfo end
+  infos[n + 1] = "host=/nonexistent dbname=none connect_timeout=1"
+  local conns, errors = psql.connect_many(infos, 10)
+  for i = 1, n do
+    assert(errors[i] == nil and select(2, conns[i]:status()) == "CONNECTION_OK")
+    assert(conns[i]:exec"SELECT 1 AS one"[1].one == 1)
+    conns[i]:finish()
+  end
+  assert(conns[n + 1] == nil and type(errors[n + 1]) == "string")
+  conns, errors = psql.connect_many({})
+  assert(next(conns) == nil and next(errors) == nil)
+end
+print("TEST 16")
+print(string.rep("-", 40))
+test16(arg[1], 8)
+print(string.rep("=", 40))
+
+-- === seventeenth test ===
+local function test17 (conn, conninfo)
+  local listener = connect(conninfo)
+  local got = {}
+  listener:onnotify("lpq_a", function (payload, channel, pid)
+    assert(channel == "lpq_a" and type(pid) == "number")
+    got[#got + 1] = payload
+  end)
+  assert(listener:exec"LISTEN lpq_a":status() == "PGRES_COMMAND_OK")
+  assert(listener:exec"LISTEN lpq_b":status() == "PGRES_COMMAND_OK")
+  assert(listener:dispatch(0.05) == 0) -- timeout
+  for i = 1, 3 do conn:exec("NOTIFY lpq_a, '" .. i .. "'") end
+  conn:exec"NOTIFY lpq_b, 'unrouted'"
+  local n = 0
+  while n < 3 do n = n + assert(listener:dispatch(5)) end
+  assert(n == 3 and table.concat(got, ",") == "1,2,3")
+  -- unrouted ones are kept for conn:notifies
+  local channel, pid, payload = listener:notifies()
+  while not channel do
+    assert(listener:wait("read", 5) and listener:consume())
+    channel, pid, payload = listener:notifies()
+  end
+  assert(channel == "lpq_b" and payload == "unrouted")
+  assert(listener:notifies() == nil)
+  -- batched
+  local batches = {}
+  local function collect (payloads, channel, pids)
+    assert(#pids == #payloads)
+    batches[#batches + 1] = channel .. ":" .. table.concat(payloads, ",")
+  end
+  listener:onnotify("lpq_a", collect)
+  listener:onnotify("lpq_b", collect)
+  conn:exec"BEGIN"
+  for i = 1, 3 do conn:exec("NOTIFY lpq_a, 'a" .. i .. "'") end
+  conn:exec"NOTIFY lpq_b, 'b1'"
+  conn:exec"COMMIT" -- delivered together
+  n = 0
+  while n < 4 do n = n + assert(listener:dispatch(5, true)) end
+  assert(#batches == 2)
+  assert(batches[1] == "lpq_a:a1,a2,a3" and batches[2] == "lpq_b:b1")
+  listener:onnotify("lpq_a", nil)
+  conn:exec"NOTIFY lpq_a, 'x'"
+  assert(listener:dispatch(0.1) == 0)
+  channel, pid, payload = listener:notifies()
+  assert(channel == "lpq_a" and type(pid) == "number" and payload == "x")
+  listener:finish()
+end
+print("TEST 17")
+print(string.rep("-", 40))
+test17(c, arg[1])
+print(string.rep("=", 40))
+
+-- === eighteenth test ===
+local function test18 (conn)
+  conn:resetstats()
+  local s = conn:stats()
+  assert(s.queries == 0 and s.rows == 0 and s.exectime == 0)
+  local r = conn:exec"SELECT g AS i, 'ab' AS s FROM generate_series(1, 10) g"
+  local t = r:totable()
+  assert(#t == 10)
+  local p = assert(conn:prepare("SELECT $1::int4 + 1 AS j", "stats"))
+  assert(p:exec(41)[1].j == 42)
+  s = conn:stats()
+  assert(s.queries == 2 and s.results == 2 and s.rows == 11)
+  assert(s.bytes == 10 * (4 + 2) + 4) -- binary int4 and text
+  assert(s.parambytes == 4 and s.prepares == 2) -- prepare and describe
+  assert(s.exectime > 0 and s.decodetime >= 0)
+  conn:exec"SELECT repeat('x', 1000) AS x" -- never read
+  assert(conn:stats().bytes == s.bytes and conn:stats().rows == 12)
+  conn:resetstats()
+  assert(conn:stats().queries == 0)
+  r = nil; collectgarbage() -- result sets share counters with conn
+  assert(conn:stats().rows == 0)
+end
+print("TEST 18")
+print(string.rep("-", 40))
+checktest(test18, c)
+print(string.rep("=", 40))
+
+-- === nineteenth test ===
+local function test19 (conn)
+  conn:setlatency(true)
+  local q = "SELECT g AS i FROM generate_series(1, 5) g"
+  for i = 1, 20 do conn:exec(q) end
+  local p = assert(conn:prepare("SELECT $1::int4 AS i", "latency"))
+  for i = 1, 5 do p:exec(i) end
+  for i = 1, 3 do conn:execp("SELECT $1::int4 AS j", i) end
+  local lat = conn:latency()
+  local h = assert(lat[q])
+  assert(h.count == 20 and h.wait.max > 0)
+  assert(h.wait.p50 <= h.wait.p90 and h.wait.p90 <= h.wait.p99)
+  assert(h.wait.p99 <= h.wait.max)
+  local total = 0
+  for _, b in ipairs(h.build.buckets) do total = total + b[2] end
+  assert(total == 20)
+  assert(lat["SELECT $1::int4 AS i"].count == 5)
+  assert(lat["SELECT $1::int4 AS j"].count == 3)
+  conn:resetlatency()
+  assert(next(conn:latency()) == nil)
+  conn:setlatency(true, 2) -- at most two statements
+  for i = 1, 3 do conn:exec("SELECT " .. i) end
+  conn:exec"SELECT 1"
+  lat = conn:latency()
+  assert(lat["SELECT 1"].count == 2 and lat["SELECT 2"].count == 1)
+  assert(lat["SELECT 3"] == nil)
+  conn:resetlatency()
+  conn:setlatency(false)
+  conn:exec(q)
+  assert(next(conn:latency()) == nil)
+  -- slow query hook
+  local slow = {}
+  conn:setslowlog(0.05, function (stmt, nparams, rows, wait, build)
+    slow[#slow + 1] = {stmt, nparams, rows, wait + build}
+  end)
+  conn:exec"SELECT 1"
+  p = assert(conn:prepare("SELECT $1::int4 AS i FROM pg_sleep(0.1)", "slow"))
+  p:exec(1)
+  assert(#slow == 1 and slow[1][1] == "SELECT $1::int4 AS i FROM pg_sleep(0.1)")
+  assert(slow[1][2] == 1 and slow[1][3] == 1 and slow[1][4] >= 0.05)
+  conn:setslowlog()
+  p:exec(1)
+  assert(#slow == 1)
+end
+print("TEST 19")
+print(string.rep("-", 40))
+checktest(test19, c)
+print(string.rep("=", 40))
+
+-- === twentieth test ===
+local function test20 ()
+  local rset = psql.makeresult({23, 25, 701, 1007, 1114},
+    {{1, "a", 0.5, {1, 2}, 946684800}, {2}},
+    {"i", "s", "f", "a", "t"})
+  assert(rset:status() == "PGRES_TUPLES_OK" and #rset == 2)
+  local t = rset:totable()
+  assert(t[1].i == 1 and t[1].s == "a" and t[1].f == 0.5)
+  assert(t[1].a[2] == 2 and t[1].t == 946684800) -- 2000-01-01
+  assert(t[2].i == 2 and t[2].s == nil)
+  assert(psql.makeresult({23}, {})[1] == nil)
+end
+print("TEST 20")
+print(string.rep("-", 40))
+test20()
+print(string.rep("=", 40))
+
+-- === twenty-first test ===
+local function test21 (conn)
+  assert(conn:setviews(16) == 0)
+  local rset = conn:exec[[
+    SELECT repeat('x', 100) || 'yz' AS t, 'short'::text AS s,
+      decode(repeat('00ff', 10), 'hex') AS b, 1 AS i]]
+  local row = rset[1]
+  local v, b = row.t, row.b
+  assert(type(v) == "userdata" and type(row.s) == "string" and row.i == 1)
+  assert(#v == 102 and v:sub(-2) == "yz" and v:sub(1, 3) == "xxx")
+  assert(v:sub(200) == "" and v:tostring() == string.rep("x", 100) .. "yz")
+  assert(#b == 20 and b:sub(1, 2) == "\0\255")
+  local p, n = v:pointer()
+  assert(type(p) == "userdata" and n == 102)
+  rset, row = nil, nil
+  collectgarbage(); collectgarbage()
+  assert(v:tostring():sub(-3) == "xyz") -- view outlives result set
+  -- kept until lua_close, where its anchor may be collected first
+  keepviews = conn:exec"SELECT repeat('x', 100) AS t"
+  assert(type(keepviews[1].t) == "userdata")
+  assert(conn:setviews() == 16)
+  assert(type(conn:exec"SELECT repeat('x', 100) AS t"[1].t) == "string")
+end
+print("TEST 21")
+print(string.rep("-", 40))
+checktest(test21, c)
+print(string.rep("=", 40))
+
+-- === twenty-second test ===
+local function test22 (conn)
+  local int2, point = require"pqtype.int2", require"pqtype.point"
+  local mt = getmetatable(point())
+  assert(type(getmetatable(int2()).__codec) == "userdata")
+  assert(type(mt.__codec) == "userdata")
+  local plan = assert(conn:prepare("SELECT $1::int2 AS i, $2::point AS p," ..
+    " $3::point[] AS a", "codec"))
+  local function check ()
+    local r = plan:exec(int2(-7), point(1, 2), {point(3, 4), nil, n = 2})[1]
+    assert(tostring(r.i) == "-7" and getmetatable(r.p) == mt)
+    assert(tostring(r.p) == tostring(point(1, 2)))
+    assert(tostring(r.a[1]) == tostring(point(3, 4)) and r.a[2] == nil)
+  end
+  check()
+  -- Lua callbacks are used without a codec
+  local codec = mt.__codec
+  mt.__codec = nil
+  local ok, e = pcall(check)
+  mt.__codec = codec
+  assert(ok, e)
+end
+print("TEST 22")
+print(string.rep("-", 40))
+checktest(test22, c)
+print(string.rep("=", 40))
+
+-- === twenty-third test ===
+local function test23 (conn)
+  checkset(conn, conn:exec"CREATE TYPE mood AS ENUM ('sad', 'ok', 'happy')")
+  checkset(conn, conn:exec"CREATE DOMAIN posint AS int CHECK (VALUE > 0)")
+  checkset(conn, conn:exec"CREATE TYPE pair AS (k text, v posint, m mood)")
+  local q = "SELECT 'ok'::mood AS m, 3::posint AS d," ..
+    " ROW('a', 1, 'sad')::pair AS p, ARRAY['happy', NULL]::mood[] AS a," ..
+    " ARRAY[ROW('b', 2, NULL)::pair] AS ps, ROW(1, 'x', NULL) AS r"
+  local r = conn:exec(q)[1]
+  assert(type(r.m) == "userdata" and r.d == 3) -- raw enum without catalog
+  assert(r.r[1] == 1 and r.r[2] == "x" and r.r[3] == nil) -- anonymous record
+  local types = assert(conn:loadtypes())
+  local oid = conn:exec"SELECT 'pair'::regtype::oid AS o"[1].o
+  assert(types[oid].kind == "composite" and types[oid].fields[2] == "v")
+  r = conn:exec(q)[1]
+  assert(r.m == "ok" and r.d == 3)
+  assert(r.p.k == "a" and r.p.v == 1 and r.p.m == "sad")
+  assert(r.a[1] == "happy" and r.a[2] == nil)
+  assert(r.ps[1].k == "b" and r.ps[1].v == 2 and r.ps[1].m == nil)
+  for i, m, d, p in conn:stream(q) do
+    assert(m == "ok" and p.k == "a")
+  end
+  conn:loadtypes(false)
+  assert(type(conn:exec(q)[1].m) == "userdata")
+  checkset(conn, conn:exec"DROP TYPE pair")
+  checkset(conn, conn:exec"DROP DOMAIN posint")
+  checkset(conn, conn:exec"DROP TYPE mood")
+end
+print("TEST 23")
+print(string.rep("-", 40))
+checktest(test23, c)
+print(string.rep("=", 40))
+
+-- === twenty-fourth test ===
+local function test24 (conn)
+  local q = "SELECT -7::int2 AS i2, 1.5::numeric AS n," ..
+    " 123456789.000000000123::numeric AS big, -0.01::numeric AS small," ..
+    " 'NaN'::numeric AS nan, '2000-01-02'::date AS d," ..
+    " '12:30:00.25'::time AS t, 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'::uuid" ..
+    " AS u, '10.1.2.3'::inet AS ip, '10.1.0.0/16'::cidr AS net," ..
+    " '::1/64'::inet AS ip6, '1 mon 2 days 00:00:03.5'::interval AS iv," ..
+    " ARRAY[1.25, NULL]::numeric[] AS na"
+  local r = conn:exec(q)[1]
+  assert(r.i2 == -7 and r.n == 1.5 and r.small == -0.01)
+  assert(math.abs(r.big - 123456789) < 1e-6 and r.nan ~= r.nan)
+  assert(r.d == 946684800 + 86400 and r.t == 12 * 3600 + 30 * 60 + 0.25)
+  assert(r.u == "a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11")
+  assert(r.ip == "10.1.2.3" and r.net == "10.1.0.0/16" and r.ip6 == "::1/64")
+  assert(r.iv.month == 1 and r.iv.day == 2 and r.iv.time == 3.5)
+  assert(r.na[1] == 1.25 and r.na[2] == nil)
+  assert(conn:setnumeric"string" == "number")
+  r = conn:exec(q)[1]
+  assert(r.n == "1.5" and r.big == "123456789.000000000123")
+  assert(r.small == "-0.01" and r.nan == "NaN" and r.na[1] == "1.25")
+  assert(conn:setnumeric"integer" == "string")
+  r = conn:exec("SELECT 42::numeric AS a, 1e20::numeric AS b," ..
+    " 2.5::numeric AS c, -9223372036854775808::numeric AS min")[1]
+  assert(math.type == nil or math.type(r.a) == "integer")
+  assert(r.a == 42 and r.b == 1e20 and r.c == 2.5)
+  assert(math.mininteger == nil or r.min == math.mininteger)
+  -- leading zero digit groups after the decimal point
+  local tiny = {"0.00000005", "0.0000000001", "0.000000051234567891234"}
+  for _, mode in ipairs{"number", "string", "integer"} do
+    conn:setnumeric(mode)
+    r = conn:exec("SELECT 0.00000005::numeric AS a, 1e-10::numeric AS b," ..
+      " 0.000000051234567891234::numeric AS c")[1]
+    for i, k in ipairs{"a", "b", "c"} do
+      if mode == "string" then assert(r[k] == tiny[i])
+      else assert(r[k] == tonumber(tiny[i])) end
+    end
+  end
+  conn:setnumeric"number"
+  -- encoders: round trip through the server's text form
+  local plan = assert(conn:prepare("SELECT $1::int2::text AS i2," ..
+    " $2::numeric::text AS n, $3::date::text AS d, $4::time::text AS t," ..
+    " $5::uuid::text AS u, $6::inet::text AS ip, $7::cidr::text AS net," ..
+    " $8::interval::text AS iv, $9::numeric::text AS n2," ..
+    " $10::numeric[]::text AS na", "encoders"))
+  r = plan:exec(-3, "-12345.678900e2", 946684800 + 2 * 86400, 3661.5,
+    "{A0EEBC99-9C0B-4EF8-BB6D-6BB9BD380A11}", "192.168.0.1/24",
+    "2001:db8::/32", {month = 14, day = 3, time = -1.5}, 0.1,
+    {1, 2.5, "1e-3"})[1]
+  assert(r.i2 == "-3" and r.n == "-1234567.8900" and r.d == "2000-01-03")
+  assert(r.t == "01:01:01.5" and r.u == "a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11")
+  assert(r.ip == "192.168.0.1/24" and r.net == "2001:db8::/32")
+  assert(r.iv == "1 year 2 mons 3 days -00:00:01.5", r.iv)
+  assert(r.n2 == "0.1" and r.na == "{1,2.5,0.001}", r.na)
+  local ok, err = pcall(plan.exec, plan, 70000, 0, 0, 0,
+    "a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11", "10.0.0.1", "10.0.0.0/8",
+    {month = 0, day = 0, time = 0}, 0, {})
+  assert(not ok and err:find"smallint out of range")
+  plan = assert(conn:prepare("SELECT $1::date::text AS d, $2::time::text AS t",
+    "datetime"))
+  r = plan:exec(-0.5, 0)[1]
+  assert(r.d == "1969-12-31" and r.t == "00:00:00")
+  ok, err = pcall(plan.exec, plan, "2024-01-01", 0)
+  assert(not ok and err:find"invalid date value")
+  ok, err = pcall(plan.exec, plan, 0, "10:00:00")
+  assert(not ok and err:find"invalid time value")
+end
+print("TEST 24")
+print(string.rep("-", 40))
+checktest(test24, c)
+print(string.rep("=", 40))
+
+-- === twenty-fifth test ===
+local function test25 (conn)
+  conn:exec"SET TimeZone = 'UTC'"
+  local q = "SELECT '2021-03-04 05:06:07.123456'::timestamp AS t," ..
+    " '2021-03-04 05:06:07.5+02'::timestamptz AS tz," ..
+    " '1969-12-31 23:59:59'::timestamp AS neg, 'infinity'::timestamp AS inf," ..
+    " ARRAY['2000-01-01 00:00:01'::timestamp] AS a"
+  local base = 1614834367 -- 2021-03-04 05:06:07 UTC
+  local r = conn:exec(q)[1]
+  assert(math.abs(r.t - (base + 0.123456)) < 1e-6)
+  assert(r.tz == base - 7200 + 0.5 and r.neg == -1 and r.inf == math.huge)
+  assert(r.a[1] == 946684801)
+  assert(conn:settimestamp"integer" == "number")
+  r = conn:exec(q)[1]
+  assert(r.t == base * 1000000 + 123456 and r.neg == -1000000)
+  assert(r.a[1] == 946684801000000)
+  assert(conn:settimestamp"table" == "integer")
+  r = conn:exec(q)[1]
+  assert(r.t.year == 2021 and r.t.month == 3 and r.t.day == 4)
+  assert(r.t.hour == 5 and r.t.min == 6 and r.t.sec == 7 and r.t.usec == 123456)
+  assert(r.neg.year == 1969 and r.neg.month == 12 and r.neg.day == 31)
+  assert(r.neg.sec == 59 and r.inf == math.huge)
+  conn:settimestamp"number"
+  -- encoders
+  local plan = assert(conn:prepare("SELECT $1::timestamp::text AS a," ..
+    " $2::timestamptz::text AS b, $3::timestamp::text AS c," ..
+    " $4::timestamp::text AS d", "timestamps"))
+  r = plan:exec(base + 0.25, base, {year = 1999, month = 12, day = 31,
+    hour = 23, min = 59, sec = 59, usec = 999999}, -math.huge)[1]
+  assert(r.a == "2021-03-04 05:06:07.25" and r.b == "2021-03-04 05:06:07+00")
+  assert(r.c == "1999-12-31 23:59:59.999999" and r.d == "-infinity")
+  local ok, err = pcall(plan.exec, plan, "2024-01-01 10:00:00", base, base,
+    base)
+  assert(not ok and err:find"invalid timestamp value")
+  ok, err = pcall(plan.exec, plan, base, "2024-01-01 10:00:00+00", base, base)
+  assert(not ok and err:find"invalid timestamp value")
+  conn:exec"RESET TimeZone"
+end
+print("TEST 25")
+print(string.rep("-", 40))
+checktest(test25, c)
+print(string.rep("=", 40))
+
+-- === twenty-sixth test ===
+local function test26 (conn)
+  local r = conn:exec("SELECT int4range(1, 5) AS a, '[2,9]'::int8range AS b," ..
+    " 'empty'::int4range AS e, '(,3.5]'::numrange AS n," ..
+    " daterange('2000-01-01', NULL) AS d," ..
+    " '[2000-01-01 00:00:01.5, 2000-01-02)'::tsrange AS ts," ..
+    " '{[1,3), [5,7)}'::int4multirange AS m," ..
+    " ARRAY[int4range(1, 2), NULL, 'empty'] AS ra")[1]
+  local a, b, n = r.a, r.b, r.n
+  assert(a.lower == 1 and a.upper == 5 and a.lowerinc and not a.upperinc)
+  assert(b.lower == 2 and b.upper == 10 and tostring(b) == "[2,10)") -- canonical
+  assert(r.e.empty and tostring(r.e) == "empty" and not r.e:contains(1))
+  assert(n.lower == nil and n.upper == 3.5 and not n.lowerinc and n.upperinc)
+  assert(r.d.lower == 946684800 and r.d.upper == nil)
+  assert(r.ts.lower == 946684801.5 and r.ts.upper == 946684800 + 86400)
+  assert(#r.m == 2 and r.m[1].lower == 1 and r.m[2].upper == 7)
+  assert(r.ra[1].upper == 2 and r.ra[2] == nil and r.ra[3].empty)
+  -- contains and overlaps
+  assert(a:contains(1) and a:contains(4) and not a:contains(5))
+  assert(not a:contains(0) and n:contains(-1e9) and n:contains(3.5))
+  assert(b:contains(a) == false and b:contains(psql.range(2, 5)))
+  assert(a:contains(r.e) and not r.e:contains(a))
+  assert(a:overlaps(b) and not a:overlaps(psql.range(5, 6)))
+  assert(a:overlaps(psql.range(4, 4, "[]")) and not a:overlaps(r.e))
+  assert(n:overlaps(psql.range(3.5, nil)) and not n:overlaps(psql.range(3.5, nil, "()")))
+  assert(r.d:contains(r.d) and r.d:overlaps(psql.range()))
+  assert(tostring(psql.range(nil, 3, "(]")) == "(,3]")
+  assert(not pcall(psql.range, 1, 2, "[["))
+  -- encoders
+  local plan = assert(conn:prepare("SELECT $1::int4range::text AS a," ..
+    " $2::numrange::text AS n, $3::tstzrange::text AS ts," ..
+    " $4::int8multirange::text AS m, $5::int4range[]::text AS ra," ..
+    " $6::int4range::text AS e, $4::int8multirange @> 8::int8 AS c",
+    "ranges"))
+  conn:exec"SET TimeZone = 'UTC'"
+  r = plan:exec({lower = 1, upper = 3, upperinc = true}, psql.range(nil, 1.25),
+    r.ts, {psql.range(1, 3), {lower = 7, upper = 9}},
+    {psql.range(1, 2), psql.range(nil, 0)}, psql.range(nil, nil, "empty"))[1]
+  assert(r.a == "[1,4)" and r.n == "(,1.25)" and r.m == "{[1,3),[7,9)}")
+  assert(r.ts == '["2000-01-01 00:00:01.5+00","2000-01-02 00:00:00+00")')
+  assert(r.ra == '{"[1,2)","(,0)"}' and r.e == "empty" and r.c == true)
+  -- tables of bounds are elements of range arrays, not subarrays
+  local ra = assert(conn:prepare("SELECT $1::int4range[]::text AS a",
+    "rangearrays"))
+  r = ra:exec{{lower = 1, upper = 3}, {upper = 0, upperinc = true}}[1]
+  assert(r.a == '{"[1,3)","(,1)"}', r.a)
+  r = ra:exec{{{lower = 1, upper = 3}}, {psql.range(5, 6)}}[1]
+  assert(r.a == '{{"[1,3)"},{"[5,6)"}}', r.a)
+  plan = assert(conn:prepare("SELECT $1::int4multirange[]::text AS a",
+    "multiranges"))
+  r = plan:exec{{psql.range(1, 3), {lower = 5, upper = 7}}, {}}[1]
+  assert(r.a == '{"{[1,3),[5,7)}","{}"}', r.a)
+  r = plan:exec{{{psql.range(1, 2)}}, {{}}}[1]
+  assert(r.a == '{{"{[1,2)}"},{"{}"}}', r.a)
+  local ok, err = pcall(plan.exec, plan, {psql.range(1, 2)})
+  assert(not ok and err:find"arrays of ranges")
+  ok, err = pcall(plan.exec, plan, {{lower = 1, upper = 2}})
+  assert(not ok and err:find"arrays of ranges")
+  conn:exec"RESET TimeZone"
+end
+print("TEST 26")
+print(string.rep("-", 40))
+checktest(test26, c)
+print(string.rep("=", 40))